@@ -0,0 +1,303 @@
+#! /usr/bin/python3
+import os
+import argparse
+import sys
+import subprocess
+import json
+import hashlib
+import platform
+import math
+import time
+
+def eprint(message):
+        sys.stderr.write(str(message))
+        sys.stderr.flush()
+
+HISTORY = '.bench-history'
+
+# Metrics of an rmp-bench report, with whether lower is better
+LOAD_METRICS = [
+    ('throughput', lambda report: report['throughput'], False),
+    ('p50', lambda report: report['latency_us']['p50'], True),
+    ('p99', lambda report: report['latency_us']['p99'], True),
+    ('p999', lambda report: report['latency_us']['p999'], True)]
+
+# Argument parsing
+argument_parser = argparse.ArgumentParser(
+    description='Record benchmark results by commit and machine, and '
+        'compare two commits with a Mann-Whitney U test')
+argument_parser.add_argument('--history',default=HISTORY)
+subparsers = argument_parser.add_subparsers(dest='action')
+run_parser = subparsers.add_parser('run')
+run_parser.add_argument('-n','--repetitions',type=int,default=5)
+run_parser.add_argument('command',nargs=argparse.REMAINDER)
+record_parser = subparsers.add_parser('record')
+record_parser.add_argument('results',nargs='+')
+subparsers.add_parser('list')
+compare_parser = subparsers.add_parser('compare')
+compare_parser.add_argument('baseline')
+compare_parser.add_argument('candidate',nargs='?')
+compare_parser.add_argument('--alpha',type=float,default=0.05)
+compare_parser.add_argument('--threshold',type=float,default=0.02)
+
+def git(args):
+    return subprocess.check_output(['git'] + args).decode().strip()
+
+def current_commit():
+    commit = git(['rev-parse','--short=12','HEAD'])
+    if(git(['status','--porcelain','--untracked-files=no']) != ''):
+        commit = commit + '-dirty'
+    return commit
+
+def resolve_commit(name):
+    result = name
+    if(not(name.endswith('-dirty'))):
+        result = git(['rev-parse','--short=12',name])
+    return result
+
+def read_file(path):
+    result = ''
+    if(os.path.exists(path)):
+        with open(path) as source:
+            result = source.read()
+    return result
+
+def machine():
+    # Only what changes the numbers: CPU, core count, memory and kernel
+    model = ''
+    for line in read_file('/proc/cpuinfo').splitlines():
+        if(model == '' and line.startswith('model name')):
+            model = line.split(':',1)[1].strip()
+    memory = ''
+    for line in read_file('/proc/meminfo').splitlines():
+        if(line.startswith('MemTotal')):
+            memory = line.split(':',1)[1].strip()
+    return {
+        'cpu': model or platform.processor(),
+        'cores': os.cpu_count(),
+        'memory': memory,
+        'system': platform.system() + ' ' + platform.release(),
+        'machine': platform.machine()}
+
+def fingerprint(description):
+    text = json.dumps(description,sort_keys=True)
+    return hashlib.sha1(text.encode()).hexdigest()[:12]
+
+def store(history, result, command):
+    description = machine()
+    directory = os.path.join(
+        history,
+        fingerprint(description),
+        current_commit())
+    os.makedirs(directory,exist_ok=True)
+    path = os.path.join(
+        directory,
+        str(time.time_ns()) + '.json')
+    with open(path,'w') as target:
+        json.dump({
+            'commit': current_commit(),
+            'machine': description,
+            'command': command,
+            'timestamp': time.time(),
+            'result': result},target,indent=2)
+    return path
+
+def samples(history, commit):
+    # Every repetition of every recorded run is one sample per benchmark
+    result = {}
+    directory = os.path.join(history,fingerprint(machine()),commit)
+    paths = []
+    if(os.path.isdir(directory)):
+        paths = sorted(os.listdir(directory))
+    for path in paths:
+        with open(os.path.join(directory,path)) as source:
+            report = json.load(source)['result']
+        for name, value, lower in metrics(report):
+            result.setdefault(name,([],lower))[0].append(value)
+    return result
+
+def metrics(report):
+    result = []
+    if('benchmarks' in report):
+        for benchmark in report['benchmarks']:
+            if(benchmark.get('run_type','iteration') == 'iteration'):
+                result.append((
+                    benchmark['name'],
+                    benchmark['cpu_time'],
+                    True))
+    elif('latency_us' in report):
+        prefix = 'rmp-bench/' + report['mode'] + '/'
+        for name, value, lower in LOAD_METRICS:
+            result.append((prefix + name,value(report),lower))
+    else:
+        raise ValueError('not a bench or rmp-bench report')
+    return result
+
+def ranks(values):
+    # Average ranks for ties, and the tie correction sum of t^3 - t
+    order = sorted(range(len(values)),key=lambda index: values[index])
+    result = [0.0] * len(values)
+    ties = 0.0
+    start = 0
+    while(start < len(order)):
+        end = start
+        while(end + 1 < len(order)
+            and values[order[end + 1]] == values[order[start]]):
+            end = end + 1
+        for index in range(start,end + 1):
+            result[order[index]] = (start + end) / 2.0 + 1.0
+        count = end - start + 1
+        ties = ties + count ** 3 - count
+        start = end + 1
+    return result, ties
+
+def arrangements(first, second):
+    # counts[u] is the number of orderings of the two samples with U = u
+    counts = [[[1] for _ in range(second + 1)] for _ in range(first + 1)]
+    for m in range(1,first + 1):
+        for n in range(1,second + 1):
+            size = m * n + 1
+            total = [0] * size
+            for u, count in enumerate(counts[m - 1][n]):
+                total[u + n] = total[u + n] + count
+            for u, count in enumerate(counts[m][n - 1]):
+                total[u] = total[u] + count
+            counts[m][n] = total
+    return counts[first][second]
+
+def mann_whitney(baseline, candidate):
+    # Two sided p-value, exact for small samples without ties
+    first = len(baseline)
+    second = len(candidate)
+    total = first + second
+    rank, ties = ranks(baseline + candidate)
+    u = sum(rank[:first]) - first * (first + 1) / 2.0
+    smallest = min(u,first * second - u)
+    if(ties == 0 and total <= 40):
+        counts = arrangements(first,second)
+        tail = sum(counts[:int(smallest) + 1])
+        result = min(1.0,2.0 * tail / math.comb(total,first))
+    else:
+        mean = first * second / 2.0
+        variance = first * second / 12.0 * (
+            (total + 1) - ties / (total * (total - 1)))
+        result = 1.0
+        if(variance > 0):
+            z = max(0.0,abs(u - mean) - 0.5) / math.sqrt(variance)
+            result = math.erfc(z / math.sqrt(2.0))
+    return result
+
+def median(values):
+    ordered = sorted(values)
+    middle = len(ordered) // 2
+    return (ordered[middle] if len(ordered) % 2 == 1
+        else (ordered[middle - 1] + ordered[middle]) / 2.0)
+
+def verdict(baseline, candidate, lower, alpha, threshold):
+    change = 0.0
+    if(median(baseline) != 0):
+        change = (median(candidate) - median(baseline)) / median(baseline)
+    p = mann_whitney(baseline,candidate)
+    # The smallest p-value these sample sizes can reach at all
+    smallest = 2.0 / math.comb(
+        len(baseline) + len(candidate),
+        len(baseline))
+    if(smallest > alpha):
+        result = 'too few runs'
+    elif(p >= alpha or abs(change) < threshold):
+        result = 'unchanged'
+    elif((change > 0) == lower):
+        result = 'REGRESSION'
+    else:
+        result = 'improvement'
+    return change, p, result
+
+def run_main(args):
+    command = [argument for argument in args.command if argument != '--']
+    for repetition in range(args.repetitions):
+        eprint('run ' + str(repetition + 1) + '/'
+            + str(args.repetitions) + '...\n')
+        output = subprocess.check_output(command)
+        print(store(args.history,json.loads(output),command))
+    return 0
+
+def record_main(args):
+    for path in args.results:
+        with open(path) as source:
+            print(store(args.history,json.load(source),[path]))
+    return 0
+
+def list_main(args):
+    directory = os.path.join(args.history,fingerprint(machine()))
+    print('machine ' + fingerprint(machine()) + ' '
+        + json.dumps(machine(),sort_keys=True))
+    commits = []
+    if(os.path.isdir(directory)):
+        commits = sorted(
+            os.listdir(directory),
+            key=lambda commit: os.path.getmtime(
+                os.path.join(directory,commit)))
+    for commit in commits:
+        print(commit + ' '
+            + str(len(os.listdir(os.path.join(directory,commit))))
+            + ' runs')
+    return 0
+
+def compare_main(args):
+    result = 0
+    baseline_commit = resolve_commit(args.baseline)
+    candidate_commit = current_commit()
+    if(args.candidate is not None):
+        candidate_commit = resolve_commit(args.candidate)
+    baseline = samples(args.history,baseline_commit)
+    candidate = samples(args.history,candidate_commit)
+    print('baseline ' + baseline_commit + ', candidate ' + candidate_commit
+        + ', machine ' + fingerprint(machine()))
+    print('%-48s %12s %12s %8s %8s  %s' % (
+        'benchmark','baseline','candidate','change','p','verdict'))
+    for name in sorted(set(baseline) & set(candidate)):
+        change, p, outcome = verdict(
+            baseline[name][0],
+            candidate[name][0],
+            baseline[name][1],
+            args.alpha,
+            args.threshold)
+        print('%-48s %12.1f %12.1f %+7.1f%% %8.4f  %s (%d vs %d runs)' % (
+            name,
+            median(baseline[name][0]),
+            median(candidate[name][0]),
+            change * 100.0,
+            p,
+            outcome,
+            len(baseline[name][0]),
+            len(candidate[name][0])))
+        if(outcome == 'REGRESSION'):
+            result = 1
+    for name in sorted(set(baseline) ^ set(candidate)):
+        print('%-48s only in %s' % (
+            name,
+            baseline_commit if name in baseline else candidate_commit))
+    return result
+
+def bench_main():
+    args = argument_parser.parse_args()
+    actions = {
+        'run': run_main,
+        'record': record_main,
+        'list': list_main,
+        'compare': compare_main}
+    if(args.action is None):
+        argument_parser.print_help()
+        result = 1
+    else:
+        result = actions[args.action](args)
+    return result
+
+if __name__ == '__main__':
+    result = 0
+    try:
+        result = bench_main()
+    except Exception:
+        result = 2
+        eprint(str(sys.exc_info()[1]) + '\n')
+    sys.exit(result)
\ No newline at end of file
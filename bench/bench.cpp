@@ -0,0 +1,339 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#include <benchmark/benchmark.h>
+
+static std::string make_email(size_t length);
+
+static void fill_bucket(rmp::bucket& bucket, int records);
+
+static void fill_record(rmp::record& record, int index);
+
+static void fill_table(
+    rmp::record_table& table, 
+    std::vector<std::string>& emails, 
+    int records);
+
+// Shared by the threads of one contended benchmark run
+static rmp::record_table * hot_table = nullptr;
+
+// Keys every reader of the contended benchmark keeps hitting
+const int HOT_KEYS = 16;
+
+// Lookups per call of the batch find benchmark
+const size_t BATCH_SIZE = 64;
+
+static void djb_hash_benchmark(benchmark::State& state)
+{
+    std::string email = make_email(state.range(0));
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(rmp::djb_hash(email));
+    }
+    state.SetBytesProcessed(state.iterations() * email.size());
+}
+BENCHMARK(djb_hash_benchmark)->RangeMultiplier(4)->Range(16,1024);
+
+static void find_record_hit_benchmark(benchmark::State& state)
+{
+    rmp::bucket bucket;
+    std::string email;
+    fill_bucket(bucket,state.range(0));
+    // The last record is the worst case for the linear scan
+    email = bucket.records(bucket.records_size() - 1).email();
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(rmp::find_record(bucket,email));
+    }
+    state.SetItemsProcessed(state.iterations() * bucket.records_size());
+}
+BENCHMARK(find_record_hit_benchmark)->RangeMultiplier(10)->Range(1,10000);
+
+static void find_record_miss_benchmark(benchmark::State& state)
+{
+    rmp::bucket bucket;
+    std::string email = make_email(20);
+    fill_bucket(bucket,state.range(0));
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(rmp::find_record(bucket,email));
+    }
+    state.SetItemsProcessed(state.iterations() * bucket.records_size());
+}
+BENCHMARK(find_record_miss_benchmark)->RangeMultiplier(10)->Range(1,10000);
+
+static void record_table_find_benchmark(benchmark::State& state)
+{
+    rmp::record_table table;
+    std::vector<std::string> emails;
+    std::string record;
+    size_t index = 0;
+    // Same records as the find_record benchmarks, one lookup each
+    fill_table(table,emails,state.range(0));
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(
+            table.find(emails[index++ % emails.size()], record));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(record_table_find_benchmark)->RangeMultiplier(10)->Range(1,10000);
+
+static void record_table_batch_find_benchmark(benchmark::State& state)
+{
+    rmp::record_table table;
+    std::vector<std::string> emails, batch, records;
+    std::vector<bool> found;
+    fill_table(table,emails,state.range(0));
+    for(size_t index = 0; index < BATCH_SIZE; index++)
+    {
+        batch.push_back(emails[(index * 7) % emails.size()]);
+    }
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(table.find(batch, records, found));
+    }
+    state.SetItemsProcessed(state.iterations() * batch.size());
+}
+BENCHMARK(record_table_batch_find_benchmark)
+    ->RangeMultiplier(10)
+    ->Range(1,10000);
+
+static void record_table_hot_read_benchmark(benchmark::State& state)
+{
+    std::string record;
+    std::vector<std::string> emails;
+    size_t index = 0;
+    for(int key = 0; key < HOT_KEYS; key++)
+    {
+        emails.push_back(make_email(20 + key));
+    }
+    // The first thread builds the table before the threads line up and
+    // keeps updating the hot keys while the others read them
+    if(state.thread_index() == 0)
+    {
+        hot_table = new rmp::record_table();
+        for(const std::string& email : emails)
+        {
+            hot_table->insert(email, "0");
+        }
+    }
+    for(auto _ : state)
+    {
+        if(state.thread_index() == 0)
+        {
+            hot_table->update(
+                emails[index % emails.size()], 
+                std::to_string(index));
+        }
+        else
+        {
+            benchmark::DoNotOptimize(
+                hot_table->find(emails[index % emails.size()], record));
+        }
+        index++;
+    }
+    if(state.thread_index() == 0)
+    {
+        state.counters["updates"] = static_cast<double>(index);
+        delete hot_table;
+        hot_table = nullptr;
+    }
+    else
+    {
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+BENCHMARK(record_table_hot_read_benchmark)->ThreadRange(2,8)->UseRealTime();
+
+static void bucket_parse_benchmark(benchmark::State& state)
+{
+    rmp::bucket bucket;
+    std::string serialized;
+    rmp::request_arena arena;
+    rmp::bucket * parsed;
+    fill_bucket(bucket,state.range(0));
+    bucket.SerializeToString(&serialized);
+    // Parsed into a request arena the way the server loads buckets
+    for(auto _ : state)
+    {
+        parsed = google::protobuf::Arena::CreateMessage<rmp::bucket>(
+            arena.get());
+        benchmark::DoNotOptimize(
+            parsed->ParseFromArray(
+                serialized.data(),
+                static_cast<int>(serialized.size())));
+        arena.reset();
+    }
+    state.SetBytesProcessed(state.iterations() * serialized.size());
+}
+BENCHMARK(bucket_parse_benchmark)->RangeMultiplier(10)->Range(1,10000);
+
+static void bucket_serialize_benchmark(benchmark::State& state)
+{
+    rmp::bucket bucket;
+    std::vector<uint8_t> buffer;
+    size_t size = 0;
+    fill_bucket(bucket,state.range(0));
+    buffer.resize(bucket.ByteSizeLong());
+    for(auto _ : state)
+    {
+        size = bucket.ByteSizeLong();
+        bucket.SerializeWithCachedSizesToArray(buffer.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(bucket_serialize_benchmark)->RangeMultiplier(10)->Range(1,10000);
+
+static void request_encode_benchmark(benchmark::State& state)
+{
+    rmp::request request;
+    std::string output;
+    request.set_command(rmp::command_codes::CREATE_RECORD);
+    fill_record(*request.mutable_payload(),0);
+    for(auto _ : state)
+    {
+        request.SerializeToString(&output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * output.size());
+}
+BENCHMARK(request_encode_benchmark);
+
+static void request_decode_benchmark(benchmark::State& state)
+{
+    rmp::request request;
+    std::string input;
+    rmp::request_arena arena;
+    rmp::request * parsed;
+    request.set_command(rmp::command_codes::CREATE_RECORD);
+    fill_record(*request.mutable_payload(),0);
+    request.SerializeToString(&input);
+    for(auto _ : state)
+    {
+        parsed = google::protobuf::Arena::CreateMessage<rmp::request>(
+            arena.get());
+        benchmark::DoNotOptimize(
+            parsed->ParseFromArray(
+                input.data(),
+                static_cast<int>(input.size())));
+        arena.reset();
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(request_decode_benchmark);
+
+static void response_encode_benchmark(benchmark::State& state)
+{
+    rmp::response response;
+    rmp::record record;
+    std::string output;
+    fill_record(record,0);
+    response.set_status(rmp::status_codes::GOOD);
+    response.set_payload(record.SerializeAsString());
+    for(auto _ : state)
+    {
+        response.SerializeToString(&output);
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * output.size());
+}
+BENCHMARK(response_encode_benchmark);
+
+static void response_decode_benchmark(benchmark::State& state)
+{
+    rmp::response response;
+    rmp::record record;
+    std::string input;
+    fill_record(record,0);
+    response.set_status(rmp::status_codes::GOOD);
+    response.set_payload(record.SerializeAsString());
+    response.SerializeToString(&input);
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(
+            response.ParseFromArray(
+                input.data(),
+                static_cast<int>(input.size())));
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(response_decode_benchmark);
+
+int main(int argc, char ** argv)
+{
+    // JSON unless the caller picks a format, so runs can be compared
+    std::vector<char*> arguments(argv,argv + argc);
+    char format[] = "--benchmark_format=json";
+    int count;
+    arguments.insert(arguments.begin() + 1,format);
+    count = static_cast<int>(arguments.size());
+    benchmark::Initialize(&count,arguments.data());
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
+
+static std::string make_email(size_t length)
+{
+    std::string domain = "@example.com";
+    std::string result;
+    while(result.size() + domain.size() < length)
+    {
+        result.push_back('a' + (result.size() % 26));
+    }
+    return result + domain;
+}
+
+static void fill_bucket(rmp::bucket& bucket, int records)
+{
+    for(int index = 0; index < records; index++)
+    {
+        fill_record(*bucket.add_records(),index);
+    }
+}
+
+static void fill_record(rmp::record& record, int index)
+{
+    record.set_email("user" + std::to_string(index) + "@example.com");
+    record.mutable_contact()->set_name("John");
+    record.mutable_contact()->set_phone("0000000000");
+}
+
+static void fill_table(
+    rmp::record_table& table, 
+    std::vector<std::string>& emails, 
+    int records)
+{
+    rmp::record record;
+    for(int index = 0; index < records; index++)
+    {
+        fill_record(record,index);
+        table.insert(record.email(), record.SerializeAsString());
+        emails.push_back(record.email());
+    }
+}
\ No newline at end of file
@@ -23,14 +23,20 @@
  * 
  *******************************************************************/
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <set>
 #include <sstream>
 #include <string>
@@ -58,16 +64,1385 @@
 #include <arpa/inet.h> 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #endif
 #include "rmp.pb.h"
 
+// USDT probes for bpftrace and perf, built with -DRMP_USDT=ON. Each probe
+// is a nop until a tracer attaches, and nothing at all without the option
+#if defined(RMP_USDT)
+#include <sys/sdt.h>
+#define RMP_PROBE(name, ...) STAP_PROBEV(rmp, name, __VA_ARGS__)
+#else
+#define RMP_PROBE(name, ...) do {} while(0)
+#endif
+
 namespace rmp
 {
     std::string djb_hash(const std::string& data);
 
+    int find_record(const bucket& bucket, const std::string& email);
+
+    enum io_modes
+    {
+        BUFFERED_IO = 0,
+        DIRECT_IO = 1
+    };
+
+    enum network_engines
+    {
+        UV_ENGINE = 0,
+        EPOLL_ENGINE = 1
+    };
+
+    struct numa_metrics
+    {
+        bool available = false;
+        uint64_t local = 0;
+        uint64_t remote = 0;
+    };
+
+    class numa
+    {
+    public:
+        static std::vector<int> parse_cpus(const std::string& list);
+
+        static int node_of_cpu(int cpu);
+
+        static bool allowed(int cpu);
+
+        static void pin_thread(int cpu);
+
+        static void bind(void * address, size_t size, int node);
+
+        static void track_thread();
+
+        static numa_metrics metrics();
+    };
+
+    class aligned_allocator
+    {
+    public:
+        aligned_allocator(size_t alignment = 4096);
+
+        ~aligned_allocator();
+
+        void * allocate(size_t size);
+
+        void deallocate(void * block, size_t size);
+
+        size_t round_up(size_t size) const;
+
+        size_t alignment() const;
+
+        size_t allocated() const;
+
+        void set_node(int node);
+
+    private:
+        size_t _alignment;
+        int _node;
+        std::atomic<size_t> _allocated;
+        std::mutex _free_blocks_mutex;
+        std::unordered_map<size_t,std::vector<void*>> _free_blocks;
+    };
+
+    class aligned_buffer
+    {
+    public:
+        aligned_buffer(aligned_allocator& allocator, size_t capacity);
+
+        aligned_buffer(const aligned_buffer&) = delete;
+
+        aligned_buffer& operator=(const aligned_buffer&) = delete;
+
+        ~aligned_buffer();
+
+        char * data();
+
+        const char * data() const;
+
+        size_t capacity() const;
+
+        size_t size() const;
+
+        void resize(size_t size);
+
+    private:
+        aligned_allocator& _allocator;
+        char * _data;
+        size_t _capacity;
+        size_t _size;
+    };
+
+    class page_cache
+    {
+    public:
+        page_cache(size_t capacity = 0);
+
+        page_cache(const page_cache&) = delete;
+
+        page_cache& operator=(const page_cache&) = delete;
+
+        ~page_cache();
+
+        std::shared_ptr<const aligned_buffer> find(const std::string& hash);
+
+        void insert(
+            const std::string& hash, 
+            std::shared_ptr<const aligned_buffer> buffer);
+
+        void erase(const std::string& hash);
+
+        size_t shrink(size_t target);
+
+        void set_capacity(size_t capacity);
+
+        size_t capacity() const;
+
+        size_t size() const;
+
+        uint64_t hits() const;
+
+        uint64_t misses() const;
+
+    private:
+        typedef std::list<std::pair<std::string,
+            std::shared_ptr<const aligned_buffer>>> entry_list;
+
+        mutable std::mutex _mutex;
+        entry_list _entries;
+        std::unordered_map<std::string,entry_list::iterator> _index;
+        size_t _capacity;
+        size_t _size;
+        uint64_t _hits;
+        uint64_t _misses;
+    };
+
+    class file_descriptor
+    {
+    public:
+        file_descriptor(int fd);
+
+        file_descriptor(const file_descriptor&) = delete;
+
+        file_descriptor& operator=(const file_descriptor&) = delete;
+
+        ~file_descriptor();
+
+        int get() const;
+
+    private:
+        int _fd;
+    };
+
+    class descriptor_cache
+    {
+    public:
+        descriptor_cache(size_t capacity = 0);
+
+        ~descriptor_cache();
+
+        void open(
+            const std::string& directory, 
+            int flags, 
+            bool use_openat);
+
+        std::shared_ptr<file_descriptor> acquire(
+            const std::string& hash, 
+            const std::string& path, 
+            bool create);
+
+        void erase(const std::string& hash);
+
+        void clear();
+
+        void set_capacity(size_t capacity);
+
+        size_t capacity() const;
+
+        size_t size() const;
+
+    private:
+        typedef std::list<std::pair<std::string,
+            std::shared_ptr<file_descriptor>>> entry_list;
+
+        int open_file(const std::string& path, bool create) const;
+
+        void evict();
+
+        mutable std::mutex _mutex;
+        entry_list _entries;
+        std::unordered_map<std::string,entry_list::iterator> _index;
+        size_t _capacity;
+        std::string _directory;
+        int _directory_fd;
+        int _flags;
+    };
+
+    class bucket_layout
+    {
+    public:
+        bucket_layout(size_t levels = 0, size_t width = 2);
+
+        static bucket_layout parse(const std::string& name);
+
+        static bucket_layout load(const std::string& root_directory);
+
+        static bool is_bucket_name(const std::string& name);
+
+        void save(const std::string& root_directory) const;
+
+        std::string name() const;
+
+        std::string path(const std::string& hash) const;
+
+        bool flat() const;
+
+        void create_parents(
+            const std::string& root_directory, 
+            const std::string& hash) const;
+
+        void create_directories(
+            const std::string& root_directory, 
+            size_t threads) const;
+
+    private:
+        size_t _levels;
+        size_t _width;
+    };
+
+    class layout_migrator
+    {
+    public:
+        layout_migrator(
+            const std::string& root_directory,
+            const bucket_layout& layout,
+            size_t threads);
+
+        ~layout_migrator();
+
+        void start(std::function<void(bool complete)> on_finish);
+
+        void stop();
+
+        bool done() const;
+
+        uint64_t moved() const;
+
+        uint64_t failed() const;
+
+    private:
+        void scan();
+
+        void move();
+
+        std::string _root_directory;
+        bucket_layout _layout;
+        size_t _threads;
+        std::function<void(bool complete)> _on_finish;
+        std::vector<std::thread> _workers;
+        std::thread _scanner;
+        std::mutex _queue_mutex;
+        std::condition_variable _queue_ready;
+        std::condition_variable _queue_drained;
+        std::deque<std::string> _queue;
+        size_t _busy;
+        std::atomic<bool> _stopping;
+        std::atomic<bool> _done;
+        std::atomic<uint64_t> _moved;
+        std::atomic<uint64_t> _failed;
+    };
+
+    class bucket_store
+    {
+    public:
+        bucket_store();
+
+        void set_root_directory(const std::string& root_directory);
+
+        void set_io_mode(io_modes io_mode);
+
+        void set_cache_capacity(size_t capacity);
+
+        void set_readahead(size_t readahead);
+
+        void set_descriptor_capacity(size_t capacity);
+
+        void set_openat(bool use_openat);
+
+        void set_layout(const bucket_layout& layout);
+
+        void set_migration_threads(size_t threads);
+
+        void set_partition(const bucket_store& parent, size_t partitions);
+
+        void set_numa_node(int node);
+
+        void open();
+
+        bool migrating() const;
+
+        bool migration_failed() const;
+
+        void scan(
+            std::function<void(
+                const std::string& hash, 
+                bucket& bucket)> callback,
+            std::function<bool(const std::string& hash)> filter = nullptr);
+
+        void load(
+            const std::string& hash, 
+            bucket& bucket);
+
+        void store(
+            const std::string& hash, 
+            const bucket& bucket);
+
+        page_cache& cache();
+
+    private:
+        std::shared_ptr<aligned_buffer> read_bucket(int fd);
+
+        void write_bucket(int fd, const aligned_buffer& buffer);
+
+        std::shared_ptr<file_descriptor> open_bucket(
+            const std::string& hash, 
+            bool create);
+
+        std::string _root_directory;
+        io_modes _io_mode;
+        size_t _readahead;
+        bool _use_openat;
+        bucket_layout _layout;
+        size_t _migration_threads;
+        std::atomic<bool> _migrating;
+        std::atomic<bool> _migration_failed;
+        std::unique_ptr<layout_migrator> _migrator;
+        aligned_allocator _allocator;
+        page_cache _cache;
+        descriptor_cache _descriptors;
+    };
+
+    class epoch
+    {
+    public:
+        static void enter();
+
+        static void exit();
+
+        template<class T> static void retire(T * object)
+        {
+            retire(object, [](void * retired)
+            {
+                delete reinterpret_cast<T*>(retired);
+            });
+        }
+
+        static void retire(void * object, void (*deleter)(void*));
+
+        static size_t collect();
+
+        static uint64_t current();
+    };
+
+    class epoch_guard
+    {
+    public:
+        epoch_guard();
+
+        epoch_guard(const epoch_guard&) = delete;
+
+        epoch_guard& operator=(const epoch_guard&) = delete;
+
+        ~epoch_guard();
+    };
+
+    class record_table
+    {
+    public:
+        class snapshot
+        {
+        public:
+            snapshot(record_table& table);
+
+            snapshot(const snapshot&) = delete;
+
+            snapshot& operator=(const snapshot&) = delete;
+
+            ~snapshot();
+
+            uint64_t version() const;
+
+        private:
+            record_table& _table;
+            uint64_t _version;
+        };
+
+        record_table(size_t capacity = 0);
+
+        record_table(const record_table&) = delete;
+
+        record_table& operator=(const record_table&) = delete;
+
+        ~record_table();
+
+        bool find(const std::string& email, std::string& record) const;
+
+        size_t find(
+            const std::vector<std::string>& emails, 
+            std::vector<std::string>& records,
+            std::vector<bool>& found) const;
+
+        bool find(
+            const std::string& email, 
+            std::string& record, 
+            const snapshot& snapshot) const;
+
+        size_t scan(
+            const snapshot& snapshot,
+            const std::function<void(
+                const std::string&, 
+                const std::string&)>& callback) const;
+
+        bool insert(const std::string& email, const std::string& record);
+
+        bool update(const std::string& email, const std::string& record);
+
+        bool erase(const std::string& email);
+
+        size_t size() const;
+
+        size_t capacity() const;
+
+        uint64_t committed() const;
+
+        size_t snapshots() const;
+
+    private:
+        struct version;
+
+        struct slot;
+
+        struct generation;
+
+        static size_t lookup(
+            const generation& table, 
+            const std::string& email, 
+            uint64_t hash);
+
+        static size_t free_slot(const generation& table, uint64_t hash);
+
+        static void store_key(
+            generation& table, 
+            slot& slot, 
+            const char * email, 
+            size_t size);
+
+        static const version * visible(
+            const version * head, 
+            uint64_t snapshot);
+
+        void publish(generation& table, size_t index, version * next);
+
+        void prune(generation& table, size_t index, uint64_t oldest);
+
+        void release(uint64_t version);
+
+        uint64_t oldest_snapshot() const;
+
+        static void delete_chain(void * head);
+
+        void rehash(size_t capacity);
+
+        std::mutex _mutex;
+        std::atomic<generation*> _table;
+        std::atomic<size_t> _size;
+        std::atomic<uint64_t> _version;
+        mutable std::mutex _snapshots_mutex;
+        std::multiset<uint64_t> _snapshots;
+    };
+
+    struct store_operation
+    {
+        command_codes command;
+        record data;
+        bool succeeded = false;
+    };
+
+    // Bucket hashes tracked by a lock profile, the report shows the most
+    // contended of them
+    const size_t LOCK_PROFILE_ENTRIES = 64;
+    const size_t LOCK_REPORT_ENTRIES = 16;
+
+    struct lock_contention
+    {
+        std::string hash;
+        uint64_t contentions = 0;
+        uint64_t error = 0;
+        uint64_t wait_total = 0;
+        uint64_t wait_max = 0;
+        uint64_t hold_total = 0;
+        uint64_t holds = 0;
+    };
+
+    // Space-Saving summary of contended bucket locks. When every entry is
+    // taken, a new hash replaces the least contended one and inherits its
+    // count, which then bounds how far the new count may be overestimated
+    class lock_profile
+    {
+    public:
+        void contended(const std::string& hash, uint64_t wait);
+
+        void held(const std::string& hash, uint64_t hold);
+
+        std::vector<lock_contention> top(size_t count) const;
+
+        std::string report() const;
+
+    private:
+        std::vector<lock_contention> _entries;
+        std::unordered_map<std::string,size_t> _index;
+    };
+
+    // The records behind the server, usable in process without it. Calls
+    // are safe from any thread; a store only ever used by one thread can 
+    // turn the bucket locks off
+    class store
+    {
+    public:
+        store();
+
+        explicit store(const std::string& root_directory);
+
+        void set_root_directory(const std::string& root_directory);
+
+        void set_io_mode(io_modes io_mode);
+
+        void set_cache_capacity(size_t capacity);
+
+        void set_readahead(size_t readahead);
+
+        void set_descriptor_capacity(size_t capacity);
+
+        void set_openat(bool use_openat);
+
+        void set_layout(const bucket_layout& layout);
+
+        void set_migration_threads(size_t threads);
+
+        void set_memory_tier(bool memory_tier);
+
+        void set_locking(bool locking);
+
+        void set_partition(const store& parent, size_t partitions);
+
+        void set_numa_node(int node);
+
+        void set_lock_threshold(uint64_t milliseconds);
+
+        bool memory_tier() const;
+
+        void open();
+
+        void load(
+            std::function<bool(const std::string& hash)> filter = nullptr);
+
+        bool migrating() const;
+
+        bool migration_failed() const;
+
+        bool create_record(record& record);
+
+        bool read_record(const std::string& email, record& record);
+
+        bool read_record(
+            const std::string& email, 
+            std::string& serialized, 
+            google::protobuf::Arena * arena = nullptr);
+
+        bool update_record(record& record);
+
+        bool delete_record(const std::string& email);
+
+        void execute(std::vector<store_operation>& batch);
+
+        size_t scan(std::function<void(
+            const std::string& email, 
+            const std::string& record)> callback);
+
+        std::string lock_report();
+
+    private:
+        class bucket_guard
+        {
+        public:
+            bucket_guard(
+                store& store, 
+                const std::string& hash, 
+                const char * operation,
+                const std::string& email,
+                bool enabled = true);
+
+            ~bucket_guard();
+
+        private:
+            store& _store;
+            const std::string& _hash;
+            bool _enabled;
+            uint64_t _acquired;
+        };
+
+        uint64_t aquire_lock(
+            const std::string& hash, 
+            const char * operation, 
+            const std::string& email);
+
+        void release_lock(const std::string& hash, uint64_t acquired);
+
+        bool apply(bucket& bucket, store_operation& operation);
+
+        bucket_store _buckets;
+        record_table _records;
+        bool _memory_tier;
+        bool _locking;
+        uint64_t _lock_threshold;
+        std::unordered_map<std::string,const char*> _thread_locks;
+        std::mutex _thread_locks_mutex;
+        std::condition_variable _thread_locks_released;
+        lock_profile _lock_profile;
+    };
+
+    enum memory_subsystems
+    {
+        MEMORY_CACHE = 0,
+        MEMORY_CONNECTIONS = 1,
+        MEMORY_MESSAGES = 2,
+        MEMORY_QUEUES = 3,
+        MEMORY_INDEX = 4
+    };
+
+    const size_t MEMORY_SUBSYSTEMS = 5;
+
+    struct thread_statistics;
+
+    // Memory is counted on the thread that allocates or frees it, so one
+    // thread's count may wrap below zero while the sum stays right. Over
+    // the limit, caches are asked to give back the excess first and new
+    // connections are refused while that is not enough
+    class statistics
+    {
+    public:
+        static thread_statistics& local();
+
+        static void add(std::atomic<uint64_t>& counter, uint64_t value);
+
+        static void allocate(memory_subsystems subsystem, uint64_t bytes);
+
+        static void release(memory_subsystems subsystem, uint64_t bytes);
+
+        static uint64_t memory(memory_subsystems subsystem);
+
+        static uint64_t memory();
+
+        static void set_memory_limit(uint64_t bytes);
+
+        static bool over_limit();
+
+        static void add_reclaimer(
+            const void * owner, 
+            std::function<uint64_t(uint64_t excess)> reclaim);
+
+        static void remove_reclaimer(const void * owner);
+
+        static std::string report();
+    };
+
+    // Padding between indices written by different threads, C++14 does
+    // not honour alignas on heap allocations
+    const size_t CACHE_LINE_SIZE = 64;
+
+    // Bounded ring for exactly one producer and one consumer thread. Each
+    // side caches the other's index and only reloads it when the ring
+    // looks full or empty
+    template<class T> class spsc_queue
+    {
+    public:
+        spsc_queue(size_t capacity) :
+            _head(0),
+            _tail_cache(0),
+            _tail(0),
+            _head_cache(0)
+        {
+            size_t size = 1;
+            while(size < capacity)
+            {
+                size <<= 1;
+            }
+            _buffer.resize(size);
+            _mask = size - 1;
+            statistics::allocate(MEMORY_QUEUES, size * sizeof(T));
+        }
+
+        spsc_queue(const spsc_queue&) = delete;
+
+        spsc_queue& operator=(const spsc_queue&) = delete;
+
+        ~spsc_queue()
+        {
+            statistics::release(MEMORY_QUEUES, _buffer.size() * sizeof(T));
+        }
+
+        bool push(const T& value)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            bool result = (tail - _head_cache < _buffer.size());
+            if(!result)
+            {
+                _head_cache = _head.load(std::memory_order_acquire);
+                result = (tail - _head_cache < _buffer.size());
+            }
+            if(result)
+            {
+                _buffer[tail & _mask] = value;
+                _tail.store(tail + 1, std::memory_order_release);
+            }
+            return result;
+        }
+
+        bool pop(T& value)
+        {
+            size_t head = _head.load(std::memory_order_relaxed);
+            bool result = (head != _tail_cache);
+            if(!result)
+            {
+                _tail_cache = _tail.load(std::memory_order_acquire);
+                result = (head != _tail_cache);
+            }
+            if(result)
+            {
+                value = _buffer[head & _mask];
+                _head.store(head + 1, std::memory_order_release);
+            }
+            return result;
+        }
+
+        size_t size() const
+        {
+            return _tail.load() - _head.load();
+        }
+
+    private:
+        std::vector<T> _buffer;
+        size_t _mask;
+        char _head_padding[CACHE_LINE_SIZE];
+        std::atomic<size_t> _head;
+        size_t _tail_cache;
+        char _tail_padding[CACHE_LINE_SIZE];
+        std::atomic<size_t> _tail;
+        size_t _head_cache;
+        char _end_padding[CACHE_LINE_SIZE];
+    };
+
+    // Bounded ring for any number of producers and consumers, each cell
+    // carries a sequence number telling whose turn it is (after Vyukov)
+    template<class T> class mpmc_queue
+    {
+    public:
+        mpmc_queue(size_t capacity = 4096) :
+            _enqueue(0),
+            _dequeue(0)
+        {
+            size_t size = 2;
+            while(size < capacity)
+            {
+                size <<= 1;
+            }
+            _cells.reset(new cell[size]);
+            for(size_t index = 0; index < size; index++)
+            {
+                _cells[index].sequence.store(
+                    index, 
+                    std::memory_order_relaxed);
+            }
+            _mask = size - 1;
+            statistics::allocate(MEMORY_QUEUES, size * sizeof(cell));
+        }
+
+        mpmc_queue(const mpmc_queue&) = delete;
+
+        mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+        ~mpmc_queue()
+        {
+            statistics::release(MEMORY_QUEUES, (_mask + 1) * sizeof(cell));
+        }
+
+        bool push(const T& value)
+        {
+            cell * target = nullptr;
+            cell * candidate;
+            size_t position = _enqueue.load(std::memory_order_relaxed);
+            intptr_t difference = 0;
+            // A cell behind the producer position means the ring is full
+            while(target == nullptr && difference >= 0)
+            {
+                candidate = &_cells[position & _mask];
+                difference = static_cast<intptr_t>(
+                    candidate->sequence.load(std::memory_order_acquire)) 
+                    - static_cast<intptr_t>(position);
+                if(difference == 0 && _enqueue.compare_exchange_weak(
+                    position, 
+                    position + 1, 
+                    std::memory_order_relaxed))
+                {
+                    target = candidate;
+                }
+                else if(difference > 0)
+                {
+                    position = _enqueue.load(std::memory_order_relaxed);
+                    difference = 0;
+                }
+            }
+            if(target != nullptr)
+            {
+                target->value = value;
+                target->sequence.store(
+                    position + 1, 
+                    std::memory_order_release);
+            }
+            return target != nullptr;
+        }
+
+        bool pop(T& value)
+        {
+            return pop(&value, 1) == 1;
+        }
+
+        // Claims up to count consecutive ready cells with a single CAS
+        size_t pop(T * values, size_t count)
+        {
+            size_t position = _dequeue.load(std::memory_order_relaxed);
+            size_t result = 0;
+            bool claimed = false;
+            while(!claimed)
+            {
+                result = 0;
+                while(result < count 
+                    && _cells[(position + result) & _mask].sequence.load(
+                        std::memory_order_acquire) == position + result + 1)
+                {
+                    result++;
+                }
+                claimed = (result == 0) || _dequeue.compare_exchange_weak(
+                    position, 
+                    position + result, 
+                    std::memory_order_relaxed);
+            }
+            for(size_t index = 0; index < result; index++)
+            {
+                cell& source = _cells[(position + index) & _mask];
+                values[index] = source.value;
+                source.sequence.store(
+                    position + index + _mask + 1, 
+                    std::memory_order_release);
+            }
+            return result;
+        }
+
+        size_t size() const
+        {
+            size_t enqueue = _enqueue.load(std::memory_order_relaxed);
+            size_t dequeue = _dequeue.load(std::memory_order_relaxed);
+            return enqueue > dequeue ? enqueue - dequeue : 0;
+        }
+
+        uint64_t pushed() const
+        {
+            return _enqueue.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct cell
+        {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<cell[]> _cells;
+        size_t _mask;
+        char _enqueue_padding[CACHE_LINE_SIZE];
+        std::atomic<size_t> _enqueue;
+        char _dequeue_padding[CACHE_LINE_SIZE];
+        std::atomic<size_t> _dequeue;
+        char _end_padding[CACHE_LINE_SIZE];
+    };
+
+    struct queue_metrics
+    {
+        size_t depth = 0;
+        uint64_t enqueued = 0;
+        uint64_t stalls = 0;
+        uint64_t parks = 0;
+    };
+
+    // Threads draining an MPMC queue in batches. Idle workers sleep on an
+    // eventfd and are only woken when a job arrives while they sleep
+    class worker_pool
+    {
+    public:
+        typedef std::function<void(
+            size_t worker, 
+            void ** jobs, 
+            size_t count)> handler;
+
+        typedef std::function<void(size_t worker)> initializer;
+
+        worker_pool(size_t capacity = 4096);
+
+        worker_pool(const worker_pool&) = delete;
+
+        worker_pool& operator=(const worker_pool&) = delete;
+
+        ~worker_pool();
+
+        void start(
+            size_t threads, 
+            handler callback, 
+            initializer initialize = nullptr);
+
+        bool submit(void * job);
+
+        void stop();
+
+        size_t size() const;
+
+        queue_metrics metrics() const;
+
+    private:
+        void run(size_t worker);
+
+        void wake(size_t count);
+
+        mpmc_queue<void*> _queue;
+        std::vector<std::thread> _threads;
+        handler _handler;
+        initializer _initialize;
+        int _event;
+        std::atomic<bool> _running;
+        std::atomic<size_t> _sleeping;
+        std::atomic<uint64_t> _stalls;
+        std::atomic<uint64_t> _parks;
+    };
+
+    class request_arena
+    {
+    public:
+        request_arena(size_t initial_size = 64 * 1024);
+
+        request_arena(const request_arena&) = delete;
+
+        request_arena& operator=(const request_arena&) = delete;
+
+        ~request_arena();
+
+        google::protobuf::Arena * get();
+
+        void reset();
+
+        size_t allocations() const;
+
+        size_t initial_size() const;
+
+    private:
+        void create();
+
+        std::vector<char> _initial_block;
+        std::unique_ptr<google::protobuf::Arena> _arena;
+        size_t _allocations;
+    };
+
+    // Log-linear buckets in the style of HDR histograms: values below 32
+    // are exact, above that every power of two is split into 32 steps,
+    // so any value is known to about 3%
+    const size_t HISTOGRAM_BUCKETS = 1920;
+
+    // Written by one thread only and read by any, so recording is a 
+    // relaxed load and store without read-modify-write
+    class histogram
+    {
+    public:
+        histogram();
+
+        histogram(const histogram&) = delete;
+
+        histogram& operator=(const histogram&) = delete;
+
+        void record(uint64_t value);
+
+        // Also records the samples a stalled caller never got to send, one
+        // per expected interval, as HdrHistogram does for coordinated
+        // omission
+        void record(uint64_t value, uint64_t expected_interval);
+
+        void merge(const histogram& other);
+
+        uint64_t count() const;
+
+        uint64_t max() const;
+
+        uint64_t percentile(double percentile) const;
+
+    private:
+        static size_t bucket(uint64_t value);
+
+        static uint64_t highest(size_t bucket);
+
+        std::array<std::atomic<uint64_t>,HISTOGRAM_BUCKETS> _counts;
+        std::atomic<uint64_t> _count;
+        std::atomic<uint64_t> _max;
+    };
+
+    // Zipfian ranks as generated by YCSB (Gray et al.), rank 0 is the most
+    // popular. A theta of 0 is uniform, it must stay below 1
+    class zipfian_generator
+    {
+    public:
+        zipfian_generator(uint64_t items, double theta);
+
+        uint64_t next(std::mt19937_64& random);
+
+    private:
+        uint64_t _items;
+        double _theta;
+        double _alpha;
+        double _zetan;
+        double _eta;
+    };
+
+    // Counters of the calling thread, only ever written by it
+    struct thread_statistics
+    {
+        histogram latency[4];
+        histogram loop_lag;
+        histogram lock_wait;
+        histogram lock_hold;
+        std::atomic<uint64_t> lock_contentions{0};
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+        std::atomic<uint64_t> connections_opened{0};
+        std::atomic<uint64_t> connections_closed{0};
+        std::atomic<uint64_t> connections_refused{0};
+        std::atomic<uint64_t> disk_reads{0};
+        std::atomic<uint64_t> disk_bytes_read{0};
+        std::atomic<uint64_t> disk_writes{0};
+        std::atomic<uint64_t> disk_bytes_written{0};
+        std::atomic<uint64_t> memory[MEMORY_SUBSYSTEMS] = {};
+    };
+
+    enum trace_phases
+    {
+        TRACE_PARSE = 0,
+        TRACE_LOCK_WAIT = 1,
+        TRACE_LOAD_BUCKET = 2,
+        TRACE_FIND_RECORD = 3,
+        TRACE_STORE_BUCKET = 4,
+        TRACE_SERIALIZE = 5,
+        TRACE_WRITE = 6
+    };
+
+    const size_t TRACE_PHASES = 7;
+
+    struct trace_event
+    {
+        trace_phases phase;
+        uint64_t begin;
+        uint64_t end;
+        uint32_t thread;
+    };
+
+    // Phases of one sampled request, stamped with the TSC. A request can
+    // move between threads, each event remembers where it ran
+    struct request_trace
+    {
+        int command = -1;
+        uint64_t begin = 0;
+        uint32_t thread = 0;
+        std::vector<trace_event> events;
+    };
+
+    // Samples one request in every n and writes their phases as Chrome
+    // trace events from a background thread. While a request is traced
+    // it is the calling thread's active trace, phases without one cost a
+    // thread local load
+    class tracer
+    {
+    public:
+        static void enable(const std::string& path, size_t sample);
+
+        static void disable();
+
+        static uint64_t now();
+
+        static double ticks_per_microsecond();
+
+        static const char * phase_name(trace_phases phase);
+
+        static const char * command_name(int command);
+
+        static request_trace * active()
+        {
+            return _active;
+        }
+
+        static request_trace * begin()
+        {
+            return (_sample.load(std::memory_order_relaxed) == 0 
+                || _active != nullptr) ? _active : sample();
+        }
+
+        static request_trace * detach();
+
+        static void attach(request_trace * trace);
+
+        static void record(
+            request_trace * trace, 
+            trace_phases phase, 
+            uint64_t begin, 
+            uint64_t end);
+
+        static void end(request_trace * trace);
+
+    private:
+        static request_trace * sample();
+
+        static void write();
+
+        static std::atomic<size_t> _sample;
+        static thread_local request_trace * _active;
+    };
+
+    // One request over the slow log threshold, plain data so it can wait
+    // in a lock free ring for the writer. Times are in TSC ticks
+    struct slow_request
+    {
+        int command;
+        char hash[16];
+        uint64_t time;
+        uint64_t latency;
+        uint64_t phases[TRACE_PHASES];
+        uint64_t bucket_bytes;
+        uint64_t stored_bytes;
+        uint64_t request_bytes;
+        uint64_t response_bytes;
+    };
+
+    // Logs requests slower than a threshold from a background thread. The
+    // executing thread adds up phases in thread local storage and copies
+    // them into the ring only for a slow request, a full ring drops it
+    class slow_log
+    {
+    public:
+        static void enable(
+            const std::string& path, 
+            uint64_t threshold_microseconds, 
+            uint64_t rotate_bytes);
+
+        static void disable();
+
+        static bool recording()
+        {
+            return _recording;
+        }
+
+        static void begin(const request& request)
+        {
+            if(_enabled.load(std::memory_order_relaxed))
+            {
+                start(request);
+            }
+        }
+
+        static void phase(trace_phases phase, uint64_t ticks);
+
+        static void touch(uint64_t bucket_bytes, uint64_t stored_bytes);
+
+        static void end(size_t response_bytes)
+        {
+            if(_recording)
+            {
+                finish(response_bytes);
+            }
+        }
+
+        static uint64_t dropped();
+
+    private:
+        static void start(const request& request);
+
+        static void finish(size_t response_bytes);
+
+        static void write();
+
+        static void rotate();
+
+        static std::atomic<bool> _enabled;
+        static thread_local bool _recording;
+    };
+
+    class trace_phase
+    {
+    public:
+        explicit trace_phase(trace_phases phase);
+
+        trace_phase(const trace_phase&) = delete;
+
+        trace_phase& operator=(const trace_phase&) = delete;
+
+        ~trace_phase();
+
+    private:
+        request_trace * _trace;
+        trace_phases _phase;
+        uint64_t _begin;
+    };
+
+    // Transport serving one request per connection, the handler turns a
+    // complete request into the response written back. The server's own
+    // libuv loop is the default, engines replace it for the single loop
+    class network_engine
+    {
+    public:
+        typedef std::function<void(
+            const char * request, 
+            size_t size, 
+            std::string& response)> handler;
+
+        virtual ~network_engine() = default;
+
+        virtual void listen(uint16_t port) = 0;
+
+        virtual void listen(const std::string& path) = 0;
+
+        virtual void run(handler callback) = 0;
+
+        virtual void stop() = 0;
+    };
+
+    // Edge triggered epoll with pooled connections, each reading into a
+    // fixed buffer and writing with vectored sends
+    class epoll_engine : public network_engine
+    {
+    public:
+        epoll_engine();
+
+        epoll_engine(const epoll_engine&) = delete;
+
+        epoll_engine& operator=(const epoll_engine&) = delete;
+
+        ~epoll_engine();
+
+        void set_zerocopy(bool zerocopy);
+
+        void set_busy_poll(uint64_t idle_microseconds);
+
+        void listen(uint16_t port) override;
+
+        void listen(const std::string& path) override;
+
+        void run(handler callback) override;
+
+        void stop() override;
+
+    private:
+        struct connection;
+
+        void watch(int& listener);
+
+        void accept_connections(int listener);
+
+        void receive(connection& client);
+
+        void send(connection& client);
+
+        void complete_zerocopy(connection& client);
+
+        void release(connection& client);
+
+        handler _handler;
+        int _epoll;
+        int _listener;
+        int _unix_listener;
+        int _stop_event;
+        int _signals;
+        bool _zerocopy;
+        uint64_t _busy_poll;
+        std::atomic<bool> _running;
+        std::vector<char> _overflow;
+        std::vector<std::unique_ptr<connection>> _connections;
+        std::vector<connection*> _free;
+    };
+
+    enum channel_rings
+    {
+        REQUEST_RING = 0,
+        RESPONSE_RING = 1
+    };
+
+    // Request and response rings in memory shared with a process on the
+    // same host, each ring with one producer and one consumer. A side 
+    // that finds its ring empty spins briefly, then sleeps on a futex 
+    // the producer only wakes when the consumer announced it is asleep
+    class shm_channel
+    {
+    public:
+        shm_channel();
+
+        explicit shm_channel(int descriptor);
+
+        shm_channel(const shm_channel&) = delete;
+
+        shm_channel& operator=(const shm_channel&) = delete;
+
+        ~shm_channel();
+
+        int descriptor() const;
+
+        char * reserve(channel_rings ring, size_t size);
+
+        void commit(channel_rings ring, size_t size);
+
+        const char * receive(
+            channel_rings ring, 
+            size_t& size, 
+            int timeout_milliseconds);
+
+        void release(channel_rings ring);
+
+        void close();
+
+        bool closed() const;
+
+    private:
+        struct ring;
+
+        struct region;
+
+        void map();
+
+        int _descriptor;
+        region * _region;
+        uint32_t _reserved[2];
+        uint32_t _received[2];
+    };
+
     class client
     {
     public:
@@ -91,13 +1466,31 @@ namespace rmp
 
         std::pair<bool,std::string> delete_record(const std::string& email);
 
+        std::pair<bool,std::string> server_statistics();
+
+        std::pair<bool,std::string> lock_contention();
+
+        std::pair<bool,std::string> export_records(const std::string& path);
+
+        void set_shared_memory(bool enabled);
+
     private:
         std::pair<bool,std::string> process_request(
             int command,
             const record& record);
+
+        void open_channel();
+
+        void close_channel();
+
+        void exchange(const request& request, response& response);
             
         int _socket;
-        sockaddr_in _address;
+        sockaddr_storage _address;
+        socklen_t _address_length;
+        bool _shared_memory = false;
+        int _channel_socket = -1;
+        std::unique_ptr<shm_channel> _channel;
     };
 
     class server
@@ -113,6 +1506,62 @@ namespace rmp
 
         void set_root_directory(const std::string& root_directory);
 
+        void set_io_mode(io_modes io_mode);
+
+        void set_cache_capacity(size_t capacity);
+
+        void set_readahead(size_t readahead);
+
+        void set_descriptor_capacity(size_t capacity);
+
+        void set_openat(bool use_openat);
+
+        void set_layout(const bucket_layout& layout);
+
+        void set_migration_threads(size_t threads);
+
+        void set_memory_tier(bool memory_tier);
+
+        void set_shards(size_t shards);
+
+        void set_workers(size_t workers);
+
+        void set_cpus(const std::vector<int>& cpus);
+
+        void set_busy_poll(uint64_t idle_microseconds);
+
+        void set_network_engine(network_engines engine);
+
+        void set_zerocopy(bool zerocopy);
+
+        void set_unix_socket(const std::string& path);
+
+        void set_trace(const std::string& path);
+
+        void set_trace_sample(size_t sample);
+
+        void set_lock_threshold(uint64_t milliseconds);
+
+        void set_slow_log(const std::string& path);
+
+        void set_slow_threshold(uint64_t microseconds);
+
+        void set_slow_log_size(uint64_t bytes);
+
+        void set_memory_limit(uint64_t bytes);
+
+        uint64_t arena_allocations() const;
+
+        queue_metrics request_queue_metrics() const;
+
+        queue_metrics response_queue_metrics() const;
+
+        numa_metrics memory_locality() const;
+
+        std::string report() const;
+
+        size_t export_records(const std::string& path);
+
         void start();
         
         void run();
@@ -120,21 +1569,18 @@ namespace rmp
         void stop();
     
     private:
-        std::set<std::string> _thread_locks;
-
-        std::mutex _thread_locks_mutex;
+        struct partition
+        {
+            store records;
+            request_arena arena;
+            std::atomic<uint64_t> arena_allocations{0};
+        };
 
-        void aquire_lock(const std::string& hash);
+        struct shard;
 
-        void release_lock(const std::string& hash);
+        struct shard_message;
 
-        void load_bucket(
-            const std::string& hash, 
-            bucket& bucket);
-        
-        void store_bucket(
-            const std::string& hash, 
-            const bucket& bucket);
+        struct channel;
 
         static void uv_read_callback(
             uv_stream_t *client, 
@@ -156,26 +1602,116 @@ namespace rmp
         static void uv_walk_callback(
             uv_handle_t* handle, void* arg);    
 
+        static void uv_response_callback(uv_async_t *handle);
+
+        static void uv_shard_read_callback(
+            uv_stream_t *client, 
+            ssize_t nread, 
+            const uv_buf_t *buf);
+
+        static void uv_shard_connection_callback(
+            uv_stream_t *server, 
+            int status);
+
+        static void uv_shard_async_callback(uv_async_t *handle);
+
+        static void uv_shard_idle_callback(uv_idle_t *handle);
+
+        static void uv_shard_signal_callback(
+            uv_signal_t *handle, 
+            int signum);
+
+        static void send_message(
+            shard& source, 
+            size_t target, 
+            shard_message * message);
+
+        void start_shards();
+
+        void start_loop();
+
+        void start_engine();
+
+        void listen_pipe(uv_loop_t * loop, uv_connection_cb callback);
+
+        void open_channel(uv_stream_t * client);
+
+        void run_channel(channel& target);
+
+        void stop_channels();
+
+        void run_shard(shard& target);
+
+        void place_thread(size_t index);
+
+        void run_loop(uv_loop_t * loop, const uint64_t& activity);
+
+        void run_jobs(size_t worker, void ** jobs, size_t count);
+
+        rmp::request * parse(
+            request_arena& arena, 
+            const char * data, 
+            size_t size);
+
+        void process(
+            partition& partition,
+            request_arena& arena,
+            rmp::request& request,
+            std::string& output);
+
         void handle_request(
-            const rmp::request& request,
+            partition& partition,
+            rmp::request& request,
             rmp::response& response);
 
-        response on_create(
-            const record& record);
+        void on_create(
+            partition& partition,
+            record& record,
+            response& response);
 
-        response on_read(
-            const record& record);
+        void on_read(
+            partition& partition,
+            record& record,
+            response& response);
 
-        response on_update(
-            const record& record);
+        void on_update(
+            partition& partition,
+            record& record,
+            response& response);
 
-        response on_delete(
-            const record& record);
+        void on_delete(
+            partition& partition,
+            record& record,
+            response& response);
 
         uint16_t _port;
-        std::string _root_directory;
+        partition _partition;
+        size_t _shard_count;
+        std::vector<std::shared_ptr<shard>> _shards;
+        std::atomic<bool> _stopping;
+        std::vector<int> _cpus;
+        uint64_t _busy_poll;
+        uint64_t _activity;
+        network_engines _engine;
+        bool _zerocopy;
+        std::unique_ptr<network_engine> _network;
+        std::string _unix_path;
+        std::string _trace_path;
+        size_t _trace_sample;
+        std::string _slow_log_path;
+        uint64_t _slow_threshold;
+        uint64_t _slow_log_size;
+        std::mutex _channels_mutex;
+        std::list<std::shared_ptr<channel>> _channels;
+        size_t _worker_count;
+        std::unique_ptr<worker_pool> _workers;
+        std::vector<std::unique_ptr<request_arena>> _worker_arenas;
+        mpmc_queue<void*> _responses;
+        std::atomic<uint64_t> _response_stalls;
+        uv_async_t _responses_async;
         std::shared_ptr<uv_loop_t> _loop;
         uv_tcp_t _handle;
+        uv_pipe_t _pipe;
         uv_signal_t _signal;
     };
 }
\ No newline at end of file
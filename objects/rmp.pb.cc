@@ -171,9 +171,11 @@ const char descriptor_table_protodef_rmp_2eproto[] PROTOBUF_SECTION_VARIABLE(pro
   "records\030\001 \003(\0132\013.rmp.record\"8\n\007request\022\017\n"
   "\007command\030\001 \001(\r\022\034\n\007payload\030\002 \001(\0132\013.rmp.re"
   "cord\"+\n\010response\022\016\n\006status\030\001 \001(\r\022\017\n\007payl"
-  "oad\030\002 \001(\t*=\n\rcommand_codes\022\n\n\006CREATE_RECORD\020\000\022\010"
-  "\n\004READ_RECORD\020\001\022\n\n\006UPDATE_RECORD\020\002\022\n\n\006DELETE_RECORD\020\003*!\n\014stat"
-  "us_codes\022\010\n\004GOOD\020\000\022\007\n\003BAD\020\001b\006proto3"
+  "oad\030\002 \001(\t*\215\001\n\rcommand_codes\022\021\n\rCREATE_RE"
+  "CORD\020\000\022\017\n\013READ_RECORD\020\001\022\021\n\rUPDATE_RECORD"
+  "\020\002\022\021\n\rDELETE_RECORD\020\003\022\020\n\014OPEN_CHANNEL\020\004\022"
+  "\t\n\005STATS\020\005\022\t\n\005LOCKS\020\006\022\n\n\006EXPORT\020\007*!\n\014"
+  "status_codes\022\010\n\004GOOD\020\000\022\007\n\003BAD\020\001b\006proto3"
   ;
 static const ::PROTOBUF_NAMESPACE_ID::internal::DescriptorTable*const descriptor_table_rmp_2eproto_deps[1] = {
 };
@@ -186,7 +188,7 @@ static ::PROTOBUF_NAMESPACE_ID::internal::SCCInfoBase*const descriptor_table_rmp
 };
 static ::PROTOBUF_NAMESPACE_ID::internal::once_flag descriptor_table_rmp_2eproto_once;
 const ::PROTOBUF_NAMESPACE_ID::internal::DescriptorTable descriptor_table_rmp_2eproto = {
-  false, false, descriptor_table_protodef_rmp_2eproto, "rmp.proto", 355,
+  false, false, descriptor_table_protodef_rmp_2eproto, "rmp.proto", 436,
   &descriptor_table_rmp_2eproto_once, descriptor_table_rmp_2eproto_sccs, descriptor_table_rmp_2eproto_deps, 5, 0,
   schemas, file_default_instances, TableStruct_rmp_2eproto::offsets,
   file_level_metadata_rmp_2eproto, 5, file_level_enum_descriptors_rmp_2eproto, file_level_service_descriptors_rmp_2eproto,
@@ -205,6 +207,10 @@ bool command_codes_IsValid(int value) {
     case 1:
     case 2:
     case 3:
+    case 4:
+    case 5:
+    case 6:
+    case 7:
       return true;
     default:
       return false;
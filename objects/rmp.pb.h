@@ -85,12 +85,16 @@ enum command_codes : int {
   READ_RECORD = 1,
   UPDATE_RECORD = 2,
   DELETE_RECORD = 3,
+  OPEN_CHANNEL = 4,
+  STATS = 5,
+  LOCKS = 6,
+  EXPORT = 7,
   command_codes_INT_MIN_SENTINEL_DO_NOT_USE_ = std::numeric_limits<::PROTOBUF_NAMESPACE_ID::int32>::min(),
   command_codes_INT_MAX_SENTINEL_DO_NOT_USE_ = std::numeric_limits<::PROTOBUF_NAMESPACE_ID::int32>::max()
 };
 bool command_codes_IsValid(int value);
 constexpr command_codes command_codes_MIN = CREATE_RECORD;
-constexpr command_codes command_codes_MAX = DELETE_RECORD;
+constexpr command_codes command_codes_MAX = EXPORT;
 constexpr int command_codes_ARRAYSIZE = command_codes_MAX + 1;
 
 const ::PROTOBUF_NAMESPACE_ID::EnumDescriptor* command_codes_descriptor();
@@ -100,6 +100,15 @@ static void update_command(
 static void delete_command(
     std::shared_ptr<rmp::client>& client);
 
+static void stats_command(
+    std::shared_ptr<rmp::client>& client);
+
+static void locks_command(
+    std::shared_ptr<rmp::client>& client);
+
+static void export_command(
+    std::shared_ptr<rmp::client>& client);
+
 static void print_help();
 
 static bool client_main(
@@ -130,6 +139,18 @@ static bool client_main(
             {
                 delete_command(client);
             }
+            else if(line_buffer == "stats")
+            {
+                stats_command(client);
+            }
+            else if(line_buffer == "locks")
+            {
+                locks_command(client);
+            }
+            else if(line_buffer == "export")
+            {
+                export_command(client);
+            }
             else if(line_buffer == "exit")
             {
                 loop = false;
@@ -272,6 +293,54 @@ static void delete_command(
     std::cerr << result.second << std::endl;
 }
 
+static void stats_command(
+    std::shared_ptr<rmp::client>& client)
+{
+    std::pair<bool,std::string> result;
+
+    result = client->server_statistics();
+
+    if(!result.first)
+    {
+        std::cerr << "Error: ";
+    }
+    
+    std::cerr << result.second << std::endl;
+}
+
+static void locks_command(
+    std::shared_ptr<rmp::client>& client)
+{
+    std::pair<bool,std::string> result;
+
+    result = client->lock_contention();
+
+    if(!result.first)
+    {
+        std::cerr << "Error: ";
+    }
+    
+    std::cerr << result.second << std::endl;
+}
+
+static void export_command(
+    std::shared_ptr<rmp::client>& client)
+{
+    std::string path;
+    std::pair<bool,std::string> result;
+
+    path = get_input("path on the server");
+
+    result = client->export_records(path);
+
+    if(!result.first)
+    {
+        std::cerr << "Error: ";
+    }
+    
+    std::cerr << result.second << std::endl;
+}
+
 static void print_help()
 {
     std::cerr << std::endl << std::setw(5) << '\0'
@@ -289,6 +358,15 @@ static void print_help()
     std::cerr << std::setw(5) << '\0' <<  std::setw(15) 
               << std::left << "create" << std::setw(50)
               << "Delete an existing record from the server." << std::endl;
+    std::cerr << std::setw(5) << '\0' <<  std::setw(15) 
+              << std::left << "stats" << std::setw(50)
+              << "Print the server's latencies and counters." << std::endl;
+    std::cerr << std::setw(5) << '\0' <<  std::setw(15) 
+              << std::left << "locks" << std::setw(50)
+              << "Print the most contended bucket locks." << std::endl;
+    std::cerr << std::setw(5) << '\0' <<  std::setw(15) 
+              << std::left << "export" << std::setw(50)
+              << "Write every record to a file on the server." << std::endl;
     std::cerr << std::setw(5) << '\0' << std::setw(15) 
               << std::left << "exit" << std::setw(50)
               << "Exit the client program." << std::endl;
@@ -0,0 +1,208 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+
+// Retired objects queued before a collection is attempted
+const size_t COLLECT_THRESHOLD = 64;
+
+struct participant
+{
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> active;
+    std::atomic<bool> in_use;
+    participant * next;
+    size_t depth;
+};
+
+struct retired_object
+{
+    void * object;
+    void (*deleter)(void*);
+    uint64_t epoch;
+};
+
+static std::atomic<uint64_t> global_epoch(0);
+
+static std::atomic<participant*> participants(nullptr);
+
+static std::mutex retired_mutex;
+
+// Whatever is still queued at exit has no readers left
+struct retired_list : std::vector<retired_object>
+{
+    ~retired_list()
+    {
+        for(retired_object& retired : *this)
+        {
+            retired.deleter(retired.object);
+        }
+    }
+};
+
+static retired_list retired_objects;
+
+static participant * acquire_participant();
+
+static bool try_advance();
+
+// Hands the participant back when its thread exits
+struct participant_holder
+{
+    participant * owner = nullptr;
+
+    ~participant_holder()
+    {
+        if(owner != nullptr)
+        {
+            owner->active.store(false);
+            owner->in_use.store(false);
+        }
+    }
+};
+
+static thread_local participant_holder local_participant;
+
+void rmp::epoch::enter()
+{
+    participant * self = local_participant.owner;
+    uint64_t epoch;
+    if(self == nullptr)
+    {
+        self = local_participant.owner = acquire_participant();
+    }
+
+    if(self->depth++ == 0)
+    {
+        // Publish the epoch before any shared pointer is read, retry if
+        // the epoch moved in between so a stale value is never announced
+        do
+        {
+            epoch = global_epoch.load();
+            self->epoch.store(epoch);
+            self->active.store(true);
+        } while(epoch != global_epoch.load());
+    }
+}
+
+void rmp::epoch::exit()
+{
+    participant * self = local_participant.owner;
+    if(--self->depth == 0)
+    {
+        self->active.store(false, std::memory_order_release);
+    }
+}
+
+void rmp::epoch::retire(void * object, void (*deleter)(void*))
+{
+    std::unique_lock<std::mutex> lock(retired_mutex);
+    retired_objects.push_back({object, deleter, global_epoch.load()});
+    if(retired_objects.size() >= COLLECT_THRESHOLD)
+    {
+        lock.unlock();
+        collect();
+    }
+}
+
+size_t rmp::epoch::collect()
+{
+    size_t result = 0;
+    std::vector<retired_object> expired;
+    std::unique_lock<std::mutex> lock(retired_mutex);
+    try_advance();
+    // Anything retired two epochs ago can no longer be referenced
+    auto end = std::partition(
+        retired_objects.begin(), 
+        retired_objects.end(), 
+        [](const retired_object& retired)
+        {
+            return retired.epoch + 2 > global_epoch.load();
+        });
+    expired.assign(end, retired_objects.end());
+    retired_objects.erase(end, retired_objects.end());
+    lock.unlock();
+
+    for(retired_object& retired : expired)
+    {
+        retired.deleter(retired.object);
+        result++;
+    }
+    return result;
+}
+
+uint64_t rmp::epoch::current()
+{
+    return global_epoch.load();
+}
+
+rmp::epoch_guard::epoch_guard()
+{
+    rmp::epoch::enter();
+}
+
+rmp::epoch_guard::~epoch_guard()
+{
+    rmp::epoch::exit();
+}
+
+static participant * acquire_participant()
+{
+    participant * result = participants.load();
+    bool in_use = false;
+
+    // Reuse the record of a thread that has exited
+    while(result != nullptr 
+        && !result->in_use.compare_exchange_strong(in_use, true))
+    {
+        in_use = false;
+        result = result->next;
+    }
+
+    if(result == nullptr)
+    {
+        result = new participant;
+        result->epoch = 0;
+        result->active = false;
+        result->in_use = true;
+        result->next = participants.load();
+        while(!participants.compare_exchange_weak(result->next, result));
+    }
+    result->depth = 0;
+    return result;
+}
+
+static bool try_advance()
+{
+    uint64_t epoch = global_epoch.load();
+    bool result = true;
+    for(participant * current = participants.load(); 
+        result && current != nullptr; 
+        current = current->next)
+    {
+        result = !current->active.load() || current->epoch.load() == epoch;
+    }
+    return result && global_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
\ No newline at end of file
@@ -0,0 +1,453 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+// Requests up to this size are read without touching the heap
+const size_t CONNECTION_BUFFER_SIZE = 16 * 1024;
+
+// Reads beyond the fixed buffer spill into one buffer shared by all
+const size_t OVERFLOW_BUFFER_SIZE = 1024 * 1024;
+
+// Pinning pages only pays off for large responses
+const size_t ZEROCOPY_THRESHOLD = 32 * 1024;
+
+const int MAX_EVENTS = 64;
+
+struct rmp::epoll_engine::connection
+{
+    int fd;
+    char buffer[CONNECTION_BUFFER_SIZE];
+    size_t received;
+    std::string overflow;
+    std::string response;
+    size_t sent;
+    bool responded;
+    bool zerocopy;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_done;
+};
+
+rmp::epoll_engine::epoll_engine() :
+    _epoll(-1),
+    _listener(-1),
+    _unix_listener(-1),
+    _stop_event(-1),
+    _signals(-1),
+    _zerocopy(false),
+    _busy_poll(0),
+    _running(false),
+    _overflow(OVERFLOW_BUFFER_SIZE)
+{
+
+}
+
+rmp::epoll_engine::~epoll_engine()
+{
+    for(std::unique_ptr<connection>& client : _connections)
+    {
+        if(client->fd >= 0)
+        {
+            close(client->fd);
+        }
+    }
+    rmp::statistics::release(
+        rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+        _connections.size() * sizeof(connection));
+    for(int fd : {_epoll, _listener, _unix_listener, _stop_event, _signals})
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+void rmp::epoll_engine::set_zerocopy(bool zerocopy)
+{
+    _zerocopy = zerocopy;
+}
+
+void rmp::epoll_engine::set_busy_poll(uint64_t idle_microseconds)
+{
+    _busy_poll = idle_microseconds;
+}
+
+void rmp::epoll_engine::listen(uint16_t port)
+{
+    int enable = 1;
+    sockaddr_in address;
+    _listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if(_listener < 0 || bind(
+        _listener, 
+        reinterpret_cast<const sockaddr*>(&address), 
+        sizeof(address)) < 0 || ::listen(_listener, 100) < 0)
+    {
+        throw std::runtime_error("Failed to listen");
+    }
+    watch(_listener);
+}
+
+void rmp::epoll_engine::listen(const std::string& path)
+{
+    sockaddr_un address;
+    if(path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Unix socket path too long");
+    }
+    _unix_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+    if(_unix_listener < 0 || bind(
+        _unix_listener, 
+        reinterpret_cast<const sockaddr*>(&address), 
+        sizeof(address)) < 0 || ::listen(_unix_listener, 100) < 0)
+    {
+        throw std::runtime_error("Failed to listen on " + path);
+    }
+    watch(_unix_listener);
+}
+
+void rmp::epoll_engine::watch(int& listener)
+{
+    epoll_event event;
+    sigset_t signals;
+    if(_epoll < 0)
+    {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        _stop_event = eventfd(0, EFD_NONBLOCK);
+        if(_epoll < 0 || _stop_event < 0)
+        {
+            throw std::runtime_error("Failed to create the epoll engine");
+        }
+
+        // SIGINT stops the engine the same way it stops the libuv loop
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        _signals = signalfd(-1, &signals, SFD_NONBLOCK);
+
+        event.events = EPOLLIN;
+        event.data.ptr = &_stop_event;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _stop_event, &event);
+        event.data.ptr = &_signals;
+        if(_signals >= 0)
+        {
+            epoll_ctl(_epoll, EPOLL_CTL_ADD, _signals, &event);
+        }
+    }
+
+    // The event data points at the member holding the descriptor for the
+    // engine's own descriptors and at the connection for clients
+    event.events = EPOLLIN;
+    event.data.ptr = &listener;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, listener, &event);
+}
+
+void rmp::epoll_engine::run(handler callback)
+{
+    epoll_event events[MAX_EVENTS];
+    uint64_t last = uv_hrtime();
+    int count, timeout;
+    _handler = callback;
+    _running = true;
+    while(_running)
+    {
+        // Busy polling keeps the wait non-blocking until the idle period
+        // has passed without events
+        timeout = (_busy_poll > 0 && uv_hrtime() - last < _busy_poll * 1000)
+            ? 0 
+            : -1;
+        count = epoll_wait(_epoll, events, MAX_EVENTS, timeout);
+        if(count > 0)
+        {
+            last = uv_hrtime();
+        }
+
+        for(int index = 0; index < count; index++)
+        {
+            void * source = events[index].data.ptr;
+            if(source == &_listener || source == &_unix_listener)
+            {
+                accept_connections(*reinterpret_cast<int*>(source));
+            }
+            else if(source == &_stop_event || source == &_signals)
+            {
+                _running = false;
+            }
+            else
+            {
+                connection& client = *reinterpret_cast<connection*>(source);
+                if(events[index].events & EPOLLERR)
+                {
+                    complete_zerocopy(client);
+                }
+                if(client.fd >= 0 && !client.responded 
+                    && (events[index].events & (EPOLLIN | EPOLLRDHUP)))
+                {
+                    receive(client);
+                }
+                if(client.fd >= 0 && client.responded 
+                    && (events[index].events & EPOLLOUT))
+                {
+                    send(client);
+                }
+            }
+        }
+    }
+}
+
+void rmp::epoll_engine::stop()
+{
+    uint64_t value = 1;
+    if(write(_stop_event, &value, sizeof(value)) < 0)
+    {
+        _running = false;
+    }
+}
+
+void rmp::epoll_engine::accept_connections(int listener)
+{
+    connection * client;
+    epoll_event event;
+    int fd, enable = 1;
+    while((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK)) >= 0)
+    {
+        // Refused before it can take a buffer from the pool
+        if(rmp::statistics::over_limit())
+        {
+            rmp::statistics::add(
+                rmp::statistics::local().connections_refused, 
+                1);
+            close(fd);
+        }
+        else
+        {
+            if(_free.empty())
+            {
+                _connections.emplace_back(new connection);
+                rmp::statistics::allocate(
+                    rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+                    sizeof(connection));
+                _free.push_back(_connections.back().get());
+            }
+            client = _free.back();
+            _free.pop_back();
+            rmp::statistics::add(
+                rmp::statistics::local().connections_opened, 
+                1);
+            RMP_PROBE(connection__accept, client, fd);
+            client->fd = fd;
+            client->received = 0;
+            client->sent = 0;
+            client->responded = false;
+            client->zerocopy = false;
+            client->zerocopy_sent = 0;
+            client->zerocopy_done = 0;
+            client->overflow.clear();
+            client->response.clear();
+#if defined(SO_ZEROCOPY)
+            client->zerocopy = _zerocopy && setsockopt(
+                fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+#endif
+            // Registered once, edge triggered for the whole connection
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = client;
+            epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+            receive(*client);
+        }
+    }
+}
+
+void rmp::epoll_engine::receive(connection& client)
+{
+    iovec buffers[2];
+    ssize_t size;
+    size_t space, total = 0;
+    bool open = true, drained = false;
+    // Edge triggered, so read until the socket reports it is empty
+    while(open && !drained)
+    {
+        space = CONNECTION_BUFFER_SIZE - client.received;
+        buffers[0].iov_base = client.buffer + client.received;
+        buffers[0].iov_len = space;
+        buffers[1].iov_base = _overflow.data();
+        buffers[1].iov_len = _overflow.size();
+        size = readv(client.fd, buffers, 2);
+        if(size > 0)
+        {
+            total += size;
+            client.received += std::min<size_t>(size, space);
+            if(static_cast<size_t>(size) > space)
+            {
+                client.overflow.append(_overflow.data(), size - space);
+            }
+        }
+        else if(size == 0)
+        {
+            open = false;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            drained = true;
+        }
+        else if(errno != EINTR)
+        {
+            open = false;
+        }
+    }
+
+    // Like the libuv loop, whatever a wake up delivers is the request
+    if(total > 0)
+    {
+        rmp::statistics::add(rmp::statistics::local().bytes_in, total);
+        if(!client.overflow.empty())
+        {
+            client.overflow.insert(0, client.buffer, client.received);
+            _handler(
+                client.overflow.data(), 
+                client.overflow.size(), 
+                client.response);
+        }
+        else
+        {
+            _handler(client.buffer, client.received, client.response);
+        }
+        client.responded = true;
+        rmp::statistics::add(
+            rmp::statistics::local().bytes_out, 
+            client.response.size());
+        send(client);
+    }
+    else if(!open)
+    {
+        release(client);
+    }
+}
+
+void rmp::epoll_engine::send(connection& client)
+{
+    iovec buffer;
+    msghdr message;
+    ssize_t size;
+    int flags;
+    bool blocked = false;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    while(client.fd >= 0 && !blocked && client.sent < client.response.size())
+    {
+        buffer.iov_base = &client.response[client.sent];
+        buffer.iov_len = client.response.size() - client.sent;
+        flags = MSG_NOSIGNAL;
+#if defined(MSG_ZEROCOPY)
+        if(client.zerocopy && buffer.iov_len >= ZEROCOPY_THRESHOLD)
+        {
+            flags |= MSG_ZEROCOPY;
+        }
+#endif
+        size = sendmsg(client.fd, &message, flags);
+        if(size >= 0)
+        {
+            client.sent += size;
+#if defined(MSG_ZEROCOPY)
+            client.zerocopy_sent += (flags & MSG_ZEROCOPY) ? 1 : 0;
+#endif
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            blocked = true;
+        }
+        else if(errno != EINTR)
+        {
+            release(client);
+        }
+    }
+
+    // Zero copy pages stay pinned until the kernel reports completion
+    if(client.fd >= 0 && client.sent == client.response.size() 
+        && client.zerocopy_done == client.zerocopy_sent)
+    {
+        release(client);
+    }
+}
+
+void rmp::epoll_engine::complete_zerocopy(connection& client)
+{
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+    char control[128];
+    msghdr message;
+    cmsghdr * header;
+    sock_extended_err * error;
+    bool pending = true;
+    while(pending)
+    {
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        pending = recvmsg(client.fd, &message, MSG_ERRQUEUE) >= 0;
+        for(header = CMSG_FIRSTHDR(&message); 
+            pending && header != nullptr; 
+            header = CMSG_NXTHDR(&message, header))
+        {
+            error = reinterpret_cast<sock_extended_err*>(CMSG_DATA(header));
+            if(error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+            {
+                // Completions arrive as ranges of send sequence numbers
+                client.zerocopy_done += error->ee_data - error->ee_info + 1;
+            }
+        }
+    }
+    if(client.responded && client.sent == client.response.size() 
+        && client.zerocopy_done == client.zerocopy_sent)
+    {
+        release(client);
+    }
+#endif
+}
+
+void rmp::epoll_engine::release(connection& client)
+{
+    // Closing also removes the descriptor from the epoll set
+    rmp::statistics::add(rmp::statistics::local().connections_closed, 1);
+    RMP_PROBE(connection__close, &client, client.fd);
+    close(client.fd);
+    client.fd = -1;
+    _free.push_back(&client);
+}
\ No newline at end of file
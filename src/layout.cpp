@@ -0,0 +1,450 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+
+// Hash strings are padded to the width of a 32 bit hash before fan-out
+const size_t HASH_DIGITS = 8;
+
+// Names handed to the movers before the scanner waits for them
+const size_t MIGRATION_BATCH_SIZE = 4096;
+
+const char * LAYOUT_MARKER = ".layout";
+
+static bool is_bucket_file(
+    const std::string& root_directory, 
+    const dirent * entry);
+
+rmp::bucket_layout::bucket_layout(size_t levels, size_t width) :
+    _levels(levels),
+    _width(width)
+{
+    if(_width == 0 || _levels * _width > HASH_DIGITS)
+    {
+        throw std::invalid_argument("Invalid bucket layout");
+    }
+}
+
+rmp::bucket_layout rmp::bucket_layout::parse(const std::string& name)
+{
+    size_t separator;
+    rmp::bucket_layout result;
+    if(name != "flat")
+    {
+        separator = name.find('x');
+        if(separator == std::string::npos)
+        {
+            throw std::invalid_argument("Invalid bucket layout " + name);
+        }
+        result = rmp::bucket_layout(
+            std::stoul(name.substr(0, separator)),
+            std::stoul(name.substr(separator + 1)));
+    }
+    return result;
+}
+
+std::string rmp::bucket_layout::name() const
+{
+    return flat() 
+        ? "flat" 
+        : std::to_string(_levels) + "x" + std::to_string(_width);
+}
+
+std::string rmp::bucket_layout::path(const std::string& hash) const
+{
+    std::string result;
+    std::string padded;
+    if(flat())
+    {
+        result = hash;
+    }
+    else
+    {
+        padded = std::string(
+            HASH_DIGITS - std::min(hash.size(), HASH_DIGITS), '0') + hash;
+        result.reserve(_levels * (_width + 1) + hash.size());
+        for(size_t level = 0; level < _levels; level++)
+        {
+            result.append(padded, level * _width, _width);
+            result.push_back('/');
+        }
+        result.append(hash);
+    }
+    return result;
+}
+
+rmp::bucket_layout rmp::bucket_layout::load(
+    const std::string& root_directory)
+{
+    std::ifstream marker(root_directory + "/" + LAYOUT_MARKER);
+    std::string name = "flat";
+    if(marker.good())
+    {
+        marker >> name;
+    }
+    return parse(name);
+}
+
+void rmp::bucket_layout::save(const std::string& root_directory) const
+{
+    std::ofstream marker(root_directory + "/" + LAYOUT_MARKER);
+    marker << name();
+    if(!marker.good())
+    {
+        throw std::runtime_error("Failed to save bucket layout");
+    }
+}
+
+bool rmp::bucket_layout::is_bucket_name(const std::string& name)
+{
+    bool result = (name.size() > 0 && name.size() <= HASH_DIGITS);
+    for(size_t index = 0; result && index < name.size(); index++)
+    {
+        result = isxdigit(name[index]) && !isupper(name[index]);
+    }
+    return result;
+}
+
+bool rmp::bucket_layout::flat() const
+{
+    return _levels == 0;
+}
+
+void rmp::bucket_layout::create_parents(
+    const std::string& root_directory,
+    const std::string& hash) const
+{
+    std::string target = path(hash);
+    std::string directory, blocker;
+    struct stat status;
+    for(size_t level = 0; level < _levels; level++)
+    {
+        directory = root_directory + "/" 
+            + target.substr(0, level * (_width + 1) + _width);
+        if(mkdir(directory.c_str(), 0755) < 0 && errno == EEXIST 
+            && stat(directory.c_str(), &status) == 0 
+            && !S_ISDIR(status.st_mode) && level == 0)
+        {
+            // Only flat buckets live next to the top level directories,
+            // move the one in the way to its own path first
+            blocker = target.substr(0, _width);
+            if(path(blocker).compare(0, _width, blocker) == 0)
+            {
+                throw std::runtime_error(
+                    "Bucket " + blocker + " blocks its own path");
+            }
+            create_parents(root_directory, blocker);
+            if(rename(
+                directory.c_str(), 
+                (root_directory + "/" + path(blocker)).c_str()) < 0 
+                && errno != ENOENT)
+            {
+                throw std::runtime_error(
+                    "Failed to move " + directory + ": " + strerror(errno));
+            }
+            mkdir(directory.c_str(), 0755);
+        }
+    }
+}
+
+void rmp::bucket_layout::create_directories(
+    const std::string& root_directory,
+    size_t threads) const
+{
+    std::vector<std::string> parents(1, root_directory), children;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next;
+    std::string error_message;
+    std::mutex error_mutex;
+    size_t count = static_cast<size_t>(1) << (4 * _width);
+    threads = std::max(threads, static_cast<size_t>(1));
+    for(size_t level = 0; level < _levels; level++)
+    {
+        children.resize(parents.size() * count);
+        next = 0;
+        // The lower levels hold most of the directories, so split the
+        // parents between threads
+        for(size_t thread = 0; thread < threads; thread++)
+        {
+            workers.emplace_back([&]
+            {
+                std::stringstream component;
+                size_t parent;
+                while((parent = next++) < parents.size())
+                {
+                    for(size_t index = 0; index < count; index++)
+                    {
+                        std::string& child = children[parent * count + index];
+                        component.str("");
+                        component << std::setbase(16) << std::setw(_width) 
+                                  << std::setfill('0') << index;
+                        child = parents[parent] + "/" + component.str();
+                        if(mkdir(child.c_str(), 0755) < 0 && errno != EEXIST)
+                        {
+                            std::unique_lock<std::mutex> lock(error_mutex);
+                            error_message = "Failed to create " + child 
+                                + ": " + strerror(errno);
+                        }
+                    }
+                }
+            });
+        }
+        for(std::thread& worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+        if(error_message.size() > 0)
+        {
+            throw std::runtime_error(error_message);
+        }
+        parents.swap(children);
+    }
+}
+
+rmp::layout_migrator::layout_migrator(
+    const std::string& root_directory,
+    const rmp::bucket_layout& layout,
+    size_t threads) :
+    _root_directory(root_directory),
+    _layout(layout),
+    _threads(std::max(threads, static_cast<size_t>(1))),
+    _busy(0),
+    _stopping(false),
+    _done(false),
+    _moved(0),
+    _failed(0)
+{
+
+}
+
+rmp::layout_migrator::~layout_migrator()
+{
+    stop();
+}
+
+void rmp::layout_migrator::start(std::function<void(bool)> on_finish)
+{
+    _on_finish = on_finish;
+    for(size_t thread = 0; thread < _threads; thread++)
+    {
+        _workers.emplace_back(&rmp::layout_migrator::move, this);
+    }
+    _scanner = std::thread(&rmp::layout_migrator::scan, this);
+}
+
+void rmp::layout_migrator::stop()
+{
+    std::unique_lock<std::mutex> lock(_queue_mutex);
+    _stopping = true;
+    _queue_ready.notify_all();
+    _queue_drained.notify_all();
+    lock.unlock();
+    if(_scanner.joinable())
+    {
+        _scanner.join();
+    }
+    for(std::thread& worker : _workers)
+    {
+        if(worker.joinable())
+        {
+            worker.join();
+        }
+    }
+    _workers.clear();
+}
+
+bool rmp::layout_migrator::done() const
+{
+    return _done;
+}
+
+uint64_t rmp::layout_migrator::moved() const
+{
+    return _moved;
+}
+
+uint64_t rmp::layout_migrator::failed() const
+{
+    return _failed;
+}
+
+void rmp::layout_migrator::scan()
+{
+    DIR * directory;
+    dirent * entry;
+    uint64_t moved;
+    std::unique_lock<std::mutex> lock(_queue_mutex, std::defer_lock);
+
+    // Entries renamed during readdir may be skipped, so scan until a
+    // full pass finds nothing left to move
+    do
+    {
+        moved = _moved;
+        _failed = 0;
+        directory = opendir(_root_directory.c_str());
+        if(directory == nullptr)
+        {
+            fprintf(stderr, "Migration failed to open %s: %s\n",
+                _root_directory.c_str(), strerror(errno));
+            return;
+        }
+        while(!_stopping && (entry = readdir(directory)) != nullptr)
+        {
+            if(is_bucket_file(_root_directory, entry))
+            {
+                lock.lock();
+                _queue.emplace_back(entry->d_name);
+                _queue_ready.notify_one();
+                if(_queue.size() >= MIGRATION_BATCH_SIZE)
+                {
+                    _queue_drained.wait(lock, [this]
+                    {
+                        return _stopping || _queue.size() == 0;
+                    });
+                }
+                lock.unlock();
+            }
+        }
+        closedir(directory);
+
+        lock.lock();
+        _queue_drained.wait(lock, [this]
+        {
+            return _stopping || (_queue.size() == 0 && _busy == 0);
+        });
+        lock.unlock();
+    } while(!_stopping && _moved != moved);
+
+    // Saving the layout would hide buckets that are still flat, so both
+    // layouts stay in use until a later start moves them
+    if(!_stopping && _failed > 0)
+    {
+        fprintf(stderr, "Migration left %llu buckets in the flat layout\n",
+            static_cast<unsigned long long>(_failed.load()));
+    }
+    else if(!_stopping)
+    {
+        try
+        {
+            // A bucket named like a fan-out directory blocks its creation
+            // until it has been moved
+            _layout.create_directories(_root_directory, _threads);
+            _layout.save(_root_directory);
+            _done = true;
+        }
+        catch(const std::exception& e)
+        {
+            fprintf(stderr, "Migration failed: %s\n", e.what());
+        }
+    }
+    if(!_stopping && _on_finish)
+    {
+        _on_finish(_done);
+    }
+
+    lock.lock();
+    _stopping = true;
+    _queue_ready.notify_all();
+}
+
+void rmp::layout_migrator::move()
+{
+    std::string name, source, destination;
+    struct stat status;
+    int error;
+    std::unique_lock<std::mutex> lock(_queue_mutex);
+    while(!_stopping)
+    {
+        _queue_ready.wait(lock, [this]
+        {
+            return _stopping || _queue.size() > 0;
+        });
+        if(_queue.size() > 0)
+        {
+            name = std::move(_queue.front());
+            _queue.pop_front();
+            _busy++;
+            lock.unlock();
+
+            // Requests may have already moved this bucket themselves
+            source = _root_directory + "/" + name;
+            destination = _root_directory + "/" + _layout.path(name);
+            try
+            {
+                _layout.create_parents(_root_directory, name);
+                if(rename(source.c_str(), destination.c_str()) == 0)
+                {
+                    _moved++;
+                }
+                else if(errno != ENOENT)
+                {
+                    // A bucket moved out of a directory's way is replaced
+                    // by that directory
+                    error = errno;
+                    if(lstat(source.c_str(), &status) == 0 
+                        && S_ISREG(status.st_mode))
+                    {
+                        throw std::runtime_error(strerror(error));
+                    }
+                }
+            }
+            catch(const std::exception& e)
+            {
+                _failed++;
+                fprintf(stderr, "Failed to migrate %s: %s\n",
+                    name.c_str(), e.what());
+            }
+
+            lock.lock();
+            _busy--;
+            if(_queue.size() == 0)
+            {
+                _queue_drained.notify_all();
+            }
+        }
+    }
+}
+
+static bool is_bucket_file(
+    const std::string& root_directory, 
+    const dirent * entry)
+{
+    struct stat status;
+    bool result = rmp::bucket_layout::is_bucket_name(entry->d_name);
+
+    // Fan-out directories have hexadecimal names as well
+    if(result && entry->d_type == DT_UNKNOWN)
+    {
+        result = lstat(
+            (root_directory + "/" + entry->d_name).c_str(), 
+            &status) == 0 && S_ISREG(status.st_mode);
+    }
+    else if(result)
+    {
+        result = (entry->d_type == DT_REG);
+    }
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+#include "record_manager.h"
+
+void rmp::lock_profile::contended(const std::string& hash, uint64_t wait)
+{
+    std::unordered_map<std::string,size_t>::iterator found;
+    size_t slot;
+    found = _index.find(hash);
+    if(found != _index.end())
+    {
+        slot = found->second;
+    }
+    else if(_entries.size() < LOCK_PROFILE_ENTRIES)
+    {
+        slot = _entries.size();
+        _entries.emplace_back();
+        _entries[slot].hash = hash;
+        _index.emplace(hash, slot);
+    }
+    else
+    {
+        slot = std::min_element(
+            _entries.begin(), 
+            _entries.end(), 
+            [](const rmp::lock_contention& left, 
+                const rmp::lock_contention& right)
+            {
+                return left.contentions < right.contentions;
+            }) - _entries.begin();
+        _index.erase(_entries[slot].hash);
+        _index.emplace(hash, slot);
+        rmp::lock_contention& replaced = _entries[slot];
+        replaced.hash = hash;
+        replaced.error = replaced.contentions;
+        replaced.wait_total = 0;
+        replaced.wait_max = 0;
+        replaced.hold_total = 0;
+        replaced.holds = 0;
+    }
+
+    rmp::lock_contention& entry = _entries[slot];
+    entry.contentions++;
+    entry.wait_total += wait;
+    entry.wait_max = std::max(entry.wait_max, wait);
+}
+
+void rmp::lock_profile::held(const std::string& hash, uint64_t hold)
+{
+    std::unordered_map<std::string,size_t>::iterator found;
+    // Only hashes that were already contended are worth a hold time
+    found = _index.find(hash);
+    if(found != _index.end())
+    {
+        _entries[found->second].hold_total += hold;
+        _entries[found->second].holds++;
+    }
+}
+
+std::vector<rmp::lock_contention> rmp::lock_profile::top(size_t count) const
+{
+    std::vector<rmp::lock_contention> result(_entries);
+    std::sort(
+        result.begin(), 
+        result.end(), 
+        [](const rmp::lock_contention& left, 
+            const rmp::lock_contention& right)
+        {
+            return left.contentions > right.contentions;
+        });
+    if(result.size() > count)
+    {
+        result.resize(count);
+    }
+    return result;
+}
+
+std::string rmp::lock_profile::report() const
+{
+    std::stringstream output;
+    // Times are kept in nanoseconds and printed in microseconds
+    output << std::fixed << std::setprecision(1);
+    for(const rmp::lock_contention& entry : top(LOCK_REPORT_ENTRIES))
+    {
+        output << entry.hash 
+               << " contentions=" << entry.contentions 
+               << " error=" << entry.error
+               << " wait_avg=" << entry.wait_total / 1000.0 
+                    / (entry.contentions - entry.error)
+               << " wait_max=" << entry.wait_max / 1000.0
+               << " hold_avg=" << (entry.holds > 0 
+                    ? entry.hold_total / 1000.0 / entry.holds : 0.0)
+               << "us" << std::endl;
+    }
+    return output.str();
+}
\ No newline at end of file
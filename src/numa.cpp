@@ -0,0 +1,200 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+
+struct node_counters
+{
+    int loads;
+    int misses;
+};
+
+static std::mutex counters_mutex;
+
+static std::vector<node_counters> counters;
+
+static int open_counter(uint64_t result);
+
+static uint64_t read_counter(int fd);
+
+std::vector<int> rmp::numa::parse_cpus(const std::string& list)
+{
+    std::vector<int> result;
+    std::stringstream stream(list);
+    std::string range;
+    size_t separator;
+    int first, last;
+    // Same format as /sys cpulist files, for example 0-3,8-11
+    while(std::getline(stream, range, ','))
+    {
+        separator = range.find('-');
+        first = std::stoi(range.substr(0, separator));
+        last = (separator == std::string::npos) 
+            ? first 
+            : std::stoi(range.substr(separator + 1));
+        if(first < 0 || last < first)
+        {
+            throw std::invalid_argument("Invalid CPU range " + range);
+        }
+        for(int cpu = first; cpu <= last; cpu++)
+        {
+            result.push_back(cpu);
+        }
+    }
+    return result;
+}
+
+int rmp::numa::node_of_cpu(int cpu)
+{
+    int result = 0;
+    std::string directory = "/sys/devices/system/cpu/cpu" 
+        + std::to_string(cpu);
+    DIR * handle = opendir(directory.c_str());
+    dirent * entry;
+    // The CPU directory holds a nodeN link to the node it belongs to
+    while(handle != nullptr && (entry = readdir(handle)) != nullptr)
+    {
+        if(strncmp(entry->d_name, "node", 4) == 0 
+            && isdigit(entry->d_name[4]))
+        {
+            result = atoi(entry->d_name + 4);
+        }
+    }
+    if(handle != nullptr)
+    {
+        closedir(handle);
+    }
+    return result;
+}
+
+bool rmp::numa::allowed(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    return cpu < CPU_SETSIZE
+        && sched_getaffinity(0, sizeof(set), &set) == 0 
+        && CPU_ISSET(cpu, &set);
+}
+
+void rmp::numa::pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        throw std::runtime_error("Failed to pin thread to CPU " 
+            + std::to_string(cpu));
+    }
+}
+
+void rmp::numa::bind(void * address, size_t size, int node)
+{
+    unsigned long mask = 1UL << node;
+    // Preferred rather than strict so a full node falls back instead of
+    // failing, pages already touched are moved
+    if(node >= 0 && node < static_cast<int>(sizeof(mask) * 8))
+    {
+        syscall(
+            SYS_mbind, 
+            address, 
+            size, 
+            MPOL_PREFERRED, 
+            &mask, 
+            sizeof(mask) * 8, 
+            MPOL_MF_MOVE);
+    }
+}
+
+void rmp::numa::track_thread()
+{
+    node_counters thread_counters;
+    thread_counters.loads = open_counter(PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+    thread_counters.misses = open_counter(PERF_COUNT_HW_CACHE_RESULT_MISS);
+    if(thread_counters.loads >= 0 && thread_counters.misses >= 0)
+    {
+        std::unique_lock<std::mutex> lock(counters_mutex);
+        counters.push_back(thread_counters);
+    }
+    else
+    {
+        // Counters are unavailable in most containers and VMs
+        for(int fd : {thread_counters.loads, thread_counters.misses})
+        {
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+}
+
+rmp::numa_metrics rmp::numa::metrics()
+{
+    rmp::numa_metrics result;
+    uint64_t loads, misses;
+    std::unique_lock<std::mutex> lock(counters_mutex);
+    // Node loads count every load reaching memory, misses the ones
+    // served by a remote node
+    for(const node_counters& thread_counters : counters)
+    {
+        loads = read_counter(thread_counters.loads);
+        misses = read_counter(thread_counters.misses);
+        result.local += (loads > misses) ? loads - misses : 0;
+        result.remote += misses;
+    }
+    result.available = !counters.empty();
+    return result;
+}
+
+static int open_counter(uint64_t result)
+{
+    perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = PERF_TYPE_HW_CACHE;
+    attributes.config = PERF_COUNT_HW_CACHE_NODE 
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) 
+        | (result << 16);
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    return static_cast<int>(
+        syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+}
+
+static uint64_t read_counter(int fd)
+{
+    uint64_t result = 0;
+    if(read(fd, &result, sizeof(result)) != sizeof(result))
+    {
+        result = 0;
+    }
+    return result;
+}
\ No newline at end of file
@@ -24,6 +24,9 @@
  *******************************************************************/
 
 #include "record_manager.h"
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
 
 static bool validate_request(
     const rmp::request& request, 
@@ -34,8 +37,106 @@ static void allocate_buffer(
     size_t suggested_size, 
     uv_buf_t *buf);
 
-static int find_record(
-    const rmp::bucket bucket, const rmp::record& record);
+static void close_callback(uv_handle_t * handle);
+
+static uv_stream_t * create_client(uv_stream_t * server);
+
+static void lag_callback(uv_timer_t * handle);
+
+static bool refuse_connection();
+
+struct write_context
+{
+    uv_write_t request;
+    uv_stream_t * client;
+    std::string buffer;
+    rmp::request_trace * trace = nullptr;
+    uint64_t write_begin = 0;
+};
+
+static void write_response(
+    uv_stream_t * client, 
+    write_context * context, 
+    uv_write_cb callback);
+
+static size_t shard_index(const std::string& hash, size_t shards);
+
+static int listen_socket(uint16_t port);
+
+static void steer_connections(
+    uv_tcp_t * handle, 
+    const std::vector<int>& cpus, 
+    size_t shards);
+
+static void enable_busy_poll(uv_tcp_t * client);
+
+// How long a read on a busy polled socket may spin on the device queue
+const int BUSY_POLL_SOCKET_MICROSECONDS = 50;
+
+// Period of the timer measuring how late each event loop runs
+const uint64_t LAG_INTERVAL_MILLISECONDS = 100;
+
+struct loop_clock
+{
+    uv_timer_t timer;
+    uint64_t expected;
+};
+
+// Responses the loop writes per pass over the response queue
+const size_t RESPONSE_BATCH = 32;
+
+// Messages in flight from one shard to another before a shard stops
+// accepting more and queues them locally
+const size_t SHARD_QUEUE_CAPACITY = 4096;
+
+// Forwarded requests carry the raw bytes both ways, the owning shard
+// parses them on its own arena and replaces them with the response
+struct rmp::server::shard_message
+{
+    std::string data;
+    uv_stream_t * client;
+    size_t origin;
+    bool handled;
+    rmp::request_trace * trace;
+};
+
+struct rmp::server::shard
+{
+    size_t index;
+    rmp::server * owner;
+    partition data;
+    uv_loop_t loop;
+    uv_tcp_t handle;
+    uv_async_t async;
+    uv_idle_t idle;
+    // inbound[source] is only ever pushed to by that source shard
+    std::vector<std::unique_ptr<
+        rmp::spsc_queue<shard_message*>>> inbound;
+    std::deque<std::pair<size_t,shard_message*>> backlog;
+    std::thread thread;
+    uint64_t activity;
+};
+
+// A client on the same host exchanging requests through shared memory,
+// served by its own thread until either side hangs up
+struct rmp::server::channel
+{
+    rmp::shm_channel memory;
+    int socket = -1;
+    rmp::request_arena arena;
+    std::thread thread;
+    std::atomic<bool> finished{false};
+};
+
+// Largest initial block an arena grows to, bigger requests allocate
+const size_t MAX_ARENA_BLOCK = 16 * 1024 * 1024;
+
+// Heap blocks handed to arenas by the current thread
+static thread_local size_t arena_blocks = 0;
+
+static void * allocate_arena_block(size_t size);
+
+static void deallocate_arena_block(void * block, size_t size);
 
 std::string rmp::djb_hash(const std::string& data)
 {
@@ -53,6 +154,23 @@ static void write_request(int socket, const rmp::request& request);
 
 static void read_response(int socket, rmp::response& response);
 
+static int read_descriptor(int socket, rmp::response& response);
+
+static bool send_descriptor(
+    int socket, 
+    const std::string& data, 
+    int descriptor);
+
+static bool peer_open(int socket);
+
+static bool channel_request(const char * data, size_t size);
+
+// How long either side of a channel sleeps before checking its peer
+const int CHANNEL_POLL_MILLISECONDS = 100;
+
+// A channel request carries only its command, real requests are longer
+const size_t CHANNEL_REQUEST_SIZE = 16;
+
 rmp::client::client(const std::string& host, uint16_t port)
 {
     set_address(host,port);
@@ -60,12 +178,15 @@ rmp::client::client(const std::string& host, uint16_t port)
 
 rmp::client::~client()
 {
-
+    if(_channel)
+    {
+        close_channel();
+    }
 }
 
 void rmp::client::open_connection()
 {
-    _socket = socket(PF_INET,SOCK_STREAM,0);
+    _socket = socket(_address.ss_family,SOCK_STREAM,0);
     if(_socket < 0)
     {
         throw std::runtime_error("Failed to open socket");
@@ -74,7 +195,7 @@ void rmp::client::open_connection()
     if(connect(
         _socket,
         reinterpret_cast<const sockaddr*>(&_address),
-        sizeof(_address)) < 0)
+        _address_length) < 0)
     {
         close(_socket);
         throw std::runtime_error("Failed to connect socket");
@@ -92,9 +213,32 @@ void rmp::client::close_connection()
 void rmp::client::set_address(
     const std::string& host, uint16_t port)
 {
-    _address.sin_family = AF_INET;
-    inet_pton(AF_INET,host.c_str(),&_address.sin_addr.s_addr);
-    _address.sin_port = htons(port);
+    const std::string prefix("unix:");
+    sockaddr_in * inet;
+    sockaddr_un * local;
+    std::string path;
+    memset(&_address, 0, sizeof(_address));
+    // A unix: host names the server's socket file, the port is unused
+    if(host.compare(0, prefix.size(), prefix) == 0)
+    {
+        path = host.substr(prefix.size());
+        local = reinterpret_cast<sockaddr_un*>(&_address);
+        if(path.empty() || path.size() >= sizeof(local->sun_path))
+        {
+            throw std::runtime_error("Invalid unix socket path " + path);
+        }
+        local->sun_family = AF_UNIX;
+        memcpy(local->sun_path, path.c_str(), path.size());
+        _address_length = sizeof(sockaddr_un);
+    }
+    else
+    {
+        inet = reinterpret_cast<sockaddr_in*>(&_address);
+        inet->sin_family = AF_INET;
+        inet_pton(AF_INET,host.c_str(),&inet->sin_addr.s_addr);
+        inet->sin_port = htons(port);
+        _address_length = sizeof(sockaddr_in);
+    }
 }
 
 std::pair<bool,std::string> rmp::client::create_record(
@@ -153,6 +297,117 @@ std::pair<bool,std::string> rmp::client::delete_record(
         record);
 }
 
+std::pair<bool,std::string> rmp::client::server_statistics()
+{
+    rmp::record record;
+    return process_request(
+        rmp::command_codes::STATS,
+        record);
+}
+
+std::pair<bool,std::string> rmp::client::lock_contention()
+{
+    rmp::record record;
+    return process_request(
+        rmp::command_codes::LOCKS,
+        record);
+}
+
+std::pair<bool,std::string> rmp::client::export_records(
+    const std::string& path)
+{
+    rmp::record record;
+    record.set_email(path);
+    return process_request(
+        rmp::command_codes::EXPORT,
+        record);
+}
+
+void rmp::client::set_shared_memory(bool enabled)
+{
+    _shared_memory = enabled;
+    if(!enabled && _channel)
+    {
+        close_channel();
+    }
+}
+
+void rmp::client::open_channel()
+{
+    rmp::request request;
+    rmp::response response;
+    int descriptor = -1;
+    // Only a server on the same host can share memory
+    if(_address.ss_family == AF_UNIX)
+    {
+        open_connection();
+        request.set_command(rmp::command_codes::OPEN_CHANNEL);
+        write_request(_socket, request);
+        descriptor = read_descriptor(_socket, response);
+    }
+
+    if(descriptor >= 0 && response.status() == rmp::status_codes::GOOD)
+    {
+        // The connection stays open, its hang up tells the server the
+        // channel is gone
+        _channel_socket = _socket;
+        _channel.reset(new rmp::shm_channel(descriptor));
+    }
+    else
+    {
+        if(descriptor >= 0)
+        {
+            close(descriptor);
+        }
+        if(_address.ss_family == AF_UNIX)
+        {
+            close_connection();
+        }
+        _shared_memory = false;
+    }
+}
+
+void rmp::client::close_channel()
+{
+    _channel->close();
+    _channel.reset();
+    close(_channel_socket);
+    _channel_socket = -1;
+}
+
+void rmp::client::exchange(
+    const rmp::request& request, 
+    rmp::response& response)
+{
+    size_t size = request.ByteSizeLong();
+    const char * data = nullptr;
+    char * frame = _channel->reserve(
+        rmp::channel_rings::REQUEST_RING, 
+        size);
+    if(frame == nullptr)
+    {
+        throw std::runtime_error("Request exceeds the channel capacity");
+    }
+    // Serialized straight into the ring the server parses it from
+    request.SerializeToArray(frame, static_cast<int>(size));
+    _channel->commit(rmp::channel_rings::REQUEST_RING, size);
+    while(data == nullptr)
+    {
+        data = _channel->receive(
+            rmp::channel_rings::RESPONSE_RING, 
+            size, 
+            CHANNEL_POLL_MILLISECONDS);
+        if(data == nullptr 
+            && (_channel->closed() || !peer_open(_channel_socket)))
+        {
+            close_channel();
+            throw std::runtime_error("Shared memory channel closed");
+        }
+    }
+    response.ParseFromArray(data, static_cast<int>(size));
+    _channel->release(rmp::channel_rings::RESPONSE_RING);
+}
+
 std::pair<bool,std::string> rmp::client::process_request(
     int command,
     const rmp::record& record)
@@ -162,12 +417,24 @@ std::pair<bool,std::string> rmp::client::process_request(
     std::pair<bool,std::string> result;
     try
     {
-        open_connection();
         request.set_command(command);
         *request.mutable_payload() = record;
-        write_request(_socket,request);
-        read_response(_socket,response);
-        close_connection();
+        if(_shared_memory && !_channel)
+        {
+            open_channel();
+        }
+
+        if(_channel)
+        {
+            exchange(request, response);
+        }
+        else
+        {
+            open_connection();
+            write_request(_socket,request);
+            read_response(_socket,response);
+            close_connection();
+        }
         result.first = (response.status() == rmp::status_codes::GOOD);
         result.second = response.payload();
     }
@@ -179,7 +446,87 @@ std::pair<bool,std::string> rmp::client::process_request(
     return result;
 }
 
-rmp::server::server(uint16_t port, const std::string& root_directory)
+rmp::request_arena::request_arena(size_t initial_size) :
+    _initial_block(initial_size),
+    _allocations(0)
+{
+    rmp::statistics::allocate(
+        rmp::memory_subsystems::MEMORY_MESSAGES, 
+        initial_size);
+    create();
+}
+
+rmp::request_arena::~request_arena()
+{
+    _arena.reset();
+    rmp::statistics::release(
+        rmp::memory_subsystems::MEMORY_MESSAGES, 
+        _initial_block.size());
+}
+
+google::protobuf::Arena * rmp::request_arena::get()
+{
+    return _arena.get();
+}
+
+void rmp::request_arena::reset()
+{
+    size_t used;
+    if(allocations() > 0 && _initial_block.size() < MAX_ARENA_BLOCK)
+    {
+        // Grow the initial block so the next request of this size is 
+        // served without touching the heap
+        used = std::min(
+            static_cast<size_t>(_arena->SpaceAllocated()), 
+            MAX_ARENA_BLOCK);
+        _arena.reset();
+        used = std::max(used, _initial_block.size() * 2);
+        rmp::statistics::allocate(
+            rmp::memory_subsystems::MEMORY_MESSAGES, 
+            used - _initial_block.size());
+        _initial_block.resize(used);
+        create();
+    }
+    else
+    {
+        _arena->Reset();
+        _allocations = arena_blocks;
+    }
+}
+
+size_t rmp::request_arena::allocations() const
+{
+    return arena_blocks - _allocations;
+}
+
+size_t rmp::request_arena::initial_size() const
+{
+    return _initial_block.size();
+}
+
+void rmp::request_arena::create()
+{
+    google::protobuf::ArenaOptions options;
+    options.initial_block = _initial_block.data();
+    options.initial_block_size = _initial_block.size();
+    options.block_alloc = allocate_arena_block;
+    options.block_dealloc = deallocate_arena_block;
+    _arena.reset(new google::protobuf::Arena(options));
+    _allocations = arena_blocks;
+}
+
+rmp::server::server(uint16_t port, const std::string& root_directory) :
+    _shard_count(0),
+    _stopping(false),
+    _busy_poll(0),
+    _activity(0),
+    _engine(rmp::network_engines::UV_ENGINE),
+    _zerocopy(false),
+    _trace_sample(100),
+    _slow_threshold(10000),
+    _slow_log_size(64 * 1024 * 1024),
+    _worker_count(0),
+    _response_stalls(0)
 {
     _loop = std::shared_ptr<uv_loop_t>(uv_default_loop(),[](uv_loop_t * loop)
     {
@@ -202,317 +549,1262 @@ void rmp::server::set_port(uint16_t port)
 
 void rmp::server::set_root_directory(const std::string& root_directory)
 {
-    _root_directory = root_directory;
+    _partition.records.set_root_directory(root_directory);
 }
 
-void rmp::server::start()
+void rmp::server::set_io_mode(rmp::io_modes io_mode)
 {
-    uv_signal_init(_loop.get(),&_signal);
-    uv_signal_start(
-        &_signal,
-        uv_signal_callback,
-        SIGINT);
-    
-    sockaddr_in addr;
-    uv_ip4_addr("0.0.0.0", _port, &addr);
-    uv_tcp_init(_loop.get(), &_handle);
-    uv_tcp_bind(
-        &_handle,
-        reinterpret_cast<const sockaddr*>(&addr), 0);
-    if(uv_listen(
-        reinterpret_cast<uv_stream_t*>(&_handle),
-        100,uv_new_connection_callback) > 0)
-    {
-        throw std::runtime_error("Failed to listen");
-    }
-    uv_run(_loop.get(),UV_RUN_DEFAULT);
+    _partition.records.set_io_mode(io_mode);
 }
 
-void rmp::server::stop()
+void rmp::server::set_cache_capacity(size_t capacity)
 {
+    _partition.records.set_cache_capacity(capacity);
+}
 
+void rmp::server::set_readahead(size_t readahead)
+{
+    _partition.records.set_readahead(readahead);
 }
 
-void rmp::server::uv_read_callback(
-    uv_stream_t *client, 
-    ssize_t nread, 
-    const uv_buf_t *buf)
+void rmp::server::set_descriptor_capacity(size_t capacity)
 {
-    rmp::server * server = reinterpret_cast<rmp::server*>(
-        client->loop->data);
-    rmp::request request;
-    rmp::response response;
-    std::string response_buffer;
-    uv_buf_t wrbuf;
-    uv_write_t * req = new uv_write_t;
-    
-    if (nread < 0) 
-    {
-        if (nread != UV_EOF) 
-        {
-            fprintf(stderr, "Read error %s\n", uv_err_name(nread));
-            uv_close((uv_handle_t*) client, NULL);
-        }
-    } 
-    else if (nread > 0) 
-    {
-        request.ParseFromArray(buf->base,nread);
-        server->handle_request(request,response);
-        response_buffer = response.SerializeAsString();
-        wrbuf = uv_buf_init(
-            const_cast<char*>(
-                response_buffer.c_str()), 
-            response_buffer.size());
-        req->data = client;
-        uv_write(req, client, &wrbuf, 1, uv_write_callback);
-    }
+    _partition.records.set_descriptor_capacity(capacity);
+}
 
-    if (buf->base) 
-    {
-        free(buf->base);
-    }
+void rmp::server::set_openat(bool use_openat)
+{
+    _partition.records.set_openat(use_openat);
 }
 
-void rmp::server::uv_write_callback(
-    uv_write_t *req, 
-    int status)
+void rmp::server::set_layout(const rmp::bucket_layout& layout)
 {
-    uv_close(reinterpret_cast<uv_handle_t*>(
-        req->data),0);
-    delete reinterpret_cast<uv_handle_t*>(
-        req->data);    
-    delete req;
+    _partition.records.set_layout(layout);
 }
 
-void rmp::server::uv_new_connection_callback(
-    uv_stream_t *server, 
-    int status)
+void rmp::server::set_migration_threads(size_t threads)
 {
-    uv_tcp_t* client = new uv_tcp_t;
-    uv_tcp_init(server->loop,client);
-    if(uv_accept(
-        server,
-        reinterpret_cast<uv_stream_t*>(client)) == 0)
-    {
-        uv_read_start(
-            reinterpret_cast<uv_stream_t*>(client),
-            allocate_buffer,
-            uv_read_callback);
-    }
-    else
-    {
-        uv_close(
-            reinterpret_cast<uv_handle_t*>(client),0);
-    }
-    
+    _partition.records.set_migration_threads(threads);
 }
 
-void rmp::server::uv_signal_callback(
-    uv_signal_t *handle, 
-    int signum)
+void rmp::server::set_memory_tier(bool memory_tier)
 {
-    int result = uv_loop_close(handle->loop);
-    if (result == UV_EBUSY)
-    {
-        uv_walk(handle->loop, uv_walk_callback, NULL);
-    }
+    _partition.records.set_memory_tier(memory_tier);
 }
 
-void rmp::server::uv_walk_callback(
-    uv_handle_t* handle, void* arg)
+void rmp::server::set_shards(size_t shards)
+{
+    _shard_count = shards;
+}
+
+void rmp::server::set_workers(size_t workers)
 {
-    uv_close(handle,0);
+    _worker_count = workers;
 }
 
-void rmp::server::aquire_lock(const std::string& hash)
+uint64_t rmp::server::arena_allocations() const
 {
-    std::unique_lock<std::mutex> lock(
-        _thread_locks_mutex, std::defer_lock);
-    while(_thread_locks.find(hash) != _thread_locks.end())
+    uint64_t result = _partition.arena_allocations;
+    for(const std::shared_ptr<shard>& current : _shards)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        result += current->data.arena_allocations;
     }
-    lock.lock();
-    // Aquire thread lock
-    _thread_locks.insert(hash);
-    lock.unlock();
+    return result;
 }
 
-void rmp::server::release_lock(const std::string& hash)
+void rmp::server::set_cpus(const std::vector<int>& cpus)
 {
-    std::unique_lock<std::mutex> lock(
-        _thread_locks_mutex, std::defer_lock);
-    lock.lock();
-    // Release thread lock
-    _thread_locks.erase(hash);
-    lock.unlock();
+    _cpus = cpus;
 }
 
-void rmp::server::load_bucket(
-    const std::string & hash, 
-    rmp::bucket& bucket)
+void rmp::server::set_busy_poll(uint64_t idle_microseconds)
 {
-    std::fstream bucket_stream(
-        _root_directory + "/" + hash,
-        std::ios::in);
-    
-    bucket.clear_records();
+    _busy_poll = idle_microseconds;
+}
 
-    if(bucket_stream.good())
-    {
-        bucket.ParseFromIstream(
-            &bucket_stream);
-    }
+void rmp::server::set_network_engine(rmp::network_engines engine)
+{
+    _engine = engine;
 }
 
-void rmp::server::store_bucket(
-    const std::string & hash, 
-    const rmp::bucket& bucket)
+void rmp::server::set_zerocopy(bool zerocopy)
 {
-    std::fstream bucket_stream(
-        _root_directory + "/" + hash,
-        std::ios::out);
+    _zerocopy = zerocopy;
+}
 
-    bucket.SerializeToOstream(
-        &bucket_stream);
+void rmp::server::set_unix_socket(const std::string& path)
+{
+    _unix_path = path;
 }
 
-void rmp::server::handle_request(
-    const rmp::request& request,
-    rmp::response& response)
+void rmp::server::set_lock_threshold(uint64_t milliseconds)
 {
-    std::string error_message;
-    if(validate_request(request,error_message))
-    {
-        switch (request.command())
-        {
-        case rmp::command_codes::CREATE_RECORD:
-            response = on_create(request.payload());
-            break;
-        case rmp::command_codes::READ_RECORD:
-            response = on_read(request.payload());
-            break;
-        case rmp::command_codes::UPDATE_RECORD:
-            response = on_update(request.payload());
-            break;
-        case rmp::command_codes::DELETE_RECORD:
-            response = on_delete(request.payload());
-            break;        
-        default:
-            break;
-        }
-    }
-    else
-    {
-        response.set_status(
-            rmp::status_codes::BAD);
-        *response.mutable_payload() = error_message;
-    }
+    _partition.records.set_lock_threshold(milliseconds);
 }
 
-rmp::response rmp::server::on_create(
-    const rmp::record& record)
+void rmp::server::set_slow_log(const std::string& path)
 {
-    std::string hash;
-    rmp::bucket bucket;
-    rmp::response result;
-    hash = djb_hash(record.email());
-    aquire_lock(hash);
-    load_bucket(hash, bucket);
-    if(find_record(bucket,record) == -1)
-    {
-        *bucket.add_records() = record;
-        result.set_status(
-            rmp::status_codes::GOOD);
-        store_bucket(hash,bucket);
-    }
-    else
-    {
-        result.set_status(
-            rmp::status_codes::BAD);
-        *result.mutable_payload() = "Record already exists";
-    }
-    release_lock(hash);
-    return result;
+    _slow_log_path = path;
 }
 
-rmp::response rmp::server::on_read(
-    const rmp::record& record)
+void rmp::server::set_slow_threshold(uint64_t microseconds)
 {
-    std::string hash;
-    rmp::bucket bucket;
-    int index;
-    rmp::response result;
-    hash = djb_hash(record.email());
-    aquire_lock(hash);
-    load_bucket(hash, bucket);    
-    index = find_record(bucket,record);
-    if(index != -1)
-    {
-        bucket.records(index).SerializeToString(
-            result.mutable_payload());
-    }
-    else
-    {
-        result.set_status(
-            rmp::status_codes::BAD);
-        *result.mutable_payload() = "Record does not exist";
-    }
-    release_lock(hash);
-    return result;
+    _slow_threshold = microseconds;
 }
 
-rmp::response rmp::server::on_update(
-    const rmp::record& record)
+void rmp::server::set_slow_log_size(uint64_t bytes)
 {
-    std::string hash;
-    rmp::bucket bucket;
-    int index;
-    rmp::response result;
-    hash = djb_hash(record.email());
-    aquire_lock(hash);
-    load_bucket(hash, bucket);    
-    index = find_record(bucket,record);
-    if(index != -1)
-    {
-        result.set_status(
+    _slow_log_size = bytes;
+}
+
+void rmp::server::set_memory_limit(uint64_t bytes)
+{
+    rmp::statistics::set_memory_limit(bytes);
+}
+
+void rmp::server::set_trace(const std::string& path)
+{
+    _trace_path = path;
+}
+
+void rmp::server::set_trace_sample(size_t sample)
+{
+    _trace_sample = sample;
+}
+
+rmp::numa_metrics rmp::server::memory_locality() const
+{
+    return rmp::numa::metrics();
+}
+
+rmp::queue_metrics rmp::server::request_queue_metrics() const
+{
+    rmp::queue_metrics result;
+    if(_workers)
+    {
+        result = _workers->metrics();
+    }
+    return result;
+}
+
+rmp::queue_metrics rmp::server::response_queue_metrics() const
+{
+    rmp::queue_metrics result;
+    result.depth = _responses.size();
+    result.enqueued = _responses.pushed();
+    result.stalls = _response_stalls.load();
+    return result;
+}
+
+std::string rmp::server::report() const
+{
+    std::stringstream output;
+    const char * names[] = {"request_queue", "response_queue"};
+    rmp::queue_metrics queues[] = {
+        request_queue_metrics(), 
+        response_queue_metrics()};
+    rmp::numa_metrics locality = memory_locality();
+    output << rmp::statistics::report();
+    // Heap blocks the request arenas needed beyond their initial block,
+    // flat once every arena has grown to the largest request
+    output << "arena_allocations " << arena_allocations() << std::endl;
+    // The queues between the loop and the workers stay empty without them
+    for(size_t queue = 0; queue < 2; queue++)
+    {
+        output << names[queue] << "_depth " << queues[queue].depth 
+               << std::endl
+               << names[queue] << "_enqueued " << queues[queue].enqueued 
+               << std::endl
+               << names[queue] << "_stalls " << queues[queue].stalls 
+               << std::endl
+               << names[queue] << "_parks " << queues[queue].parks 
+               << std::endl;
+    }
+    // Loads served by the local and by remote nodes, from perf counters
+    if(locality.available)
+    {
+        output << "numa_local_loads " << locality.local << std::endl
+               << "numa_remote_loads " << locality.remote << std::endl
+               << "numa_local_ratio " << std::fixed << std::setprecision(3)
+               << (locality.local + locality.remote > 0 
+                   ? static_cast<double>(locality.local) 
+                       / (locality.local + locality.remote) 
+                   : 1.0)
+               << std::endl;
+    }
+    else
+    {
+        output << "numa_locality unavailable" << std::endl;
+    }
+    return output.str();
+}
+
+size_t rmp::server::export_records(const std::string& path)
+{
+    size_t result;
+    uint32_t size;
+    std::ofstream file;
+    // Every shard has its own table and versions, no snapshot spans them
+    if(!_shards.empty())
+    {
+        throw std::runtime_error("Export is not available with shards");
+    }
+    else if(!_partition.records.memory_tier())
+    {
+        throw std::runtime_error("Export requires the memory tier");
+    }
+
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if(!file.is_open())
+    {
+        throw std::runtime_error("Failed to open " + path);
+    }
+
+    // Consistent as of the snapshot while writers keep going, each
+    // record is written as a 32 bit length followed by its bytes
+    result = _partition.records.scan([&](
+        const std::string& email, 
+        const std::string& record)
+    {
+        size = static_cast<uint32_t>(record.size());
+        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        file.write(record.data(), record.size());
+    });
+
+    file.close();
+    if(file.fail())
+    {
+        throw std::runtime_error("Failed to write " + path);
+    }
+    return result;
+}
+
+void rmp::server::start()
+{
+    // Pinning happens on the loop and worker threads, where it cannot
+    // fail the start any more
+    for(int cpu : _cpus)
+    {
+        if(!rmp::numa::allowed(cpu))
+        {
+            throw std::runtime_error(
+                "CPU " + std::to_string(cpu) + " is not available");
+        }
+    }
+
+    if(_shard_count > 0 && _worker_count > 0)
+    {
+        throw std::runtime_error("Shards and workers cannot be combined");
+    }
+    else if(_engine == rmp::network_engines::EPOLL_ENGINE 
+        && (_shard_count > 0 || _worker_count > 0))
+    {
+        throw std::runtime_error("The epoll engine runs a single loop");
+    }
+    _partition.records.open();
+    if(!_trace_path.empty())
+    {
+        rmp::tracer::enable(_trace_path, _trace_sample);
+    }
+    if(!_slow_log_path.empty())
+    {
+        rmp::slow_log::enable(
+            _slow_log_path, 
+            _slow_threshold, 
+            _slow_log_size);
+    }
+
+    if(_shard_count > 0)
+    {
+        start_shards();
+    }
+    else
+    {
+        _partition.records.load();
+        if(_engine == rmp::network_engines::EPOLL_ENGINE)
+        {
+            start_engine();
+        }
+        else
+        {
+            start_loop();
+        }
+    }
+
+    if(!_unix_path.empty())
+    {
+        stop_channels();
+        unlink(_unix_path.c_str());
+    }
+
+    if(!_trace_path.empty())
+    {
+        rmp::tracer::disable();
+    }
+    if(!_slow_log_path.empty())
+    {
+        rmp::slow_log::disable();
+    }
+}
+
+void rmp::server::start_loop()
+{
+    if(_worker_count > 0)
+    {
+        // Workers hand responses back to the loop through this queue
+        uv_async_init(
+            _loop.get(), 
+            &_responses_async, 
+            uv_response_callback);
+        _workers.reset(new rmp::worker_pool());
+        for(size_t worker = 0; worker < _worker_count; worker++)
+        {
+            _worker_arenas.emplace_back(new rmp::request_arena());
+        }
+        _workers->start(
+            _worker_count, 
+            [this](size_t worker, void ** jobs, size_t count)
+            {
+                run_jobs(worker, jobs, count);
+            },
+            [this](size_t worker)
+            {
+                place_thread(worker + 1);
+            });
+    }
+
+    uv_signal_init(_loop.get(),&_signal);
+    uv_signal_start(
+        &_signal,
+        uv_signal_callback,
+        SIGINT);
+    
+    sockaddr_in addr;
+    uv_ip4_addr("0.0.0.0", _port, &addr);
+    uv_tcp_init(_loop.get(), &_handle);
+    uv_tcp_bind(
+        &_handle,
+        reinterpret_cast<const sockaddr*>(&addr), 0);
+    if(uv_listen(
+        reinterpret_cast<uv_stream_t*>(&_handle),
+        100,uv_new_connection_callback) > 0)
+    {
+        throw std::runtime_error("Failed to listen");
+    }
+    if(!_unix_path.empty())
+    {
+        listen_pipe(_loop.get(), uv_new_connection_callback);
+    }
+    place_thread(0);
+    run_loop(_loop.get(), _activity);
+}
+
+void rmp::server::start_engine()
+{
+    rmp::epoll_engine * engine = new rmp::epoll_engine();
+    engine->set_zerocopy(_zerocopy);
+    engine->set_busy_poll(_busy_poll);
+    _network.reset(engine);
+    _network->listen(_port);
+    if(!_unix_path.empty())
+    {
+        _network->listen(_unix_path);
+    }
+    place_thread(0);
+    _network->run([this](
+        const char * data, 
+        size_t size, 
+        std::string& output)
+    {
+        rmp::request * request;
+        request = parse(_partition.arena, data, size);
+        process(_partition, _partition.arena, *request, output);
+        rmp::tracer::end(rmp::tracer::detach());
+    });
+}
+
+void rmp::server::listen_pipe(
+    uv_loop_t * loop, 
+    uv_connection_cb callback)
+{
+    // A socket file left behind by an earlier run would fail the bind
+    unlink(_unix_path.c_str());
+    uv_pipe_init(loop, &_pipe, 0);
+    if(uv_pipe_bind(&_pipe, _unix_path.c_str()) < 0 
+        || uv_listen(
+            reinterpret_cast<uv_stream_t*>(&_pipe), 
+            100, 
+            callback) < 0)
+    {
+        throw std::runtime_error("Failed to listen on " + _unix_path);
+    }
+}
+
+void rmp::server::open_channel(uv_stream_t * client)
+{
+    std::shared_ptr<channel> target;
+    std::list<std::shared_ptr<channel>>::iterator current;
+    rmp::response response;
+    uv_os_fd_t fd;
+    std::lock_guard<std::mutex> lock(_channels_mutex);
+    // Channels whose client went away are joined here, off the request
+    // path of the loop
+    current = _channels.begin();
+    while(current != _channels.end())
+    {
+        if((*current)->finished)
+        {
+            (*current)->thread.join();
+            current = _channels.erase(current);
+        }
+        else
+        {
+            current++;
+        }
+    }
+
+    try
+    {
+        // The memory descriptor travels with the response, the channel
+        // keeps its own copy of the connection once libuv closes it
+        target = std::make_shared<channel>();
+        if(uv_fileno(reinterpret_cast<uv_handle_t*>(client), &fd) == 0)
+        {
+            target->socket = dup(fd);
+        }
+        response.set_status(rmp::status_codes::GOOD);
+        response.set_payload("Channel open");
+        if(target->socket < 0 || !send_descriptor(
+            target->socket, 
+            response.SerializeAsString(), 
+            target->memory.descriptor()))
+        {
+            throw std::runtime_error("Failed to pass the channel");
+        }
+        rmp::statistics::add(
+            rmp::statistics::local().connections_opened, 
+            1);
+        RMP_PROBE(connection__accept, target.get(), target->socket);
+        target->thread = std::thread(
+            &rmp::server::run_channel, 
+            this, 
+            std::ref(*target));
+        _channels.push_back(target);
+    }
+    catch(const std::exception& e)
+    {
+        fprintf(stderr, "Channel not opened: %s\n", e.what());
+        if(target && target->socket >= 0)
+        {
+            close(target->socket);
+        }
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(client), close_callback);
+}
+
+void rmp::server::run_channel(channel& target)
+{
+    rmp::thread_statistics& statistics = rmp::statistics::local();
+    rmp::request * request;
+    std::string output;
+    const char * data;
+    char * frame;
+    size_t size;
+    bool open = true;
+    while(open && !_stopping)
+    {
+        data = target.memory.receive(
+            rmp::channel_rings::REQUEST_RING, 
+            size, 
+            CHANNEL_POLL_MILLISECONDS);
+        if(data != nullptr)
+        {
+            request = parse(target.arena, data, size);
+            target.memory.release(rmp::channel_rings::REQUEST_RING);
+            rmp::statistics::add(statistics.bytes_in, size);
+            process(_partition, target.arena, *request, output);
+            rmp::tracer::end(rmp::tracer::detach());
+            rmp::statistics::add(statistics.bytes_out, output.size());
+            frame = target.memory.reserve(
+                rmp::channel_rings::RESPONSE_RING, 
+                output.size());
+            open = (frame != nullptr);
+            if(open)
+            {
+                memcpy(frame, output.data(), output.size());
+                target.memory.commit(
+                    rmp::channel_rings::RESPONSE_RING, 
+                    output.size());
+            }
+        }
+        else
+        {
+            // A client that died without closing is only noticed here
+            open = !target.memory.closed() && peer_open(target.socket);
+        }
+    }
+    target.memory.close();
+    RMP_PROBE(connection__close, &target, target.socket);
+    close(target.socket);
+    rmp::statistics::add(statistics.connections_closed, 1);
+    target.finished = true;
+}
+
+void rmp::server::stop_channels()
+{
+    std::lock_guard<std::mutex> lock(_channels_mutex);
+    _stopping = true;
+    for(std::shared_ptr<channel>& target : _channels)
+    {
+        target->memory.close();
+        target->thread.join();
+    }
+    _channels.clear();
+}
+
+void rmp::server::start_shards()
+{
+    std::shared_ptr<shard> current;
+    // Shard stores assume every bucket is already in its final place
+    while(_partition.records.migrating() 
+        && !_partition.records.migration_failed())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if(_partition.records.migration_failed())
+    {
+        throw std::runtime_error(
+            "Shards cannot start while buckets are left to migrate");
+    }
+
+    // Buckets are owned by the shard their hash maps to, so no two 
+    // loops ever touch the same file and no bucket locks are taken
+    for(size_t index = 0; index < _shard_count; index++)
+    {
+        current = std::make_shared<shard>();
+        current->index = index;
+        current->owner = this;
+        current->activity = 0;
+        current->data.records.set_locking(false);
+        current->data.records.set_partition(
+            _partition.records, 
+            _shard_count);
+        if(!_cpus.empty())
+        {
+            // Cache pages come from the node of the CPU the shard runs on
+            current->data.records.set_numa_node(rmp::numa::node_of_cpu(
+                _cpus[index % _cpus.size()]));
+        }
+        current->data.records.open();
+        for(size_t source = 0; source < _shard_count; source++)
+        {
+            current->inbound.emplace_back(
+                new rmp::spsc_queue<shard_message*>(SHARD_QUEUE_CAPACITY));
+        }
+        _shards.push_back(current);
+    }
+
+    // Every shard listens on the same port and the kernel spreads the
+    // connections between them
+    for(std::shared_ptr<shard>& target : _shards)
+    {
+        uv_loop_init(&target->loop);
+        target->loop.data = target.get();
+        uv_async_init(
+            &target->loop, 
+            &target->async, 
+            uv_shard_async_callback);
+        uv_idle_init(&target->loop, &target->idle);
+        uv_tcp_init(&target->loop, &target->handle);
+        uv_tcp_open(&target->handle, listen_socket(_port));
+        if(uv_listen(
+            reinterpret_cast<uv_stream_t*>(&target->handle),
+            100,uv_shard_connection_callback) < 0)
+        {
+            throw std::runtime_error("Failed to listen");
+        }
+    }
+    if(!_cpus.empty())
+    {
+        steer_connections(&_shards.front()->handle, _cpus, _shard_count);
+    }
+
+    // Local clients all arrive on the first shard, which forwards their 
+    // requests like any other
+    if(!_unix_path.empty())
+    {
+        listen_pipe(&_shards.front()->loop, uv_shard_connection_callback);
+    }
+
+    uv_signal_init(&_shards.front()->loop,&_signal);
+    _signal.data = this;
+    uv_signal_start(
+        &_signal,
+        uv_shard_signal_callback,
+        SIGINT);
+
+    for(size_t index = 1; index < _shard_count; index++)
+    {
+        _shards[index]->thread = std::thread(
+            &rmp::server::run_shard, 
+            this, 
+            std::ref(*_shards[index]));
+    }
+    run_shard(*_shards.front());
+
+    for(std::shared_ptr<shard>& target : _shards)
+    {
+        if(target->thread.joinable())
+        {
+            target->thread.join();
+        }
+        uv_loop_close(&target->loop);
+    }
+}
+
+void rmp::server::stop()
+{
+
+}
+
+void rmp::server::uv_read_callback(
+    uv_stream_t *client, 
+    ssize_t nread, 
+    const uv_buf_t *buf)
+{
+    rmp::server * server = reinterpret_cast<rmp::server*>(
+        client->loop->data);
+    rmp::request * request;
+    write_context * req;
+    bool queued = false;
+    server->_activity++;
+    
+    if (nread < 0) 
+    {
+        if (nread != UV_EOF) 
+        {
+            fprintf(stderr, "Read error %s\n", uv_err_name(nread));
+            uv_close((uv_handle_t*) client, close_callback);
+        }
+    } 
+    else if (nread > 0 && client->type == UV_NAMED_PIPE 
+        && channel_request(buf->base, nread))
+    {
+        rmp::statistics::add(rmp::statistics::local().bytes_in, nread);
+        server->open_channel(client);
+    }
+    else if (nread > 0) 
+    {
+        rmp::statistics::add(rmp::statistics::local().bytes_in, nread);
+        req = new write_context;
+        if(server->_workers)
+        {
+            // A full queue is answered on the loop thread instead
+            req->buffer.assign(buf->base, nread);
+            req->client = client;
+            uv_read_stop(client);
+            queued = server->_workers->submit(req);
+        }
+
+        if(!queued)
+        {
+            // Request messages live on the arena until the response is sent
+            request = server->parse(
+                server->_partition.arena, 
+                buf->base, 
+                nread);
+            server->process(
+                server->_partition, 
+                server->_partition.arena, 
+                *request, 
+                req->buffer);
+            req->trace = rmp::tracer::detach();
+            write_response(client, req, uv_write_callback);
+        }
+    }
+
+    if (buf->base) 
+    {
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            buf->len);
+        free(buf->base);
+    }
+}
+
+void rmp::server::uv_write_callback(
+    uv_write_t *req, 
+    int status)
+{
+    write_context * context = reinterpret_cast<write_context*>(
+        req->data);
+    if(context->trace != nullptr)
+    {
+        rmp::tracer::record(
+            context->trace, 
+            rmp::trace_phases::TRACE_WRITE, 
+            context->write_begin, 
+            rmp::tracer::now());
+        rmp::tracer::end(context->trace);
+    }
+    rmp::statistics::release(
+        rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+        context->buffer.size());
+    uv_close(reinterpret_cast<uv_handle_t*>(
+        context->client),close_callback);
+    delete context;
+}
+
+void rmp::server::uv_new_connection_callback(
+    uv_stream_t *server, 
+    int status)
+{
+    rmp::server * owner = reinterpret_cast<rmp::server*>(
+        server->loop->data);
+    uv_stream_t* client = create_client(server);
+    owner->_activity++;
+    if(uv_accept(server, client) == 0 && !refuse_connection())
+    {
+        if(owner->_busy_poll > 0 && client->type == UV_TCP)
+        {
+            enable_busy_poll(reinterpret_cast<uv_tcp_t*>(client));
+        }
+        uv_read_start(
+            client,
+            allocate_buffer,
+            uv_read_callback);
+    }
+    else
+    {
+        uv_close(
+            reinterpret_cast<uv_handle_t*>(client),close_callback);
+    }
+    
+}
+
+void rmp::server::uv_signal_callback(
+    uv_signal_t *handle, 
+    int signum)
+{
+    rmp::server * server = reinterpret_cast<rmp::server*>(
+        handle->loop->data);
+    int result;
+    server->_stopping = true;
+    if(server->_workers)
+    {
+        server->_workers->stop();
+    }
+    result = uv_loop_close(handle->loop);
+    if (result == UV_EBUSY)
+    {
+        uv_walk(handle->loop, uv_walk_callback, NULL);
+    }
+}
+
+void rmp::server::uv_walk_callback(
+    uv_handle_t* handle, void* arg)
+{
+    if(!uv_is_closing(handle))
+    {
+        uv_close(handle,0);
+    }
+}
+
+void rmp::server::uv_response_callback(uv_async_t *handle)
+{
+    rmp::server * server = reinterpret_cast<rmp::server*>(
+        handle->loop->data);
+    void * responses[RESPONSE_BATCH];
+    write_context * context;
+    size_t count;
+    server->_activity++;
+    do
+    {
+        count = server->_responses.pop(responses, RESPONSE_BATCH);
+        for(size_t index = 0; index < count; index++)
+        {
+            context = reinterpret_cast<write_context*>(responses[index]);
+            write_response(context->client, context, uv_write_callback);
+        }
+    } while(count > 0);
+}
+
+void rmp::server::uv_shard_read_callback(
+    uv_stream_t *client, 
+    ssize_t nread, 
+    const uv_buf_t *buf)
+{
+    shard * self = reinterpret_cast<shard*>(client->loop->data);
+    rmp::request * request;
+    shard_message * message;
+    write_context * context;
+    size_t target;
+    self->activity++;
+
+    if (nread < 0) 
+    {
+        if (nread != UV_EOF) 
+        {
+            fprintf(stderr, "Read error %s\n", uv_err_name(nread));
+            uv_close((uv_handle_t*) client, close_callback);
+        }
+    } 
+    else if (nread > 0) 
+    {
+        rmp::statistics::add(rmp::statistics::local().bytes_in, nread);
+        request = self->owner->parse(self->data.arena, buf->base, nread);
+        target = shard_index(
+            rmp::djb_hash(request->payload().email()), 
+            self->owner->_shard_count);
+        if(target == self->index)
+        {
+            context = new write_context;
+            self->owner->process(
+                self->data, 
+                self->data.arena, 
+                *request, 
+                context->buffer);
+            context->trace = rmp::tracer::detach();
+            write_response(client, context, uv_write_callback);
+        }
+        else
+        {
+            // The owning shard answers, the connection stays on this loop
+            self->data.arena.reset();
+            uv_read_stop(client);
+            message = new shard_message;
+            message->data.assign(buf->base, nread);
+            message->client = client;
+            message->origin = self->index;
+            message->handled = false;
+            message->trace = rmp::tracer::detach();
+            send_message(*self, target, message);
+        }
+    }
+
+    if (buf->base) 
+    {
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            buf->len);
+        free(buf->base);
+    }
+}
+
+void rmp::server::uv_shard_connection_callback(
+    uv_stream_t *server, 
+    int status)
+{
+    shard * self = reinterpret_cast<shard*>(server->loop->data);
+    uv_stream_t* client = create_client(server);
+    self->activity++;
+    if(uv_accept(server, client) == 0 && !refuse_connection())
+    {
+        if(self->owner->_busy_poll > 0 && client->type == UV_TCP)
+        {
+            enable_busy_poll(reinterpret_cast<uv_tcp_t*>(client));
+        }
+        uv_read_start(
+            client,
+            allocate_buffer,
+            uv_shard_read_callback);
+    }
+    else
+    {
+        uv_close(
+            reinterpret_cast<uv_handle_t*>(client),close_callback);
+    }
+}
+
+void rmp::server::uv_shard_async_callback(uv_async_t *handle)
+{
+    shard * self = reinterpret_cast<shard*>(handle->loop->data);
+    rmp::server * server = self->owner;
+    rmp::request * request;
+    shard_message * message;
+    write_context * context;
+    self->activity++;
+
+    if(server->_stopping)
+    {
+        uv_walk(handle->loop, uv_walk_callback, NULL);
+    }
+
+    for(size_t source = 0; 
+        !server->_stopping && source < self->inbound.size(); 
+        source++)
+    {
+        while(self->inbound[source]->pop(message))
+        {
+            if(message->handled)
+            {
+                context = new write_context;
+                context->buffer.swap(message->data);
+                context->trace = message->trace;
+                write_response(message->client, context, uv_write_callback);
+                delete message;
+            }
+            else
+            {
+                rmp::tracer::attach(message->trace);
+                request = server->parse(
+                    self->data.arena, 
+                    message->data.data(), 
+                    message->data.size());
+                server->process(
+                    self->data, 
+                    self->data.arena, 
+                    *request, 
+                    message->data);
+                message->trace = rmp::tracer::detach();
+                message->handled = true;
+                send_message(*self, message->origin, message);
+            }
+        }
+    }
+}
+
+void rmp::server::uv_shard_idle_callback(uv_idle_t *handle)
+{
+    shard * self = reinterpret_cast<shard*>(handle->loop->data);
+    shard * target;
+    bool sent = true;
+    while(sent && !self->backlog.empty())
+    {
+        target = self->owner->_shards[self->backlog.front().first].get();
+        sent = target->inbound[self->index]->push(
+            self->backlog.front().second);
+        if(sent)
+        {
+            uv_async_send(&target->async);
+            self->backlog.pop_front();
+        }
+    }
+
+    if(self->backlog.empty())
+    {
+        uv_idle_stop(handle);
+    }
+}
+
+void rmp::server::uv_shard_signal_callback(
+    uv_signal_t *handle, 
+    int signum)
+{
+    rmp::server * server = reinterpret_cast<rmp::server*>(handle->data);
+    if(!server->_stopping.exchange(true))
+    {
+        for(std::shared_ptr<shard>& target : server->_shards)
+        {
+            uv_async_send(&target->async);
+        }
+    }
+}
+
+void rmp::server::send_message(
+    rmp::server::shard& source, 
+    size_t target, 
+    rmp::server::shard_message * message)
+{
+    shard& destination = *source.owner->_shards[target];
+    // A full queue never blocks the loop, the message waits in the
+    // backlog until the idle handle gets it through
+    if(source.backlog.empty() 
+        && destination.inbound[source.index]->push(message))
+    {
+        uv_async_send(&destination.async);
+    }
+    else
+    {
+        if(source.backlog.empty())
+        {
+            uv_idle_start(&source.idle, uv_shard_idle_callback);
+        }
+        source.backlog.emplace_back(target, message);
+    }
+}
+
+void rmp::server::run_shard(rmp::server::shard& target)
+{
+    place_thread(target.index);
+    // Loaded on the shard's own thread so the table is first touched on
+    // its node, other shards' buckets are skipped unread
+    target.data.records.load([&](const std::string& hash)
+    {
+        return shard_index(hash, _shard_count) == target.index;
+    });
+    run_loop(&target.loop, target.activity);
+}
+
+void rmp::server::run_loop(uv_loop_t * loop, const uint64_t& activity)
+{
+    uint64_t seen = activity;
+    uint64_t last = uv_hrtime();
+    bool alive = true;
+    loop_clock clock;
+    // A timer that fires late shows how long callbacks held the loop
+    uv_timer_init(loop, &clock.timer);
+    clock.expected = last + LAG_INTERVAL_MILLISECONDS * 1000000;
+    uv_timer_start(
+        &clock.timer, 
+        lag_callback, 
+        LAG_INTERVAL_MILLISECONDS, 
+        LAG_INTERVAL_MILLISECONDS);
+    if(_busy_poll == 0)
+    {
+        uv_run(loop, UV_RUN_DEFAULT);
+    }
+    // Poll without blocking while callbacks keep coming, fall back to a
+    // blocking iteration once nothing happened for the idle period
+    while(_busy_poll > 0 && alive)
+    {
+        alive = (uv_run(loop, UV_RUN_NOWAIT) != 0);
+        if(activity != seen)
+        {
+            seen = activity;
+            last = uv_hrtime();
+        }
+        else if(alive && uv_hrtime() - last > _busy_poll * 1000)
+        {
+            alive = (uv_run(loop, UV_RUN_ONCE) != 0);
+            last = uv_hrtime();
+        }
+    }
+}
+
+void rmp::server::place_thread(size_t index)
+{
+    if(!_cpus.empty())
+    {
+        rmp::numa::pin_thread(_cpus[index % _cpus.size()]);
+        rmp::numa::track_thread();
+    }
+}
+
+void rmp::server::run_jobs(size_t worker, void ** jobs, size_t count)
+{
+    rmp::request_arena& arena = *_worker_arenas[worker];
+    rmp::request * request;
+    write_context * context;
+    for(size_t index = 0; index < count; index++)
+    {
+        context = reinterpret_cast<write_context*>(jobs[index]);
+        request = parse(
+            arena, 
+            context->buffer.data(), 
+            context->buffer.size());
+        process(_partition, arena, *request, context->buffer);
+        context->trace = rmp::tracer::detach();
+        while(!_responses.push(context) && !_stopping)
+        {
+            _response_stalls++;
+            std::this_thread::yield();
+        }
+    }
+    // One wake up for the whole batch
+    uv_async_send(&_responses_async);
+}
+
+rmp::request * rmp::server::parse(
+    rmp::request_arena& arena, 
+    const char * data, 
+    size_t size)
+{
+    // Requests are sampled as they arrive, a forwarded one keeps its trace
+    rmp::request_trace * trace = rmp::tracer::begin();
+    uint64_t begin = (trace == nullptr) ? 0 : rmp::tracer::now();
+    rmp::request * request;
+    request = google::protobuf::Arena::CreateMessage<rmp::request>(
+        arena.get());
+    request->ParseFromArray(data, static_cast<int>(size));
+    RMP_PROBE(
+        request__start, 
+        request->command(), 
+        size, 
+        rmp::djb_hash(request->payload().email()).c_str());
+    if(trace != nullptr)
+    {
+        rmp::tracer::record(
+            trace, 
+            rmp::trace_phases::TRACE_PARSE, 
+            begin, 
+            rmp::tracer::now());
+    }
+    return request;
+}
+
+void rmp::server::process(
+    rmp::server::partition& partition,
+    rmp::request_arena& arena,
+    rmp::request& request,
+    std::string& output)
+{
+    rmp::thread_statistics& statistics = rmp::statistics::local();
+    uint64_t start = uv_hrtime();
+    uint64_t latency;
+    rmp::response * response;
+    rmp::slow_log::begin(request);
+    response = google::protobuf::Arena::CreateMessage<rmp::response>(
+        arena.get());
+    handle_request(partition, request, *response);
+    if(rmp::tracer::active() != nullptr)
+    {
+        rmp::tracer::active()->command = request.command();
+    }
+    {
+        rmp::trace_phase phase(rmp::trace_phases::TRACE_SERIALIZE);
+        response->SerializeToString(&output);
+    }
+    rmp::slow_log::end(output.size());
+    latency = uv_hrtime() - start;
+    if(request.command() <= rmp::command_codes::DELETE_RECORD)
+    {
+        statistics.latency[request.command()].record(latency);
+    }
+    RMP_PROBE(
+        request__end, 
+        request.command(), 
+        response->status(), 
+        output.size(), 
+        latency, 
+        rmp::djb_hash(request.payload().email()).c_str());
+    rmp::statistics::add(statistics.requests, 1);
+    if(response->status() != rmp::status_codes::GOOD)
+    {
+        rmp::statistics::add(statistics.errors, 1);
+    }
+    partition.arena_allocations += arena.allocations();
+    arena.reset();
+}
+
+void rmp::server::handle_request(
+    rmp::server::partition& partition,
+    rmp::request& request,
+    rmp::response& response)
+{
+    std::string error_message;
+    if(validate_request(request,error_message))
+    {
+        try
+        {
+            switch (request.command())
+            {
+            case rmp::command_codes::CREATE_RECORD:
+                on_create(partition, *request.mutable_payload(), response);
+                break;
+            case rmp::command_codes::READ_RECORD:
+                on_read(partition, *request.mutable_payload(), response);
+                break;
+            case rmp::command_codes::UPDATE_RECORD:
+                on_update(partition, *request.mutable_payload(), response);
+                break;
+            case rmp::command_codes::DELETE_RECORD:
+                on_delete(partition, *request.mutable_payload(), response);
+                break;        
+            case rmp::command_codes::STATS:
+                response.set_status(rmp::status_codes::GOOD);
+                *response.mutable_payload() = report();
+                break;
+            case rmp::command_codes::LOCKS:
+                response.set_status(rmp::status_codes::GOOD);
+                *response.mutable_payload() = 
+                    partition.records.lock_report();
+                break;
+            case rmp::command_codes::EXPORT:
+                // The path on the server's host travels in the email
+                response.set_status(rmp::status_codes::GOOD);
+                *response.mutable_payload() = "Exported " 
+                    + std::to_string(
+                        export_records(request.payload().email())) 
+                    + " records";
+                break;
+            case rmp::command_codes::OPEN_CHANNEL:
+                // Channels are opened by the libuv loop before requests 
+                // get here, on a unix socket and without shards
+                response.set_status(rmp::status_codes::BAD);
+                *response.mutable_payload() = 
+                    "Shared memory channels are not available";
+                break;
+            default:
+                break;
+            }
+        }
+        catch(const std::exception& e)
+        {
+            response.set_status(
+                rmp::status_codes::BAD);
+            *response.mutable_payload() = e.what();
+        }
+    }
+    else
+    {
+        response.set_status(
+            rmp::status_codes::BAD);
+        *response.mutable_payload() = error_message;
+    }
+}
+
+void rmp::server::on_create(
+    rmp::server::partition& partition,
+    rmp::record& record,
+    rmp::response& result)
+{
+    if(partition.records.create_record(record))
+    {
+        result.set_status(
             rmp::status_codes::GOOD);
-        bucket.mutable_records(index)->CopyFrom(record);
-        store_bucket(hash,bucket);
     }
     else
+    {
+        result.set_status(
+            rmp::status_codes::BAD);
+        *result.mutable_payload() = "Record already exists";
+    }
+}
+
+void rmp::server::on_read(
+    rmp::server::partition& partition,
+    rmp::record& record,
+    rmp::response& result)
+{
+    if(!partition.records.read_record(
+        record.email(), 
+        *result.mutable_payload(), 
+        result.GetArena()))
     {
         result.set_status(
             rmp::status_codes::BAD);
         *result.mutable_payload() = "Record does not exist";
     }
-    release_lock(hash);
-    return result;
 }
 
-rmp::response rmp::server::on_delete(
-    const rmp::record& record)
+void rmp::server::on_update(
+    rmp::server::partition& partition,
+    rmp::record& record,
+    rmp::response& result)
 {
-    std::string hash;
-    rmp::bucket bucket,new_bucket;
-    int index;
-    rmp::response result;
-    hash = djb_hash(record.email());
-    aquire_lock(hash);
-    load_bucket(hash, bucket);    
-    index = find_record(bucket,record);
-    if(index != -1)
+    if(partition.records.update_record(record))
+    {
+        result.set_status(
+            rmp::status_codes::GOOD);
+    }
+    else
+    {
+        result.set_status(
+            rmp::status_codes::BAD);
+        *result.mutable_payload() = "Record does not exist";
+    }
+}
+
+void rmp::server::on_delete(
+    rmp::server::partition& partition,
+    rmp::record& record,
+    rmp::response& result)
+{
+    if(partition.records.delete_record(record.email()))
     {
         result.set_status(
             rmp::status_codes::GOOD);
-        for(int i = 0; i < bucket.records_size(); i++)
-        {
-            if(i != index)
-            {
-                *new_bucket.add_records() = bucket.records(i);
-            }
-        }
-        store_bucket(hash,new_bucket);
     }
     else
     {
@@ -520,8 +1812,6 @@ rmp::response rmp::server::on_delete(
             rmp::status_codes::BAD);
         *result.mutable_payload() = "Record does not exist";
     }
-    release_lock(hash);
-    return result;
 }
 
 static bool validate_request(
@@ -532,22 +1822,129 @@ static bool validate_request(
     return result;
 }
 
-static int find_record(
-    const rmp::bucket bucket, const rmp::record& record)
+static void write_response(
+    uv_stream_t * client, 
+    write_context * context, 
+    uv_write_cb callback)
 {
-    int result = -1;
-    int index = 0;
-    while(index < bucket.records_size() && result == -1)
+    uv_buf_t buffer = uv_buf_init(
+        const_cast<char*>(context->buffer.c_str()), 
+        context->buffer.size());
+    context->request.data = context;
+    context->client = client;
+    rmp::statistics::add(
+        rmp::statistics::local().bytes_out, 
+        context->buffer.size());
+    rmp::statistics::allocate(
+        rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+        context->buffer.size());
+    if(context->trace != nullptr)
     {
-        if(record.email() == bucket.records(index).email())
-        {
-            result = index;
-        }
-        index++;
+        context->write_begin = rmp::tracer::now();
+    }
+    uv_write(&context->request, client, &buffer, 1, callback);
+}
+
+static size_t shard_index(const std::string& hash, size_t shards)
+{
+    return std::stoul(hash, nullptr, 16) % shards;
+}
+
+static int listen_socket(uint16_t port)
+{
+    int result, enable = 1;
+    sockaddr_in address;
+#if defined(SO_REUSEPORT)
+    result = socket(AF_INET, SOCK_STREAM, 0);
+    if(result < 0)
+    {
+        throw std::runtime_error("Failed to open socket");
     }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if(setsockopt(
+        result, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0
+        || setsockopt(
+        result, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0
+        || bind(
+        result, reinterpret_cast<const sockaddr*>(&address), 
+        sizeof(address)) < 0)
+    {
+        close(result);
+        throw std::runtime_error(
+            "Failed to bind port " + std::to_string(port));
+    }
+#else
+    throw std::runtime_error("Shards require SO_REUSEPORT");
+#endif
     return result;
 }
 
+static void steer_connections(
+    uv_tcp_t * handle, 
+    const std::vector<int>& cpus, 
+    size_t shards)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    std::vector<sock_filter> program;
+    sock_fprog filter;
+    uv_os_fd_t fd;
+    // Hand each connection to the shard pinned to the CPU that received
+    // it, so it is served on the same node as the network queue
+    program.push_back(BPF_STMT(
+        BPF_LD | BPF_W | BPF_ABS, 
+        static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+    for(size_t index = 0; index < shards; index++)
+    {
+        program.push_back(BPF_JUMP(
+            BPF_JMP | BPF_JEQ | BPF_K, 
+            static_cast<uint32_t>(cpus[index % cpus.size()]), 
+            0, 
+            1));
+        program.push_back(BPF_STMT(
+            BPF_RET | BPF_K, 
+            static_cast<uint32_t>(index)));
+    }
+    program.push_back(BPF_STMT(
+        BPF_ALU | BPF_MOD | BPF_K, 
+        static_cast<uint32_t>(shards)));
+    program.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    filter.len = program.size();
+    filter.filter = program.data();
+    if(uv_fileno(reinterpret_cast<uv_handle_t*>(handle), &fd) != 0 
+        || setsockopt(
+            fd, 
+            SOL_SOCKET, 
+            SO_ATTACH_REUSEPORT_CBPF, 
+            &filter, 
+            sizeof(filter)) < 0)
+    {
+        fprintf(stderr, "Connections are not steered by CPU\n");
+    }
+#endif
+}
+
+static void enable_busy_poll(uv_tcp_t * client)
+{
+#if defined(SO_BUSY_POLL)
+    int microseconds = BUSY_POLL_SOCKET_MICROSECONDS;
+    uv_os_fd_t fd;
+    // Best effort, raising it above net.core.busy_read needs 
+    // CAP_NET_ADMIN and the spinning loop works without it
+    if(uv_fileno(reinterpret_cast<uv_handle_t*>(client), &fd) == 0)
+    {
+        setsockopt(
+            fd, 
+            SOL_SOCKET, 
+            SO_BUSY_POLL, 
+            &microseconds, 
+            sizeof(microseconds));
+    }
+#endif
+}
+
 const size_t READ_RECORD_BUFFER_SIZE = 1024;
 
 static void write_request(int socket, const rmp::request& request)
@@ -559,18 +1956,23 @@ static void read_response(int socket, rmp::response& response)
 {
     std::vector<uint8_t> response_buffer;
     std::array<uint8_t,READ_RECORD_BUFFER_SIZE> read_buffer;
-    size_t read_size;
+    ssize_t read_size;
+    // The server closes the connection after the response, a short read
+    // only means the rest is still on its way
     do
     {
         read_size = read(
             socket,
             read_buffer.data(),
             read_buffer.size());
-        response_buffer.insert(
-            response_buffer.end(),
-            read_buffer.begin(),
-            read_buffer.begin() + read_size);
-    } while (read_size == 1024);
+        if(read_size > 0)
+        {
+            response_buffer.insert(
+                response_buffer.end(),
+                read_buffer.begin(),
+                read_buffer.begin() + read_size);
+        }
+    } while (read_size > 0 || (read_size < 0 && errno == EINTR));
     if(response_buffer.size() > 0)
     {
         response.ParseFromArray(
@@ -579,6 +1981,82 @@ static void read_response(int socket, rmp::response& response)
     }
 }
 
+static int read_descriptor(int socket, rmp::response& response)
+{
+    std::array<char,READ_RECORD_BUFFER_SIZE> buffer;
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec data;
+    msghdr message;
+    cmsghdr * header;
+    ssize_t size;
+    int result = -1;
+    memset(&message, 0, sizeof(message));
+    data.iov_base = buffer.data();
+    data.iov_len = buffer.size();
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    size = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    if(size > 0)
+    {
+        for(header = CMSG_FIRSTHDR(&message); 
+            header != nullptr; 
+            header = CMSG_NXTHDR(&message, header))
+        {
+            if(header->cmsg_level == SOL_SOCKET 
+                && header->cmsg_type == SCM_RIGHTS)
+            {
+                memcpy(&result, CMSG_DATA(header), sizeof(result));
+            }
+        }
+        response.ParseFromArray(buffer.data(), static_cast<int>(size));
+    }
+    return result;
+}
+
+static bool send_descriptor(
+    int socket, 
+    const std::string& data, 
+    int descriptor)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec buffer;
+    msghdr message;
+    cmsghdr * header;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    buffer.iov_base = const_cast<char*>(data.data());
+    buffer.iov_len = data.size();
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &descriptor, sizeof(descriptor));
+    return sendmsg(socket, &message, MSG_NOSIGNAL) 
+        == static_cast<ssize_t>(data.size());
+}
+
+static bool peer_open(int socket)
+{
+    char byte;
+    ssize_t result = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result > 0 
+        || (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static bool channel_request(const char * data, size_t size)
+{
+    rmp::request request;
+    return size <= CHANNEL_REQUEST_SIZE 
+        && request.ParseFromArray(data, static_cast<int>(size))
+        && request.command() == rmp::command_codes::OPEN_CHANNEL;
+}
+
 static void allocate_buffer(
     uv_handle_t *handle, 
     size_t suggested_size, 
@@ -588,4 +2066,90 @@ static void allocate_buffer(
         malloc(
             suggested_size));
     buf->len = suggested_size;
+    rmp::statistics::allocate(
+        rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+        suggested_size);
+}
+
+static void close_callback(uv_handle_t * handle)
+{
+    rmp::statistics::add(rmp::statistics::local().connections_closed, 1);
+    RMP_PROBE(connection__close, handle, -1);
+    if(handle->type == UV_NAMED_PIPE)
+    {
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            sizeof(uv_pipe_t));
+        delete reinterpret_cast<uv_pipe_t*>(handle);
+    }
+    else
+    {
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            sizeof(uv_tcp_t));
+        delete reinterpret_cast<uv_tcp_t*>(handle);
+    }
+}
+
+static uv_stream_t * create_client(uv_stream_t * server)
+{
+    uv_stream_t * result;
+    uv_pipe_t * pipe;
+    uv_tcp_t * tcp;
+    rmp::statistics::add(rmp::statistics::local().connections_opened, 1);
+    // Clients take the handle type of the listener that accepted them
+    if(server->type == UV_NAMED_PIPE)
+    {
+        pipe = new uv_pipe_t;
+        rmp::statistics::allocate(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            sizeof(uv_pipe_t));
+        uv_pipe_init(server->loop, pipe, 0);
+        result = reinterpret_cast<uv_stream_t*>(pipe);
+    }
+    else
+    {
+        tcp = new uv_tcp_t;
+        rmp::statistics::allocate(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            sizeof(uv_tcp_t));
+        uv_tcp_init(server->loop, tcp);
+        result = reinterpret_cast<uv_stream_t*>(tcp);
+    }
+    RMP_PROBE(connection__accept, result, -1);
+    return result;
+}
+
+static void lag_callback(uv_timer_t * handle)
+{
+    loop_clock * clock = reinterpret_cast<loop_clock*>(handle);
+    uint64_t now = uv_hrtime();
+    rmp::statistics::local().loop_lag.record(
+        now > clock->expected ? now - clock->expected : 0);
+    clock->expected = now + LAG_INTERVAL_MILLISECONDS * 1000000;
+}
+
+static void * allocate_arena_block(size_t size)
+{
+    arena_blocks++;
+    rmp::statistics::allocate(rmp::memory_subsystems::MEMORY_MESSAGES, size);
+    return malloc(size);
 }
+
+static void deallocate_arena_block(void * block, size_t size)
+{
+    rmp::statistics::release(rmp::memory_subsystems::MEMORY_MESSAGES, size);
+    free(block);
+}
+
+static bool refuse_connection()
+{
+    bool result = rmp::statistics::over_limit();
+    if(result)
+    {
+        rmp::statistics::add(
+            rmp::statistics::local().connections_refused, 
+            1);
+    }
+    return result;
+}
\ No newline at end of file
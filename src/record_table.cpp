@@ -0,0 +1,727 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RMP_SSE2 1
+#endif
+
+const size_t GROUP_SIZE = 16;
+
+const size_t INLINE_KEY_SIZE = 22;
+
+const size_t KEY_BLOCK_SIZE = 64 * 1024;
+
+// Lookups issued ahead of the one being probed in a batch
+const size_t PREFETCH_DISTANCE = 8;
+
+const int8_t EMPTY = -128;
+
+const int8_t DELETED = -2;
+
+const uint8_t EXTERNAL_KEY = 0xFF;
+
+// Each write pushes a version stamped with its commit number, erase
+// pushes a tombstone. Older versions stay linked while a snapshot can
+// still see them
+struct rmp::record_table::version
+{
+    std::string record;
+    uint64_t commit;
+    bool deleted;
+    std::atomic<version*> previous;
+
+    version(
+        const std::string& data, 
+        uint64_t number, 
+        bool tombstone) :
+        record(data),
+        commit(number),
+        deleted(tombstone),
+        previous(nullptr)
+    {
+        rmp::statistics::allocate(
+            rmp::memory_subsystems::MEMORY_INDEX, 
+            sizeof(version) + record.capacity());
+    }
+
+    ~version()
+    {
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_INDEX, 
+            sizeof(version) + record.capacity());
+    }
+};
+
+struct rmp::record_table::slot
+{
+    // Short emails are kept in the slot, longer ones in the key blocks
+    union
+    {
+        char data[INLINE_KEY_SIZE + 1];
+        struct
+        {
+            const char * pointer;
+            size_t size;
+        } external;
+    } key;
+    uint8_t key_size;
+    uint64_t hash;
+    std::atomic<version*> current;
+
+    const char * key_data() const
+    {
+        return key_size == EXTERNAL_KEY ? key.external.pointer : key.data;
+    }
+
+    size_t key_length() const
+    {
+        return key_size == EXTERNAL_KEY ? key.external.size : key_size;
+    }
+};
+
+// Readers only ever see a generation through an epoch guard. Slots are
+// never reused within a generation, so a published key is immutable and
+// only the version pointer changes
+struct rmp::record_table::generation
+{
+    size_t capacity;
+    size_t used;
+    std::atomic<int8_t> * control;
+    slot * slots;
+    std::vector<std::unique_ptr<char[]>> key_blocks;
+    size_t key_block_used;
+    size_t key_bytes;
+
+    generation(size_t size) :
+        capacity(size),
+        used(0),
+        control(new std::atomic<int8_t>[size]),
+        slots(new slot[size]),
+        key_block_used(KEY_BLOCK_SIZE),
+        key_bytes(0)
+    {
+        rmp::statistics::allocate(
+            rmp::memory_subsystems::MEMORY_INDEX, 
+            capacity * (sizeof(slot) + sizeof(std::atomic<int8_t>)));
+        for(size_t index = 0; index < capacity; index++)
+        {
+            control[index].store(EMPTY, std::memory_order_relaxed);
+            slots[index].current.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~generation()
+    {
+        delete[] slots;
+        delete[] control;
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_INDEX, 
+            capacity * (sizeof(slot) + sizeof(std::atomic<int8_t>)) 
+                + key_bytes);
+    }
+
+    const int8_t * group(size_t index) const
+    {
+        return reinterpret_cast<const int8_t*>(control + index * GROUP_SIZE);
+    }
+};
+
+static uint64_t table_hash(const std::string& data);
+
+static uint32_t match_byte(const int8_t * group, int8_t value);
+
+static uint32_t match_empty(const int8_t * group);
+
+static int lowest_bit(uint32_t mask);
+
+static void prefetch(const void * address);
+
+rmp::record_table::snapshot::snapshot(rmp::record_table& table) :
+    _table(table)
+{
+    std::unique_lock<std::mutex> lock(_table._snapshots_mutex);
+    _version = _table._version.load();
+    _table._snapshots.insert(_version);
+}
+
+rmp::record_table::snapshot::~snapshot()
+{
+    _table.release(_version);
+}
+
+uint64_t rmp::record_table::snapshot::version() const
+{
+    return _version;
+}
+
+rmp::record_table::record_table(size_t capacity) :
+    _table(nullptr),
+    _size(0),
+    _version(0)
+{
+    rehash(capacity);
+}
+
+rmp::record_table::~record_table()
+{
+    generation * table = _table.load();
+    for(size_t index = 0; index < table->capacity; index++)
+    {
+        delete_chain(table->slots[index].current.load());
+    }
+    delete table;
+}
+
+bool rmp::record_table::find(
+    const std::string& email, 
+    std::string& record) const
+{
+    rmp::epoch_guard guard;
+    const generation * table = _table.load(std::memory_order_acquire);
+    const version * current = nullptr;
+    size_t index = lookup(*table, email, table_hash(email));
+    if(index != table->capacity)
+    {
+        current = table->slots[index].current.load(
+            std::memory_order_acquire);
+    }
+    if(current != nullptr && !current->deleted)
+    {
+        record = current->record;
+    }
+    return current != nullptr && !current->deleted;
+}
+
+bool rmp::record_table::find(
+    const std::string& email, 
+    std::string& record,
+    const rmp::record_table::snapshot& snapshot) const
+{
+    rmp::epoch_guard guard;
+    const generation * table = _table.load(std::memory_order_acquire);
+    const version * current = nullptr;
+    size_t index = lookup(*table, email, table_hash(email));
+    if(index != table->capacity)
+    {
+        current = visible(
+            table->slots[index].current.load(std::memory_order_acquire),
+            snapshot.version());
+    }
+    if(current != nullptr)
+    {
+        record = current->record;
+    }
+    return current != nullptr;
+}
+
+size_t rmp::record_table::scan(
+    const rmp::record_table::snapshot& snapshot,
+    const std::function<void(
+        const std::string&, 
+        const std::string&)>& callback) const
+{
+    size_t result = 0;
+    const version * current;
+    std::string email;
+    // The guard spans the whole scan, versions the snapshot needs are
+    // pinned by the snapshot itself and everything else is only deferred
+    rmp::epoch_guard guard;
+    const generation * table = _table.load(std::memory_order_acquire);
+    for(size_t index = 0; index < table->capacity; index++)
+    {
+        if(table->control[index].load(std::memory_order_acquire) >= 0)
+        {
+            const slot& source = table->slots[index];
+            current = visible(
+                source.current.load(std::memory_order_acquire),
+                snapshot.version());
+            if(current != nullptr)
+            {
+                email.assign(source.key_data(), source.key_length());
+                callback(email, current->record);
+                result++;
+            }
+        }
+    }
+    return result;
+}
+
+size_t rmp::record_table::find(
+    const std::vector<std::string>& emails, 
+    std::vector<std::string>& records,
+    std::vector<bool>& found) const
+{
+    size_t result = 0;
+    size_t mask, index;
+    const version * current;
+    std::vector<uint64_t> hashes(emails.size());
+    records.resize(emails.size());
+    found.assign(emails.size(), false);
+    for(size_t email = 0; email < emails.size(); email++)
+    {
+        hashes[email] = table_hash(emails[email]);
+    }
+
+    rmp::epoch_guard guard;
+    const generation * table = _table.load(std::memory_order_acquire);
+    mask = table->capacity / GROUP_SIZE - 1;
+    // Pull in the first group of upcoming probe sequences while the
+    // current one is being matched
+    for(size_t email = 0; email < emails.size(); email++)
+    {
+        if(email + PREFETCH_DISTANCE < emails.size())
+        {
+            index = GROUP_SIZE 
+                * ((hashes[email + PREFETCH_DISTANCE] >> 7) & mask);
+            prefetch(table->control + index);
+            prefetch(table->slots + index);
+        }
+        index = lookup(*table, emails[email], hashes[email]);
+        current = (index != table->capacity) 
+            ? table->slots[index].current.load(std::memory_order_acquire)
+            : nullptr;
+        if(current != nullptr && !current->deleted)
+        {
+            records[email] = current->record;
+            found[email] = true;
+            result++;
+        }
+    }
+    return result;
+}
+
+bool rmp::record_table::insert(
+    const std::string& email, 
+    const std::string& record)
+{
+    uint64_t hash = table_hash(email);
+    generation * table;
+    size_t index;
+    bool result;
+    std::unique_lock<std::mutex> lock(_mutex);
+    table = _table.load();
+    index = lookup(*table, email, hash);
+    // A tombstone still held for a snapshot is revived in place
+    result = (index == table->capacity 
+        || table->slots[index].current.load()->deleted);
+    if(result && index == table->capacity)
+    {
+        if((table->used + 1) * 8 > table->capacity * 7)
+        {
+            rehash((_size + 1) * 2);
+            table = _table.load();
+        }
+        // Fill the slot before its tag makes it visible to readers
+        index = free_slot(*table, hash);
+        table->slots[index].hash = hash;
+        store_key(*table, table->slots[index], email.data(), email.size());
+        table->slots[index].current.store(nullptr);
+        publish(
+            *table, 
+            index, 
+            new version(record, _version.load() + 1, false));
+        table->control[index].store(
+            static_cast<int8_t>(hash & 0x7F), 
+            std::memory_order_release);
+        table->used++;
+        _size++;
+    }
+    else if(result)
+    {
+        publish(
+            *table, 
+            index, 
+            new version(record, _version.load() + 1, false));
+        _size++;
+    }
+    return result;
+}
+
+bool rmp::record_table::update(
+    const std::string& email, 
+    const std::string& record)
+{
+    generation * table;
+    size_t index;
+    bool result = false;
+    std::unique_lock<std::mutex> lock(_mutex);
+    table = _table.load();
+    index = lookup(*table, email, table_hash(email));
+    if(index != table->capacity)
+    {
+        result = !table->slots[index].current.load()->deleted;
+    }
+    if(result)
+    {
+        publish(
+            *table, 
+            index, 
+            new version(record, _version.load() + 1, false));
+    }
+    return result;
+}
+
+bool rmp::record_table::erase(const std::string& email)
+{
+    generation * table;
+    size_t index;
+    bool result = false;
+    std::unique_lock<std::mutex> lock(_mutex);
+    table = _table.load();
+    index = lookup(*table, email, table_hash(email));
+    if(index != table->capacity)
+    {
+        result = !table->slots[index].current.load()->deleted;
+    }
+    if(result)
+    {
+        publish(
+            *table, 
+            index, 
+            new version(std::string(), _version.load() + 1, true));
+        _size--;
+    }
+    return result;
+}
+
+size_t rmp::record_table::size() const
+{
+    return _size.load();
+}
+
+size_t rmp::record_table::capacity() const
+{
+    rmp::epoch_guard guard;
+    return _table.load()->capacity;
+}
+
+uint64_t rmp::record_table::committed() const
+{
+    return _version.load();
+}
+
+size_t rmp::record_table::snapshots() const
+{
+    std::unique_lock<std::mutex> lock(_snapshots_mutex);
+    return _snapshots.size();
+}
+
+const rmp::record_table::version * rmp::record_table::visible(
+    const rmp::record_table::version * head, 
+    uint64_t snapshot)
+{
+    const version * result = head;
+    while(result != nullptr && result->commit > snapshot)
+    {
+        result = result->previous.load(std::memory_order_acquire);
+    }
+    return (result != nullptr && !result->deleted) ? result : nullptr;
+}
+
+void rmp::record_table::publish(
+    rmp::record_table::generation& table, 
+    size_t index, 
+    rmp::record_table::version * next)
+{
+    slot& target = table.slots[index];
+    next->previous.store(target.current.load(), std::memory_order_relaxed);
+    target.current.store(next, std::memory_order_release);
+    // Snapshots taken from here on include this commit
+    _version.store(next->commit);
+    prune(table, index, oldest_snapshot());
+}
+
+void rmp::record_table::prune(
+    rmp::record_table::generation& table, 
+    size_t index, 
+    uint64_t oldest)
+{
+    slot& target = table.slots[index];
+    version * head = target.current.load();
+    version * keep = head;
+    version * expired = nullptr;
+
+    // The newest version at or below the oldest snapshot is the last one
+    // anybody can reach, everything older is unlinked
+    while(keep != nullptr && keep->commit > oldest)
+    {
+        keep = keep->previous.load();
+    }
+    if(keep != nullptr)
+    {
+        expired = keep->previous.exchange(nullptr);
+    }
+    if(expired != nullptr)
+    {
+        rmp::epoch::retire(expired, delete_chain);
+    }
+
+    // A tombstone nobody can look behind frees the slot
+    if(head != nullptr && head == keep && head->deleted)
+    {
+        target.current.store(nullptr, std::memory_order_release);
+        table.control[index].store(DELETED, std::memory_order_release);
+        rmp::epoch::retire(head, delete_chain);
+    }
+}
+
+void rmp::record_table::release(uint64_t version)
+{
+    generation * table;
+    bool oldest;
+    std::unique_lock<std::mutex> snapshots_lock(_snapshots_mutex);
+    _snapshots.erase(_snapshots.find(version));
+    oldest = (_snapshots.empty() || *_snapshots.begin() > version);
+    snapshots_lock.unlock();
+
+    // Chains are otherwise only trimmed when written, so sweep the table
+    // once the oldest snapshot is gone
+    if(oldest)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t limit = oldest_snapshot();
+        table = _table.load();
+        for(size_t index = 0; index < table->capacity; index++)
+        {
+            if(table->control[index].load() >= 0)
+            {
+                prune(*table, index, limit);
+            }
+        }
+    }
+}
+
+uint64_t rmp::record_table::oldest_snapshot() const
+{
+    std::unique_lock<std::mutex> lock(_snapshots_mutex);
+    return _snapshots.empty() ? _version.load() : *_snapshots.begin();
+}
+
+void rmp::record_table::delete_chain(void * head)
+{
+    version * current = reinterpret_cast<version*>(head);
+    version * previous;
+    while(current != nullptr)
+    {
+        previous = current->previous.load();
+        delete current;
+        current = previous;
+    }
+}
+
+size_t rmp::record_table::lookup(
+    const rmp::record_table::generation& table,
+    const std::string& email, 
+    uint64_t hash)
+{
+    size_t mask = table.capacity / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & mask;
+    size_t result = table.capacity;
+    uint32_t matches;
+    const slot * candidate;
+    for(size_t probe = 1; result == table.capacity; probe++)
+    {
+        // Compare the 7 bit tag against all 16 slots of the group at once
+        matches = match_byte(
+            table.group(group), 
+            static_cast<int8_t>(hash & 0x7F));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        while(matches != 0 && result == table.capacity)
+        {
+            candidate = table.slots + group * GROUP_SIZE 
+                + lowest_bit(matches);
+            if(candidate->hash == hash 
+                && candidate->key_length() == email.size()
+                && memcmp(
+                    candidate->key_data(), 
+                    email.data(), 
+                    email.size()) == 0)
+            {
+                result = candidate - table.slots;
+            }
+            matches &= matches - 1;
+        }
+
+        if(result == table.capacity && match_empty(table.group(group)) != 0)
+        {
+            break;
+        }
+        group = (group + probe) & mask;
+    }
+    return result;
+}
+
+size_t rmp::record_table::free_slot(
+    const rmp::record_table::generation& table, 
+    uint64_t hash)
+{
+    size_t mask = table.capacity / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & mask;
+    uint32_t matches;
+    for(size_t probe = 1; ; probe++)
+    {
+        matches = match_empty(table.group(group));
+        if(matches != 0)
+        {
+            return group * GROUP_SIZE + lowest_bit(matches);
+        }
+        group = (group + probe) & mask;
+    }
+}
+
+void rmp::record_table::rehash(size_t capacity)
+{
+    generation * previous = _table.load();
+    generation * table;
+    size_t size = GROUP_SIZE;
+    size_t index;
+
+    // Capacity is a power of two number of groups at under 7/8 load
+    while(size * 7 < capacity * 8)
+    {
+        size <<= 1;
+    }
+    table = new generation(size);
+
+    // Version chains move to the new generation, freed slots do not
+    for(size_t old = 0; previous != nullptr && old < previous->capacity; old++)
+    {
+        slot& source = previous->slots[old];
+        if(source.current.load() != nullptr)
+        {
+            index = free_slot(*table, source.hash);
+            table->slots[index].hash = source.hash;
+            store_key(
+                *table, 
+                table->slots[index], 
+                source.key_data(), 
+                source.key_length());
+            table->slots[index].current.store(source.current.load());
+            table->control[index].store(
+                static_cast<int8_t>(source.hash & 0x7F));
+            table->used++;
+        }
+    }
+    _table.store(table, std::memory_order_release);
+
+    if(previous != nullptr)
+    {
+        rmp::epoch::retire(previous);
+    }
+}
+
+void rmp::record_table::store_key(
+    rmp::record_table::generation& table,
+    rmp::record_table::slot& slot, 
+    const char * email,
+    size_t size)
+{
+    char * block;
+    if(size <= INLINE_KEY_SIZE)
+    {
+        memcpy(slot.key.data, email, size);
+        slot.key_size = static_cast<uint8_t>(size);
+    }
+    else
+    {
+        if(table.key_block_used + size > KEY_BLOCK_SIZE)
+        {
+            table.key_blocks.emplace_back(
+                new char[std::max(KEY_BLOCK_SIZE, size)]);
+            table.key_bytes += std::max(KEY_BLOCK_SIZE, size);
+            rmp::statistics::allocate(
+                rmp::memory_subsystems::MEMORY_INDEX, 
+                std::max(KEY_BLOCK_SIZE, size));
+            table.key_block_used = 0;
+        }
+        block = table.key_blocks.back().get() + table.key_block_used;
+        memcpy(block, email, size);
+        table.key_block_used += size;
+        slot.key.external.pointer = block;
+        slot.key.external.size = size;
+        slot.key_size = EXTERNAL_KEY;
+    }
+}
+
+static uint64_t table_hash(const std::string& data)
+{
+    // FNV-1a with a murmur finalizer so tag and group bits both mix well
+    uint64_t result = 14695981039346656037ULL;
+    for(const char& c : data)
+    {
+        result ^= static_cast<uint8_t>(c);
+        result *= 1099511628211ULL;
+    }
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdULL;
+    result ^= result >> 33;
+    result *= 0xc4ceb9fe1a85ec53ULL;
+    result ^= result >> 33;
+    return result;
+}
+
+static uint32_t match_byte(const int8_t * group, int8_t value)
+{
+    uint32_t result = 0;
+#if defined(RMP_SSE2)
+    __m128i control = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(group));
+    result = static_cast<uint32_t>(_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_set1_epi8(value), control)));
+#else
+    for(size_t index = 0; index < GROUP_SIZE; index++)
+    {
+        result |= static_cast<uint32_t>(group[index] == value) << index;
+    }
+#endif
+    return result;
+}
+
+static uint32_t match_empty(const int8_t * group)
+{
+    return match_byte(group, EMPTY);
+}
+
+static int lowest_bit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long result;
+    _BitScanForward(&result, mask);
+    return static_cast<int>(result);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static void prefetch(const void * address)
+{
+#if defined(RMP_SSE2)
+    _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+    __builtin_prefetch(address);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,545 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+#include "record_manager.h"
+
+const size_t BENCH_COMMANDS = 4;
+
+const char * BENCH_COMMAND_NAMES[] = {"create", "read", "update", "delete"};
+
+// Sleeps overshoot, so open loop clients spin for the last stretch
+const uint64_t BENCH_SPIN_NANOSECONDS = 100000;
+
+struct workload
+{
+    std::string host;
+    uint16_t port = 0;
+    bool shared_memory = false;
+    bool open_loop = false;
+    size_t clients = 8;
+    double rate = 0.0;
+    uint64_t keys = 10000;
+    double theta = 0.99;
+    std::vector<double> mix = {10.0, 70.0, 15.0, 5.0};
+    double warmup = 2.0;
+    double duration = 10.0;
+    uint64_t expected_interval = 0;
+    uint64_t seed = 1;
+    std::string output;
+};
+
+// Written only by its client thread, merged once every thread is done
+struct client_results
+{
+    rmp::histogram latency[BENCH_COMMANDS];
+    rmp::histogram uncorrected[BENCH_COMMANDS];
+    uint64_t failures[BENCH_COMMANDS] = {};
+};
+
+static bool rmp_bench_init(
+    workload& workload,
+    int argc, 
+    const char ** argv) noexcept;
+
+static bool rmp_bench_main(const workload& workload) noexcept;
+
+static void parse_option(workload& workload, const std::string& option);
+
+static void preload(const workload& workload, size_t thread);
+
+static void run(
+    const workload& workload, 
+    size_t thread, 
+    uint64_t start,
+    client_results& results);
+
+static bool execute(
+    rmp::client& client, 
+    int command, 
+    uint64_t key);
+
+static void write_report(
+    std::ostream& output, 
+    const workload& workload,
+    double seconds,
+    const std::vector<std::unique_ptr<client_results>>& results);
+
+static void write_histogram(
+    std::ostream& output, 
+    const std::string& indent,
+    const std::string& name, 
+    const rmp::histogram& values);
+
+static std::string key_email(uint64_t key);
+
+int main(int argc, const char ** argv)
+{
+    workload workload;
+    return (rmp_bench_init(workload,argc,argv) 
+        && rmp_bench_main(workload))
+        ? EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+static bool rmp_bench_init(
+    workload& workload,
+    int argc, 
+    const char ** argv) noexcept
+{
+    bool result(true);
+    std::string error_message;
+
+    result = (argc >= 3);
+
+    if(result)
+    {
+        try
+        {
+            workload.host = argv[1];
+            workload.port = std::stoi(argv[2]);
+            for(int arg = 3; arg < argc; arg++)
+            {
+                parse_option(workload, argv[arg]);
+            }
+            if(workload.open_loop && workload.rate <= 0.0)
+            {
+                throw std::invalid_argument("Open loop needs a --rate");
+            }
+            // Closed loop correction needs an interval to expect
+            if(!workload.open_loop 
+                && workload.warmup <= 0.0 
+                && workload.expected_interval == 0)
+            {
+                throw std::invalid_argument(
+                    "Closed loop needs a --warmup or an --expected-interval");
+            }
+        }
+        catch(const std::exception& e)
+        {
+            error_message = e.what();
+            result = false;
+        }
+    }
+    else
+    {
+        error_message = "At least 3 args expected, " + std::to_string(argc) + " found.";
+    }
+
+    if (!result)
+    {
+        std::cerr << "Failed to parse args: "
+                  << error_message
+                  << std::endl
+                  << "rmp-bench <host|unix:path> <port> [options]"
+                  << std::endl
+                  << "  --clients=<count>    concurrent clients, 8 by default"
+                  << std::endl
+                  << "  --rate=<ops/s>       open loop at this arrival rate"
+                  << std::endl
+                  << "  --keys=<count>       records preloaded, 10000 default"
+                  << std::endl
+                  << "  --theta=<skew>       zipfian key skew, 0 to below 1"
+                  << std::endl
+                  << "  --mix=<c,r,u,d>      command weights, 10,70,15,5"
+                  << std::endl
+                  << "  --warmup=<seconds>   not measured, 2 by default"
+                  << std::endl
+                  << "  --duration=<seconds> measured, 10 by default"
+                  << std::endl
+                  << "  --expected-interval=<us>"
+                  << std::endl
+                  << "                       closed loop correction interval,"
+                  << std::endl
+                  << "                       warmup median by default"
+                  << std::endl
+                  << "  --shared-memory      use shared memory channels"
+                  << std::endl
+                  << "  --seed=<n>           random seed"
+                  << std::endl
+                  << "  --output=<path>      JSON report, stdout by default"
+                  << std::endl;
+    }
+
+    return result;
+}
+
+static bool rmp_bench_main(const workload& workload) noexcept
+{
+    bool result(true);
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<client_results>> results;
+    std::ofstream file;
+    uint64_t start;
+    double seconds;
+    try
+    {
+        for(size_t thread = 0; thread < workload.clients; thread++)
+        {
+            threads.emplace_back(preload, std::cref(workload), thread);
+        }
+        for(std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        threads.clear();
+
+        start = uv_hrtime();
+        for(size_t thread = 0; thread < workload.clients; thread++)
+        {
+            results.emplace_back(new client_results());
+            threads.emplace_back(
+                run, 
+                std::cref(workload), 
+                thread, 
+                start,
+                std::ref(*results.back()));
+        }
+        for(std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        seconds = (uv_hrtime() - start) / 1e9 - workload.warmup;
+
+        if(workload.output.empty())
+        {
+            write_report(std::cout, workload, seconds, results);
+        }
+        else
+        {
+            file.open(workload.output);
+            if(!file)
+            {
+                throw std::runtime_error(
+                    "Failed to open " + workload.output);
+            }
+            write_report(file, workload, seconds, results);
+        }
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        result = false;
+    }
+    return result;
+}
+
+static void parse_option(workload& workload, const std::string& option)
+{
+    std::string name, value, weight;
+    size_t separator;
+
+    separator = option.find('=');
+    name = option.substr(0, separator);
+    if(separator != std::string::npos)
+    {
+        value = option.substr(separator + 1);
+    }
+
+    if(name == "--clients" && std::stoull(value) > 0)
+    {
+        workload.clients = std::stoull(value);
+    }
+    else if(name == "--rate")
+    {
+        workload.rate = std::stod(value);
+        workload.open_loop = true;
+    }
+    else if(name == "--keys" && std::stoull(value) > 2)
+    {
+        workload.keys = std::stoull(value);
+    }
+    else if(name == "--theta" 
+        && std::stod(value) >= 0.0 
+        && std::stod(value) < 1.0)
+    {
+        workload.theta = std::stod(value);
+    }
+    else if(name == "--mix")
+    {
+        std::stringstream list(value);
+        workload.mix.clear();
+        while(std::getline(list, weight, ','))
+        {
+            workload.mix.push_back(std::stod(weight));
+        }
+        if(workload.mix.size() != BENCH_COMMANDS)
+        {
+            throw std::invalid_argument("Invalid mix " + value);
+        }
+    }
+    else if(name == "--warmup" && std::stod(value) >= 0.0)
+    {
+        workload.warmup = std::stod(value);
+    }
+    else if(name == "--duration" && std::stod(value) > 0.0)
+    {
+        workload.duration = std::stod(value);
+    }
+    else if(name == "--expected-interval")
+    {
+        workload.expected_interval = std::stoull(value) * 1000;
+    }
+    else if(name == "--shared-memory")
+    {
+        workload.shared_memory = true;
+    }
+    else if(name == "--seed")
+    {
+        workload.seed = std::stoull(value);
+    }
+    else if(name == "--output" && !value.empty())
+    {
+        workload.output = value;
+    }
+    else
+    {
+        throw std::invalid_argument("Unrecognized option " + option);
+    }
+}
+
+static void preload(const workload& workload, size_t thread)
+{
+    rmp::client client;
+    client.set_address(workload.host, workload.port);
+    client.set_shared_memory(workload.shared_memory);
+    for(uint64_t key = thread; key < workload.keys; key += workload.clients)
+    {
+        execute(client, rmp::command_codes::CREATE_RECORD, key);
+    }
+}
+
+static void run(
+    const workload& workload, 
+    size_t thread, 
+    uint64_t start,
+    client_results& results)
+{
+    rmp::client client;
+    std::mt19937_64 random(workload.seed + thread);
+    std::discrete_distribution<int> commands(
+        workload.mix.begin(), 
+        workload.mix.end());
+    rmp::zipfian_generator keys(workload.keys, workload.theta);
+    std::unique_ptr<rmp::histogram> warmup(new rmp::histogram());
+    uint64_t measure = start + static_cast<uint64_t>(workload.warmup * 1e9);
+    uint64_t end = measure + static_cast<uint64_t>(workload.duration * 1e9);
+    uint64_t interval = workload.expected_interval;
+    uint64_t intended, sent, done, request = thread;
+    bool measuring = false;
+    int command;
+    bool success;
+    client.set_address(workload.host, workload.port);
+    client.set_shared_memory(workload.shared_memory);
+    intended = start;
+    while(intended < end)
+    {
+        if(workload.open_loop)
+        {
+            // Request i is due at i / rate whether or not the server kept up
+            intended = start + static_cast<uint64_t>(request * 1e9 
+                / workload.rate);
+            request += workload.clients;
+            sent = uv_hrtime();
+            if(intended > sent + BENCH_SPIN_NANOSECONDS)
+            {
+                std::this_thread::sleep_for(
+                    std::chrono::nanoseconds(
+                        intended - sent - BENCH_SPIN_NANOSECONDS));
+            }
+            while(uv_hrtime() < intended)
+            {
+                std::this_thread::yield();
+            }
+        }
+        else
+        {
+            intended = uv_hrtime();
+        }
+
+        // Closed loop clients expect the latency they saw in warmup, so
+        // warmup lasts until they have seen one
+        if(!measuring 
+            && intended >= measure 
+            && (workload.open_loop || interval > 0 || warmup->count() > 0))
+        {
+            measuring = true;
+            if(!workload.open_loop && interval == 0)
+            {
+                interval = warmup->percentile(50);
+            }
+        }
+
+        if(intended < end)
+        {
+            command = commands(random);
+            sent = uv_hrtime();
+            success = execute(client, command, keys.next(random));
+            done = uv_hrtime();
+            if(!measuring)
+            {
+                warmup->record(done - sent);
+            }
+            else if(workload.open_loop)
+            {
+                results.latency[command].record(done - intended);
+                results.uncorrected[command].record(done - sent);
+            }
+            else
+            {
+                results.latency[command].record(done - sent, interval);
+                results.uncorrected[command].record(done - sent);
+            }
+            if(measuring && !success)
+            {
+                results.failures[command]++;
+            }
+        }
+    }
+}
+
+static bool execute(
+    rmp::client& client, 
+    int command, 
+    uint64_t key)
+{
+    std::pair<bool,std::string> result;
+    rmp::info info;
+    info.set_name("bench-" + std::to_string(key));
+    info.set_phone("0000000000");
+    switch(command)
+    {
+    case rmp::command_codes::CREATE_RECORD:
+        result = client.create_record(key_email(key), info);
+        break;
+    case rmp::command_codes::READ_RECORD:
+        result = client.read_record(key_email(key));
+        break;
+    case rmp::command_codes::UPDATE_RECORD:
+        result = client.update_record(key_email(key), info);
+        break;
+    case rmp::command_codes::DELETE_RECORD:
+        result = client.delete_record(key_email(key));
+        break;
+    }
+    return result.first;
+}
+
+static void write_report(
+    std::ostream& output, 
+    const workload& workload,
+    double seconds,
+    const std::vector<std::unique_ptr<client_results>>& results)
+{
+    std::unique_ptr<client_results> total(new client_results());
+    rmp::histogram latency, uncorrected;
+    uint64_t failures = 0;
+    for(const std::unique_ptr<client_results>& client : results)
+    {
+        for(size_t command = 0; command < BENCH_COMMANDS; command++)
+        {
+            total->latency[command].merge(client->latency[command]);
+            total->uncorrected[command].merge(client->uncorrected[command]);
+            total->failures[command] += client->failures[command];
+        }
+    }
+    for(size_t command = 0; command < BENCH_COMMANDS; command++)
+    {
+        latency.merge(total->latency[command]);
+        uncorrected.merge(total->uncorrected[command]);
+        failures += total->failures[command];
+    }
+
+    output << "{" << std::endl
+           << "  \"mode\": \"" << (workload.open_loop ? "open" : "closed") 
+           << "\"," << std::endl
+           << "  \"clients\": " << workload.clients << "," << std::endl
+           << "  \"rate\": " << workload.rate << "," << std::endl
+           << "  \"keys\": " << workload.keys << "," << std::endl
+           << "  \"theta\": " << workload.theta << "," << std::endl
+           << "  \"mix\": {";
+    for(size_t command = 0; command < BENCH_COMMANDS; command++)
+    {
+        output << (command > 0 ? ", " : "") 
+               << "\"" << BENCH_COMMAND_NAMES[command] << "\": " 
+               << workload.mix[command];
+    }
+    output << "}," << std::endl
+           << "  \"warmup_seconds\": " << workload.warmup << "," << std::endl
+           << "  \"duration_seconds\": " << seconds << "," << std::endl
+           << "  \"operations\": " << uncorrected.count() << "," << std::endl
+           << "  \"failures\": " << failures << "," << std::endl
+           << "  \"throughput\": " << uncorrected.count() / seconds << "," 
+           << std::endl;
+    write_histogram(output, "  ", "latency_us", latency);
+    output << "," << std::endl;
+    write_histogram(output, "  ", "uncorrected_latency_us", uncorrected);
+    output << "," << std::endl
+           << "  \"commands\": {" << std::endl;
+    for(size_t command = 0; command < BENCH_COMMANDS; command++)
+    {
+        output << "    \"" << BENCH_COMMAND_NAMES[command] << "\": {" 
+               << std::endl
+               << "      \"operations\": " 
+               << total->uncorrected[command].count() << "," << std::endl
+               << "      \"failures\": " << total->failures[command] << "," 
+               << std::endl;
+        write_histogram(
+            output, 
+            "      ", 
+            "latency_us", 
+            total->latency[command]);
+        output << "," << std::endl;
+        write_histogram(
+            output, 
+            "      ", 
+            "uncorrected_latency_us", 
+            total->uncorrected[command]);
+        output << std::endl 
+               << "    }" << (command + 1 < BENCH_COMMANDS ? "," : "") 
+               << std::endl;
+    }
+    output << "  }" << std::endl
+           << "}" << std::endl;
+}
+
+static void write_histogram(
+    std::ostream& output, 
+    const std::string& indent,
+    const std::string& name, 
+    const rmp::histogram& values)
+{
+    output << indent << "\"" << name << "\": {"
+           << std::fixed << std::setprecision(1)
+           << "\"p50\": " << values.percentile(50) / 1000.0
+           << ", \"p90\": " << values.percentile(90) / 1000.0
+           << ", \"p99\": " << values.percentile(99) / 1000.0
+           << ", \"p999\": " << values.percentile(99.9) / 1000.0
+           << ", \"p9999\": " << values.percentile(99.99) / 1000.0
+           << ", \"max\": " << values.max() / 1000.0 << "}"
+           << std::defaultfloat;
+}
+
+static std::string key_email(uint64_t key)
+{
+    return "user" + std::to_string(key) + "@example.com";
+}
\ No newline at end of file
@@ -32,6 +32,10 @@ static bool server_init(
 static bool server_main(
     std::shared_ptr<rmp::server>& server) noexcept;
 
+static void parse_option(
+    std::shared_ptr<rmp::server>& server,
+    const std::string& option);
+
 int main(int argc, const char ** argv)
 {
     std::shared_ptr<rmp::server> server;
@@ -50,7 +54,7 @@ static bool server_init(
     uint16_t remote_port;
     std::string root_directory;
 
-    result = (argc == 3);
+    result = (argc >= 3);
 
     if(result)
     {
@@ -61,6 +65,10 @@ static bool server_init(
             server = std::make_shared<rmp::server>(
                 remote_port,
                 root_directory);
+            for(int arg = 3; arg < argc; arg++)
+            {
+                parse_option(server, argv[arg]);
+            }
         }
         catch(const std::exception& e)
         {
@@ -70,7 +78,7 @@ static bool server_init(
     }
     else
     {
-        error_message = "3 args expected, " + std::to_string(argc) + " found.";
+        error_message = "At least 3 args expected, " + std::to_string(argc) + " found.";
     }
     
 
@@ -79,7 +87,57 @@ static bool server_init(
         std::cerr << "Failed to parse args: "
                   << error_message
                   << std::endl
-                  << "server <port> <root directory>"
+                  << "server <port> <root directory> [options]"
+                  << std::endl
+                  << "  --direct-io          bypass the kernel page cache"
+                  << std::endl
+                  << "  --cache-size=<bytes> direct I/O cache capacity"
+                  << std::endl
+                  << "  --readahead=<bytes>  initial bucket read size"
+                  << std::endl
+                  << "  --fd-cache=<count>   open bucket descriptors kept"
+                  << std::endl
+                  << "  --openat             open buckets relative to the root"
+                  << std::endl
+                  << "  --fan-out=<n>x<w>    n directory levels of w hex digits"
+                  << std::endl
+                  << "  --migration-threads=<count>"
+                  << std::endl
+                  << "                       threads moving flat buckets"
+                  << std::endl
+                  << "  --memory-tier        keep every record resident"
+                  << std::endl
+                  << "  --shards=<count>     one event loop per shard"
+                  << std::endl
+                  << "  --workers=<count>    threads executing requests"
+                  << std::endl
+                  << "  --cpus=<list>        pin loops and workers, e.g. 0-3,8"
+                  << std::endl
+                  << "  --busy-poll=<usecs>  spin until idle this long"
+                  << std::endl
+                  << "  --engine=<uv|epoll>  network engine of the single loop"
+                  << std::endl
+                  << "  --zerocopy           MSG_ZEROCOPY for large responses"
+                  << std::endl
+                  << "  --unix-socket=<path> also listen on a unix socket"
+                  << std::endl
+                  << "  --trace=<path>       write sampled request phases"
+                  << std::endl
+                  << "  --trace-sample=<n>   trace one request in n, default 100"
+                  << std::endl
+                  << "  --lock-threshold=<ms>"
+                  << std::endl
+                  << "                       log bucket lock waits this long"
+                  << std::endl
+                  << "  --slow-log=<path>    log requests over the threshold"
+                  << std::endl
+                  << "  --slow-threshold=<usecs>"
+                  << std::endl
+                  << "                       slow request latency, default 10000"
+                  << std::endl
+                  << "  --slow-log-size=<MB> rotate the slow log, default 64"
+                  << std::endl
+                  << "  --memory-limit=<MB>  shrink caches and refuse clients"
                   << std::endl;
     }
 
@@ -98,4 +156,114 @@ static bool server_main(
         std::cerr << e.what() << std::endl;
     }
     return true;
+}
+
+static void parse_option(
+    std::shared_ptr<rmp::server>& server,
+    const std::string& option)
+{
+    std::string name, value;
+    size_t separator;
+
+    separator = option.find('=');
+    name = option.substr(0, separator);
+    if(separator != std::string::npos)
+    {
+        value = option.substr(separator + 1);
+    }
+
+    if(name == "--direct-io")
+    {
+        server->set_io_mode(rmp::io_modes::DIRECT_IO);
+    }
+    else if(name == "--cache-size")
+    {
+        server->set_cache_capacity(std::stoull(value));
+    }
+    else if(name == "--readahead")
+    {
+        server->set_readahead(std::stoull(value));
+    }
+    else if(name == "--fd-cache")
+    {
+        server->set_descriptor_capacity(std::stoull(value));
+    }
+    else if(name == "--openat")
+    {
+        server->set_openat(true);
+    }
+    else if(name == "--fan-out")
+    {
+        server->set_layout(rmp::bucket_layout::parse(value));
+    }
+    else if(name == "--migration-threads")
+    {
+        server->set_migration_threads(std::stoull(value));
+    }
+    else if(name == "--memory-tier")
+    {
+        server->set_memory_tier(true);
+    }
+    else if(name == "--shards")
+    {
+        server->set_shards(std::stoull(value));
+    }
+    else if(name == "--workers")
+    {
+        server->set_workers(std::stoull(value));
+    }
+    else if(name == "--cpus")
+    {
+        server->set_cpus(rmp::numa::parse_cpus(value));
+    }
+    else if(name == "--busy-poll")
+    {
+        server->set_busy_poll(std::stoull(value));
+    }
+    else if(name == "--engine" && (value == "uv" || value == "epoll"))
+    {
+        server->set_network_engine(value == "epoll" 
+            ? rmp::network_engines::EPOLL_ENGINE 
+            : rmp::network_engines::UV_ENGINE);
+    }
+    else if(name == "--zerocopy")
+    {
+        server->set_zerocopy(true);
+    }
+    else if(name == "--unix-socket" && !value.empty())
+    {
+        server->set_unix_socket(value);
+    }
+    else if(name == "--trace" && !value.empty())
+    {
+        server->set_trace(value);
+    }
+    else if(name == "--lock-threshold")
+    {
+        server->set_lock_threshold(std::stoull(value));
+    }
+    else if(name == "--slow-log" && !value.empty())
+    {
+        server->set_slow_log(value);
+    }
+    else if(name == "--slow-threshold")
+    {
+        server->set_slow_threshold(std::stoull(value));
+    }
+    else if(name == "--memory-limit")
+    {
+        server->set_memory_limit(std::stoull(value) * 1024 * 1024);
+    }
+    else if(name == "--slow-log-size")
+    {
+        server->set_slow_log_size(std::stoull(value) * 1024 * 1024);
+    }
+    else if(name == "--trace-sample")
+    {
+        server->set_trace_sample(std::stoull(value));
+    }
+    else
+    {
+        throw std::invalid_argument("Unrecognized option " + option);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static long futex(
+    std::atomic<uint32_t>& word, 
+    int operation, 
+    uint32_t value, 
+    const timespec * timeout);
+
+// Each ring holds this many bytes of frames, a power of two
+const uint32_t CHANNEL_RING_SIZE = 256 * 1024;
+
+// Empty polls before a consumer goes to sleep on the futex
+const int CHANNEL_SPINS = 2000;
+
+// Frames start on a 4 byte boundary with their length, this length 
+// marks the unused end of the ring the producer skipped
+const uint32_t CHANNEL_PADDING = 0xffffffff;
+
+const uint32_t CHANNEL_HEADER_SIZE = sizeof(uint32_t);
+
+struct rmp::shm_channel::ring
+{
+    std::atomic<uint32_t> head;
+    char head_padding[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> sleeping;
+    char tail_padding[CACHE_LINE_SIZE - 2 * sizeof(std::atomic<uint32_t>)];
+    char data[CHANNEL_RING_SIZE];
+};
+
+struct rmp::shm_channel::region
+{
+    ring rings[2];
+    std::atomic<uint32_t> closed;
+};
+
+rmp::shm_channel::shm_channel() :
+    _descriptor(-1),
+    _region(nullptr),
+    _reserved{0, 0},
+    _received{0, 0}
+{
+    _descriptor = memfd_create("rmp-channel", MFD_CLOEXEC);
+    if(_descriptor < 0 || ftruncate(_descriptor, sizeof(region)) < 0)
+    {
+        if(_descriptor >= 0)
+        {
+            ::close(_descriptor);
+        }
+        throw std::runtime_error("Failed to create a shared memory channel");
+    }
+    map();
+}
+
+rmp::shm_channel::shm_channel(int descriptor) :
+    _descriptor(descriptor),
+    _region(nullptr),
+    _reserved{0, 0},
+    _received{0, 0}
+{
+    map();
+}
+
+rmp::shm_channel::~shm_channel()
+{
+    if(_region != nullptr)
+    {
+        munmap(_region, sizeof(region));
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+            sizeof(region));
+    }
+    if(_descriptor >= 0)
+    {
+        ::close(_descriptor);
+    }
+}
+
+void rmp::shm_channel::map()
+{
+    void * memory = mmap(
+        nullptr, 
+        sizeof(region), 
+        PROT_READ | PROT_WRITE, 
+        MAP_SHARED, 
+        _descriptor, 
+        0);
+    if(memory == MAP_FAILED)
+    {
+        ::close(_descriptor);
+        _descriptor = -1;
+        throw std::runtime_error("Failed to map the shared memory channel");
+    }
+    // A fresh memfd reads as zeros, which is an open channel with two 
+    // empty rings
+    _region = reinterpret_cast<region*>(memory);
+    rmp::statistics::allocate(
+        rmp::memory_subsystems::MEMORY_CONNECTIONS, 
+        sizeof(region));
+    _received[REQUEST_RING] = _region->rings[REQUEST_RING].head.load();
+    _received[RESPONSE_RING] = _region->rings[RESPONSE_RING].head.load();
+}
+
+int rmp::shm_channel::descriptor() const
+{
+    return _descriptor;
+}
+
+char * rmp::shm_channel::reserve(channel_rings ring, size_t size)
+{
+    rmp::shm_channel::ring& target = _region->rings[ring];
+    uint32_t tail = target.tail.load(std::memory_order_relaxed);
+    uint32_t offset = tail & (CHANNEL_RING_SIZE - 1);
+    uint32_t frame = 
+        (CHANNEL_HEADER_SIZE + static_cast<uint32_t>(size) + 3) & ~3u;
+    uint32_t skip = (CHANNEL_RING_SIZE - offset < frame) 
+        ? CHANNEL_RING_SIZE - offset 
+        : 0;
+    uint32_t used = tail - target.head.load(std::memory_order_acquire);
+    char * result = nullptr;
+    // Frames never wrap, so the message is written and read in place
+    if(size <= CHANNEL_RING_SIZE / 2 
+        && CHANNEL_RING_SIZE - used >= skip + frame)
+    {
+        if(skip > 0)
+        {
+            memcpy(target.data + offset, &CHANNEL_PADDING, sizeof(uint32_t));
+            tail += skip;
+            offset = 0;
+        }
+        _reserved[ring] = tail;
+        result = target.data + offset + CHANNEL_HEADER_SIZE;
+    }
+    return result;
+}
+
+void rmp::shm_channel::commit(channel_rings ring, size_t size)
+{
+    rmp::shm_channel::ring& target = _region->rings[ring];
+    uint32_t length = static_cast<uint32_t>(size);
+    uint32_t offset = _reserved[ring] & (CHANNEL_RING_SIZE - 1);
+    memcpy(target.data + offset, &length, sizeof(length));
+    // Sequentially consistent against the consumer announcing its sleep,
+    // so either the consumer sees the frame or the producer sees it asleep
+    target.tail.store(
+        _reserved[ring] + ((CHANNEL_HEADER_SIZE + length + 3) & ~3u));
+    if(target.sleeping.load() != 0)
+    {
+        futex(target.tail, FUTEX_WAKE, 1, nullptr);
+    }
+}
+
+const char * rmp::shm_channel::receive(
+    channel_rings ring, 
+    size_t& size, 
+    int timeout_milliseconds)
+{
+    rmp::shm_channel::ring& target = _region->rings[ring];
+    timespec timeout;
+    uint32_t head = target.head.load(std::memory_order_relaxed);
+    uint32_t tail, offset, length = 0;
+    const char * result = nullptr;
+    bool waited = false;
+    timeout.tv_sec = timeout_milliseconds / 1000;
+    timeout.tv_nsec = (timeout_milliseconds % 1000) * 1000000L;
+    for(int spin = 0; result == nullptr && !waited && !closed(); spin++)
+    {
+        tail = target.tail.load(std::memory_order_acquire);
+        offset = head & (CHANNEL_RING_SIZE - 1);
+        if(head != tail)
+        {
+            memcpy(&length, target.data + offset, sizeof(length));
+        }
+        // The other process can write anything into the ring, a frame
+        // that does not fit between head and tail closes the channel
+        if(head != tail 
+            && (tail - head > CHANNEL_RING_SIZE 
+                || (length == CHANNEL_PADDING 
+                    && CHANNEL_RING_SIZE - offset > tail - head)
+                || (length != CHANNEL_PADDING 
+                    && (length > CHANNEL_RING_SIZE - offset 
+                        - CHANNEL_HEADER_SIZE
+                    || ((CHANNEL_HEADER_SIZE + length + 3) & ~3u) 
+                        > tail - head))))
+        {
+            close();
+        }
+        else if(head != tail)
+        {
+            if(length == CHANNEL_PADDING)
+            {
+                head += CHANNEL_RING_SIZE - offset;
+                target.head.store(head, std::memory_order_release);
+            }
+            else
+            {
+                result = target.data + offset + CHANNEL_HEADER_SIZE;
+                size = length;
+                _received[ring] = head 
+                    + ((CHANNEL_HEADER_SIZE + length + 3) & ~3u);
+            }
+        }
+        else if(spin >= CHANNEL_SPINS)
+        {
+            // The futex compares the tail again, so a frame committed 
+            // after the announcement never goes unnoticed
+            target.sleeping.store(1);
+            if(target.tail.load() == tail && !closed())
+            {
+                futex(target.tail, FUTEX_WAIT, tail, &timeout);
+            }
+            target.sleeping.store(0);
+            waited = target.tail.load() == tail;
+        }
+    }
+    return result;
+}
+
+void rmp::shm_channel::release(channel_rings ring)
+{
+    _region->rings[ring].head.store(
+        _received[ring], 
+        std::memory_order_release);
+}
+
+void rmp::shm_channel::close()
+{
+    _region->closed.store(1);
+    for(ring& target : _region->rings)
+    {
+        futex(target.tail, FUTEX_WAKE, 1, nullptr);
+    }
+}
+
+bool rmp::shm_channel::closed() const
+{
+    return _region->closed.load(std::memory_order_acquire) != 0;
+}
+
+static long futex(
+    std::atomic<uint32_t>& word, 
+    int operation, 
+    uint32_t value, 
+    const timespec * timeout)
+{
+    // The word is shared between processes, so no private futex
+    return syscall(
+        SYS_futex, 
+        reinterpret_cast<uint32_t*>(&word), 
+        operation, 
+        value, 
+        timeout, 
+        nullptr, 
+        0);
+}
\ No newline at end of file
@@ -0,0 +1,226 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+#include "record_manager.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+static void write_request(
+    std::ostream& output, 
+    const rmp::slow_request& entry);
+
+const size_t SLOW_LOG_CAPACITY = 4096;
+
+const size_t SLOW_LOG_BATCH = 64;
+
+// Rotated files are kept as <path>.1 up to <path>.4, oldest last
+const size_t SLOW_LOG_FILES = 4;
+
+const uint64_t SLOW_LOG_POLL_MILLISECONDS = 100;
+
+std::atomic<bool> rmp::slow_log::_enabled(false);
+thread_local bool rmp::slow_log::_recording = false;
+
+static std::unique_ptr<rmp::mpmc_queue<rmp::slow_request>> slow_queue;
+static std::atomic<uint64_t> slow_dropped(0);
+static std::atomic<bool> slow_running(false);
+static std::thread slow_writer;
+static std::ofstream slow_output;
+static std::string slow_path;
+static uint64_t slow_threshold = 0;
+static uint64_t slow_rotate_bytes = 0;
+static thread_local rmp::slow_request current;
+static thread_local uint64_t current_begin = 0;
+static thread_local std::string current_email;
+
+void rmp::slow_log::enable(
+    const std::string& path, 
+    uint64_t threshold_microseconds, 
+    uint64_t rotate_bytes)
+{
+    disable();
+    slow_output.open(path, std::ios::out | std::ios::app);
+    if(!slow_output)
+    {
+        throw std::runtime_error("Failed to open slow log " + path);
+    }
+
+    slow_path = path;
+    slow_rotate_bytes = rotate_bytes;
+    slow_threshold = static_cast<uint64_t>(
+        threshold_microseconds * rmp::tracer::ticks_per_microsecond());
+    slow_queue.reset(
+        new rmp::mpmc_queue<rmp::slow_request>(SLOW_LOG_CAPACITY));
+    slow_running = true;
+    slow_writer = std::thread(write);
+    _enabled.store(true, std::memory_order_relaxed);
+}
+
+void rmp::slow_log::disable()
+{
+    _enabled.store(false, std::memory_order_relaxed);
+    if(slow_writer.joinable())
+    {
+        slow_running = false;
+        slow_writer.join();
+        slow_output.close();
+    }
+}
+
+void rmp::slow_log::phase(rmp::trace_phases phase, uint64_t ticks)
+{
+    if(_recording)
+    {
+        current.phases[phase] += ticks;
+    }
+}
+
+void rmp::slow_log::touch(uint64_t bucket_bytes, uint64_t stored_bytes)
+{
+    if(_recording)
+    {
+        current.bucket_bytes += bucket_bytes;
+        current.stored_bytes += stored_bytes;
+    }
+}
+
+uint64_t rmp::slow_log::dropped()
+{
+    return slow_dropped.load(std::memory_order_relaxed);
+}
+
+void rmp::slow_log::start(const rmp::request& request)
+{
+    memset(&current, 0, sizeof(current));
+    _recording = true;
+    // Handling moves the payload out of the request, keep what we need
+    current.command = static_cast<int>(request.command());
+    current.request_bytes = request.ByteSizeLong();
+    current_email = request.payload().email();
+    current_begin = rmp::tracer::now();
+}
+
+void rmp::slow_log::finish(size_t response_bytes)
+{
+    std::string hash;
+    _recording = false;
+    current.latency = rmp::tracer::now() - current_begin;
+    // Everything costly is left for the few requests that were slow
+    if(current.latency >= slow_threshold)
+    {
+        if(current.command <= rmp::command_codes::DELETE_RECORD)
+        {
+            hash = rmp::djb_hash(current_email);
+            strncpy(current.hash, hash.c_str(), sizeof(current.hash) - 1);
+        }
+        current.time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        current.response_bytes = response_bytes;
+        if(!slow_queue->push(current))
+        {
+            slow_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void rmp::slow_log::write()
+{
+    rmp::slow_request entries[SLOW_LOG_BATCH];
+    size_t count = 0;
+    bool running = true;
+    // The last pass after disable drains what is still queued
+    while(running || count > 0)
+    {
+        running = slow_running;
+        count = slow_queue->pop(entries, SLOW_LOG_BATCH);
+        for(size_t index = 0; index < count; index++)
+        {
+            write_request(slow_output, entries[index]);
+        }
+
+        if(count > 0)
+        {
+            slow_output.flush();
+            if(slow_rotate_bytes > 0 
+                && static_cast<uint64_t>(slow_output.tellp()) 
+                    >= slow_rotate_bytes)
+            {
+                rotate();
+            }
+        }
+        else if(running)
+        {
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(SLOW_LOG_POLL_MILLISECONDS));
+        }
+    }
+}
+
+void rmp::slow_log::rotate()
+{
+    std::string older, newer;
+    slow_output.close();
+    for(size_t index = SLOW_LOG_FILES; index > 1; index--)
+    {
+        older = slow_path + "." + std::to_string(index - 1);
+        newer = slow_path + "." + std::to_string(index);
+        rename(older.c_str(), newer.c_str());
+    }
+    rename(slow_path.c_str(), (slow_path + ".1").c_str());
+    slow_output.open(slow_path, std::ios::out | std::ios::trunc);
+}
+
+static void write_request(
+    std::ostream& output, 
+    const rmp::slow_request& entry)
+{
+    double ticks = rmp::tracer::ticks_per_microsecond();
+    time_t seconds = static_cast<time_t>(entry.time / 1000000);
+    char stamp[32];
+    tm utc;
+    gmtime_r(&seconds, &utc);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    // Times are kept in TSC ticks and printed in microseconds
+    output << stamp << "." << std::setfill('0') << std::setw(6) 
+           << entry.time % 1000000 << std::setfill(' ') << "Z"
+           << " command=" << rmp::tracer::command_name(entry.command)
+           << " hash=" << (entry.hash[0] == '\0' ? "-" : entry.hash)
+           << std::fixed << std::setprecision(1)
+           << " latency=" << entry.latency / ticks << "us";
+    // Parsing and writing happen outside the measured span
+    for(size_t phase = rmp::trace_phases::TRACE_LOCK_WAIT; 
+        phase <= rmp::trace_phases::TRACE_SERIALIZE; 
+        phase++)
+    {
+        output << " " 
+               << rmp::tracer::phase_name(
+                    static_cast<rmp::trace_phases>(phase))
+               << "=" << entry.phases[phase] / ticks << "us";
+    }
+    output << " bucket_bytes=" << entry.bucket_bytes
+           << " stored_bytes=" << entry.stored_bytes
+           << " request_bytes=" << entry.request_bytes
+           << " response_bytes=" << entry.response_bytes << std::endl;
+}
\ No newline at end of file
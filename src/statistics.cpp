@@ -0,0 +1,473 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#include <cmath>
+
+static void print_histogram(
+    std::ostream& output, 
+    const std::string& name, 
+    const rmp::histogram& values);
+
+static std::vector<std::shared_ptr<rmp::thread_statistics>>& registry();
+
+static void merge(
+    rmp::thread_statistics& total, 
+    const rmp::thread_statistics& thread);
+
+// Linear steps within each power of two
+const size_t HISTOGRAM_STEPS = 32;
+
+const char * COMMAND_NAMES[] = {"create", "read", "update", "delete"};
+
+const char * MEMORY_NAMES[] = {
+    "cache", "connections", "messages", "queues", "index"};
+
+// The memory limit is compared with the totals this often at most
+const uint64_t MEMORY_CHECK_NANOSECONDS = 100000000;
+
+// Exiting threads fold their counters into the first registry entry and
+// leave the registry, totals never go down
+static std::mutex registry_mutex;
+static thread_local rmp::thread_statistics * current = nullptr;
+static thread_local bool exited = false;
+static std::atomic<uint64_t> memory_limit(0);
+static std::atomic<uint64_t> memory_checked(0);
+static std::atomic<bool> memory_exceeded(false);
+static std::mutex reclaimers_mutex;
+static std::unordered_map<const void*,std::function<uint64_t(uint64_t)>> 
+    reclaimers;
+
+rmp::histogram::histogram() :
+    _count(0),
+    _max(0)
+{
+    for(std::atomic<uint64_t>& count : _counts)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+void rmp::histogram::record(uint64_t value)
+{
+    std::atomic<uint64_t>& count = _counts[bucket(value)];
+    count.store(
+        count.load(std::memory_order_relaxed) + 1, 
+        std::memory_order_relaxed);
+    _count.store(
+        _count.load(std::memory_order_relaxed) + 1, 
+        std::memory_order_relaxed);
+    if(value > _max.load(std::memory_order_relaxed))
+    {
+        _max.store(value, std::memory_order_relaxed);
+    }
+}
+
+void rmp::histogram::record(uint64_t value, uint64_t expected_interval)
+{
+    uint64_t missing;
+    record(value);
+    if(expected_interval > 0)
+    {
+        missing = value;
+        while(missing >= 2 * expected_interval)
+        {
+            missing -= expected_interval;
+            record(missing);
+        }
+    }
+}
+
+void rmp::histogram::merge(const rmp::histogram& other)
+{
+    uint64_t count;
+    for(size_t index = 0; index < HISTOGRAM_BUCKETS; index++)
+    {
+        count = other._counts[index].load(std::memory_order_relaxed);
+        if(count > 0)
+        {
+            _counts[index].store(
+                _counts[index].load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+        }
+    }
+    _count.store(
+        _count.load(std::memory_order_relaxed) + other.count(),
+        std::memory_order_relaxed);
+    _max.store(std::max(max(), other.max()), std::memory_order_relaxed);
+}
+
+uint64_t rmp::histogram::count() const
+{
+    return _count.load(std::memory_order_relaxed);
+}
+
+uint64_t rmp::histogram::max() const
+{
+    return _max.load(std::memory_order_relaxed);
+}
+
+uint64_t rmp::histogram::percentile(double percentile) const
+{
+    uint64_t target, seen = 0, result = 0;
+    size_t index = 0;
+    // Buckets are read while the owner keeps recording, so the target is
+    // taken from the buckets themselves rather than the total
+    for(const std::atomic<uint64_t>& count : _counts)
+    {
+        seen += count.load(std::memory_order_relaxed);
+    }
+    target = static_cast<uint64_t>(std::ceil(seen * percentile / 100.0));
+    seen = 0;
+    while(index < HISTOGRAM_BUCKETS && (seen < target || seen == 0))
+    {
+        seen += _counts[index].load(std::memory_order_relaxed);
+        result = highest(index);
+        index++;
+    }
+    return std::min(result, max());
+}
+
+size_t rmp::histogram::bucket(uint64_t value)
+{
+    size_t result = value;
+    int top;
+    if(value >= HISTOGRAM_STEPS)
+    {
+        // The top bit picks the power of two, the 5 bits below it the step
+        top = 63 - __builtin_clzll(value);
+        result = HISTOGRAM_STEPS 
+            + (top - 5) * HISTOGRAM_STEPS 
+            + ((value >> (top - 5)) & (HISTOGRAM_STEPS - 1));
+    }
+    return result;
+}
+
+uint64_t rmp::histogram::highest(size_t bucket)
+{
+    uint64_t result = bucket;
+    size_t shift, step;
+    if(bucket >= HISTOGRAM_STEPS)
+    {
+        shift = (bucket - HISTOGRAM_STEPS) / HISTOGRAM_STEPS;
+        step = (bucket - HISTOGRAM_STEPS) % HISTOGRAM_STEPS;
+        result = ((HISTOGRAM_STEPS + step + 1) << shift) - 1;
+    }
+    return result;
+}
+
+rmp::zipfian_generator::zipfian_generator(uint64_t items, double theta) :
+    _items(items),
+    _theta(theta),
+    _alpha(1.0 / (1.0 - theta)),
+    _zetan(0.0),
+    _eta(0.0)
+{
+    double zeta2 = 1.0 + std::pow(0.5, theta);
+    // The inverse formula divides by 1 - theta
+    if(theta < 0.0 || theta >= 1.0)
+    {
+        throw std::invalid_argument("Zipfian skew must be below 1");
+    }
+    for(uint64_t item = 1; item <= items; item++)
+    {
+        _zetan += 1.0 / std::pow(static_cast<double>(item), theta);
+    }
+    _eta = (1.0 - std::pow(2.0 / items, 1.0 - theta)) 
+        / (1.0 - zeta2 / _zetan);
+}
+
+uint64_t rmp::zipfian_generator::next(std::mt19937_64& random)
+{
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+    double uz = u * _zetan;
+    uint64_t result;
+    if(uz < 1.0)
+    {
+        result = 0;
+    }
+    else if(uz < 1.0 + std::pow(0.5, _theta))
+    {
+        result = 1;
+    }
+    else
+    {
+        result = static_cast<uint64_t>(
+            _items * std::pow(_eta * u - _eta + 1.0, _alpha));
+    }
+    return std::min(result, _items - 1);
+}
+
+// Owns the calling thread's registry entry until the thread exits
+struct thread_owner
+{
+    std::shared_ptr<rmp::thread_statistics> statistics;
+
+    ~thread_owner();
+};
+
+static thread_local thread_owner owner;
+
+thread_owner::~thread_owner()
+{
+    std::vector<std::shared_ptr<rmp::thread_statistics>>::iterator entry;
+    if(statistics)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        merge(*registry().front(), *statistics);
+        entry = std::find(registry().begin(), registry().end(), statistics);
+        registry().erase(entry);
+    }
+    current = nullptr;
+    exited = true;
+}
+
+rmp::thread_statistics& rmp::statistics::local()
+{
+    std::shared_ptr<rmp::thread_statistics> created;
+    if(current == nullptr)
+    {
+        created = std::make_shared<rmp::thread_statistics>();
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry().push_back(created);
+        current = created.get();
+        // Counting after the owner is gone keeps the entry for good
+        if(!exited)
+        {
+            owner.statistics = created;
+        }
+    }
+    return *current;
+}
+
+void rmp::statistics::add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(
+        counter.load(std::memory_order_relaxed) + value, 
+        std::memory_order_relaxed);
+}
+
+void rmp::statistics::allocate(
+    rmp::memory_subsystems subsystem, 
+    uint64_t bytes)
+{
+    add(local().memory[subsystem], bytes);
+}
+
+void rmp::statistics::release(
+    rmp::memory_subsystems subsystem, 
+    uint64_t bytes)
+{
+    // Unsigned wrap around, the sum over all threads comes out right
+    add(local().memory[subsystem], 0 - bytes);
+}
+
+uint64_t rmp::statistics::memory(rmp::memory_subsystems subsystem)
+{
+    uint64_t result = 0;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for(const std::shared_ptr<rmp::thread_statistics>& thread : registry())
+    {
+        result += thread->memory[subsystem].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+uint64_t rmp::statistics::memory()
+{
+    uint64_t result = 0;
+    for(size_t subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++)
+    {
+        result += memory(static_cast<rmp::memory_subsystems>(subsystem));
+    }
+    return result;
+}
+
+void rmp::statistics::set_memory_limit(uint64_t bytes)
+{
+    memory_limit.store(bytes, std::memory_order_relaxed);
+    memory_checked.store(0, std::memory_order_relaxed);
+    memory_exceeded.store(false, std::memory_order_relaxed);
+}
+
+bool rmp::statistics::over_limit()
+{
+    uint64_t limit = memory_limit.load(std::memory_order_relaxed);
+    uint64_t now, checked, total;
+    if(limit > 0)
+    {
+        // One caller per interval sums the counters, the rest read the flag
+        now = uv_hrtime();
+        checked = memory_checked.load(std::memory_order_relaxed);
+        if(now - checked >= MEMORY_CHECK_NANOSECONDS 
+            && memory_checked.compare_exchange_strong(checked, now))
+        {
+            total = memory();
+            if(total > limit)
+            {
+                std::lock_guard<std::mutex> lock(reclaimers_mutex);
+                for(auto& reclaimer : reclaimers)
+                {
+                    if(total > limit)
+                    {
+                        total -= std::min(
+                            total, 
+                            reclaimer.second(total - limit));
+                    }
+                }
+            }
+            memory_exceeded.store(total > limit, std::memory_order_relaxed);
+        }
+    }
+    return limit > 0 && memory_exceeded.load(std::memory_order_relaxed);
+}
+
+void rmp::statistics::add_reclaimer(
+    const void * owner, 
+    std::function<uint64_t(uint64_t excess)> reclaim)
+{
+    std::lock_guard<std::mutex> lock(reclaimers_mutex);
+    reclaimers[owner] = std::move(reclaim);
+}
+
+void rmp::statistics::remove_reclaimer(const void * owner)
+{
+    std::lock_guard<std::mutex> lock(reclaimers_mutex);
+    reclaimers.erase(owner);
+}
+
+std::string rmp::statistics::report()
+{
+    std::unique_ptr<rmp::thread_statistics> total(
+        new rmp::thread_statistics());
+    std::stringstream output;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for(const std::shared_ptr<rmp::thread_statistics>& thread 
+            : registry())
+        {
+            merge(*total, *thread);
+        }
+    }
+
+    // Latencies are kept in nanoseconds and printed in microseconds
+    output << "requests " << total->requests << std::endl
+           << "errors " << total->errors << std::endl
+           << "bytes_in " << total->bytes_in << std::endl
+           << "bytes_out " << total->bytes_out << std::endl
+           << "connections_open " 
+           << (total->connections_opened > total->connections_closed 
+               ? total->connections_opened - total->connections_closed 
+               : 0)
+           << std::endl
+           << "connections_refused " << total->connections_refused 
+           << std::endl
+           << "lock_contentions " << total->lock_contentions << std::endl
+           << "disk_reads " << total->disk_reads << std::endl
+           << "disk_bytes_read " << total->disk_bytes_read << std::endl
+           << "disk_writes " << total->disk_writes << std::endl
+           << "disk_bytes_written " << total->disk_bytes_written 
+           << std::endl;
+    for(size_t subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++)
+    {
+        output << "memory_" << MEMORY_NAMES[subsystem] << " " 
+               << total->memory[subsystem] << std::endl;
+    }
+    output << "memory_limit " << memory_limit << std::endl;
+    for(size_t command = 0; command < 4; command++)
+    {
+        print_histogram(
+            output, 
+            COMMAND_NAMES[command], 
+            total->latency[command]);
+    }
+    print_histogram(output, "loop_lag", total->loop_lag);
+    print_histogram(output, "lock_wait", total->lock_wait);
+    print_histogram(output, "lock_hold", total->lock_hold);
+    return output.str();
+}
+
+static void print_histogram(
+    std::ostream& output, 
+    const std::string& name, 
+    const rmp::histogram& values)
+{
+    output << name << " count=" << values.count() 
+           << std::fixed << std::setprecision(1)
+           << " p50=" << values.percentile(50) / 1000.0
+           << " p90=" << values.percentile(90) / 1000.0
+           << " p99=" << values.percentile(99) / 1000.0
+           << " p999=" << values.percentile(99.9) / 1000.0
+           << " max=" << values.max() / 1000.0
+           << "us" << std::endl;
+}
+
+static void merge(
+    rmp::thread_statistics& total, 
+    const rmp::thread_statistics& thread)
+{
+    for(size_t command = 0; command < 4; command++)
+    {
+        total.latency[command].merge(thread.latency[command]);
+    }
+    total.loop_lag.merge(thread.loop_lag);
+    total.lock_wait.merge(thread.lock_wait);
+    total.lock_hold.merge(thread.lock_hold);
+    rmp::statistics::add(total.lock_contentions, thread.lock_contentions);
+    rmp::statistics::add(total.requests, thread.requests);
+    rmp::statistics::add(total.errors, thread.errors);
+    rmp::statistics::add(total.bytes_in, thread.bytes_in);
+    rmp::statistics::add(total.bytes_out, thread.bytes_out);
+    rmp::statistics::add(
+        total.connections_opened, 
+        thread.connections_opened);
+    rmp::statistics::add(
+        total.connections_closed, 
+        thread.connections_closed);
+    rmp::statistics::add(
+        total.connections_refused, 
+        thread.connections_refused);
+    rmp::statistics::add(total.disk_reads, thread.disk_reads);
+    rmp::statistics::add(total.disk_bytes_read, thread.disk_bytes_read);
+    rmp::statistics::add(total.disk_writes, thread.disk_writes);
+    rmp::statistics::add(
+        total.disk_bytes_written, 
+        thread.disk_bytes_written);
+    for(size_t subsystem = 0; subsystem < rmp::MEMORY_SUBSYSTEMS; subsystem++)
+    {
+        rmp::statistics::add(total.memory[subsystem], thread.memory[subsystem]);
+    }
+}
+
+static std::vector<std::shared_ptr<rmp::thread_statistics>>& registry()
+{
+    // Never destroyed, queues released during static destruction still 
+    // count into it. The first entry holds the threads that have exited
+    static std::vector<std::shared_ptr<rmp::thread_statistics>> * threads 
+        = new std::vector<std::shared_ptr<rmp::thread_statistics>>(
+            1, 
+            std::make_shared<rmp::thread_statistics>());
+    return *threads;
+}
\ No newline at end of file
@@ -0,0 +1,880 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+
+// Number of released blocks kept per size class for reuse
+const size_t FREE_BLOCKS_PER_CLASS = 64;
+
+const size_t DEFAULT_READAHEAD = 4096;
+
+const size_t DEFAULT_CACHE_CAPACITY = 64 * 1024 * 1024;
+
+const size_t DEFAULT_DESCRIPTOR_CAPACITY = 1024;
+
+const size_t DEFAULT_MIGRATION_THREADS = 4;
+
+static std::runtime_error system_error(
+    const std::string& message,
+    const std::string& path);
+
+rmp::aligned_allocator::aligned_allocator(size_t alignment) :
+    _alignment(alignment),
+    _node(-1),
+    _allocated(0)
+{
+
+}
+
+rmp::aligned_allocator::~aligned_allocator()
+{
+    for(auto& free_blocks : _free_blocks)
+    {
+        for(void * block : free_blocks.second)
+        {
+            free(block);
+        }
+    }
+}
+
+void * rmp::aligned_allocator::allocate(size_t size)
+{
+    void * result = nullptr;
+    size_t block_size = round_up(size);
+    std::unique_lock<std::mutex> lock(_free_blocks_mutex);
+    std::vector<void*>& free_blocks = _free_blocks[block_size];
+    if(free_blocks.size() > 0)
+    {
+        result = free_blocks.back();
+        free_blocks.pop_back();
+    }
+    lock.unlock();
+
+    // Reused blocks are already on the node, only fresh ones are bound
+    if(result == nullptr)
+    {
+        if(posix_memalign(&result, _alignment, block_size) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        if(_node >= 0)
+        {
+            rmp::numa::bind(result, block_size, _node);
+        }
+    }
+    _allocated += block_size;
+    return result;
+}
+
+void rmp::aligned_allocator::deallocate(void * block, size_t size)
+{
+    size_t block_size = round_up(size);
+    std::unique_lock<std::mutex> lock(_free_blocks_mutex);
+    std::vector<void*>& free_blocks = _free_blocks[block_size];
+    _allocated -= block_size;
+    if(free_blocks.size() < FREE_BLOCKS_PER_CLASS)
+    {
+        free_blocks.push_back(block);
+    }
+    else
+    {
+        lock.unlock();
+        free(block);
+    }
+}
+
+size_t rmp::aligned_allocator::round_up(size_t size) const
+{
+    // Size classes are a power of two number of alignment units
+    size_t result = _alignment;
+    while(result < size)
+    {
+        result <<= 1;
+    }
+    return result;
+}
+
+size_t rmp::aligned_allocator::alignment() const
+{
+    return _alignment;
+}
+
+size_t rmp::aligned_allocator::allocated() const
+{
+    return _allocated;
+}
+
+void rmp::aligned_allocator::set_node(int node)
+{
+    _node = node;
+}
+
+rmp::aligned_buffer::aligned_buffer(
+    rmp::aligned_allocator& allocator,
+    size_t capacity) :
+    _allocator(allocator),
+    _capacity(allocator.round_up(capacity)),
+    _size(0)
+{
+    _data = reinterpret_cast<char*>(
+        _allocator.allocate(_capacity));
+}
+
+rmp::aligned_buffer::~aligned_buffer()
+{
+    _allocator.deallocate(_data, _capacity);
+}
+
+char * rmp::aligned_buffer::data()
+{
+    return _data;
+}
+
+const char * rmp::aligned_buffer::data() const
+{
+    return _data;
+}
+
+size_t rmp::aligned_buffer::capacity() const
+{
+    return _capacity;
+}
+
+size_t rmp::aligned_buffer::size() const
+{
+    return _size;
+}
+
+void rmp::aligned_buffer::resize(size_t size)
+{
+    if(size > _capacity)
+    {
+        throw std::length_error("Buffer size exceeds capacity");
+    }
+    _size = size;
+}
+
+rmp::page_cache::page_cache(size_t capacity) :
+    _capacity(capacity),
+    _size(0),
+    _hits(0),
+    _misses(0)
+{
+    rmp::statistics::add_reclaimer(this, [this](uint64_t excess)
+    {
+        return shrink(size() > excess ? size() - excess : 0);
+    });
+}
+
+rmp::page_cache::~page_cache()
+{
+    rmp::statistics::remove_reclaimer(this);
+    rmp::statistics::release(rmp::memory_subsystems::MEMORY_CACHE, _size);
+}
+
+std::shared_ptr<const rmp::aligned_buffer> rmp::page_cache::find(
+    const std::string& hash)
+{
+    std::shared_ptr<const rmp::aligned_buffer> result;
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto index = _index.find(hash);
+    if(index != _index.end())
+    {
+        // Move to the front of the LRU list
+        _entries.splice(_entries.begin(), _entries, index->second);
+        result = index->second->second;
+        _hits++;
+    }
+    else
+    {
+        _misses++;
+    }
+    return result;
+}
+
+void rmp::page_cache::insert(
+    const std::string& hash,
+    std::shared_ptr<const rmp::aligned_buffer> buffer)
+{
+    size_t capacity;
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto index = _index.find(hash);
+    if(index != _index.end())
+    {
+        _size -= index->second->second->capacity();
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CACHE, 
+            index->second->second->capacity());
+        _entries.erase(index->second);
+        _index.erase(index);
+    }
+
+    if(buffer->capacity() <= _capacity)
+    {
+        _entries.emplace_front(hash, std::move(buffer));
+        _index[hash] = _entries.begin();
+        _size += _entries.front().second->capacity();
+        rmp::statistics::allocate(
+            rmp::memory_subsystems::MEMORY_CACHE, 
+            _entries.front().second->capacity());
+        capacity = _capacity;
+        lock.unlock();
+        shrink(capacity);
+    }
+}
+
+void rmp::page_cache::erase(const std::string& hash)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto index = _index.find(hash);
+    if(index != _index.end())
+    {
+        _size -= index->second->second->capacity();
+        rmp::statistics::release(
+            rmp::memory_subsystems::MEMORY_CACHE, 
+            index->second->second->capacity());
+        _entries.erase(index->second);
+        _index.erase(index);
+    }
+}
+
+size_t rmp::page_cache::shrink(size_t target)
+{
+    size_t result = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(_size > target && _entries.size() > 0)
+    {
+        // Evict from the back of the LRU list
+        result += _entries.back().second->capacity();
+        _size -= _entries.back().second->capacity();
+        _index.erase(_entries.back().first);
+        _entries.pop_back();
+    }
+    rmp::statistics::release(rmp::memory_subsystems::MEMORY_CACHE, result);
+    return result;
+}
+
+void rmp::page_cache::set_capacity(size_t capacity)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _capacity = capacity;
+    lock.unlock();
+    shrink(capacity);
+}
+
+size_t rmp::page_cache::capacity() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _capacity;
+}
+
+size_t rmp::page_cache::size() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _size;
+}
+
+uint64_t rmp::page_cache::hits() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+uint64_t rmp::page_cache::misses() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _misses;
+}
+
+rmp::file_descriptor::file_descriptor(int fd) :
+    _fd(fd)
+{
+
+}
+
+rmp::file_descriptor::~file_descriptor()
+{
+    close(_fd);
+}
+
+int rmp::file_descriptor::get() const
+{
+    return _fd;
+}
+
+rmp::descriptor_cache::descriptor_cache(size_t capacity) :
+    _capacity(capacity),
+    _directory_fd(-1),
+    _flags(0)
+{
+
+}
+
+rmp::descriptor_cache::~descriptor_cache()
+{
+    if(_directory_fd >= 0)
+    {
+        close(_directory_fd);
+    }
+}
+
+void rmp::descriptor_cache::open(
+    const std::string& directory,
+    int flags,
+    bool use_openat)
+{
+    clear();
+    if(_directory_fd >= 0)
+    {
+        close(_directory_fd);
+        _directory_fd = -1;
+    }
+
+    _directory = directory;
+    _flags = flags;
+    if(use_openat)
+    {
+        _directory_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if(_directory_fd < 0)
+        {
+            throw system_error("Failed to open directory", directory);
+        }
+    }
+}
+
+std::shared_ptr<rmp::file_descriptor> rmp::descriptor_cache::acquire(
+    const std::string& hash,
+    const std::string& path,
+    bool create)
+{
+    std::shared_ptr<rmp::file_descriptor> result;
+    int fd;
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto index = _index.find(hash);
+    if(index != _index.end())
+    {
+        _entries.splice(_entries.begin(), _entries, index->second);
+        result = index->second->second;
+    }
+    lock.unlock();
+
+    if(!result)
+    {
+        // Open outside of the lock, a racing open of the same bucket is
+        // harmless since the loser is closed once its users release it
+        fd = open_file(path, create);
+        if(fd >= 0)
+        {
+            result = std::make_shared<rmp::file_descriptor>(fd);
+            lock.lock();
+            if(_capacity > 0)
+            {
+                index = _index.find(hash);
+                if(index != _index.end())
+                {
+                    _entries.erase(index->second);
+                }
+                _entries.emplace_front(hash, result);
+                _index[hash] = _entries.begin();
+                evict();
+            }
+        }
+    }
+    return result;
+}
+
+void rmp::descriptor_cache::erase(const std::string& hash)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto index = _index.find(hash);
+    if(index != _index.end())
+    {
+        _entries.erase(index->second);
+        _index.erase(index);
+    }
+}
+
+void rmp::descriptor_cache::clear()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _entries.clear();
+    _index.clear();
+}
+
+void rmp::descriptor_cache::set_capacity(size_t capacity)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _capacity = capacity;
+    evict();
+}
+
+size_t rmp::descriptor_cache::capacity() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _capacity;
+}
+
+size_t rmp::descriptor_cache::size() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _entries.size();
+}
+
+int rmp::descriptor_cache::open_file(
+    const std::string& path,
+    bool create) const
+{
+    int result;
+    int flags = _flags | (create ? O_CREAT : 0);
+    if(_directory_fd >= 0)
+    {
+        result = openat(_directory_fd, path.c_str(), flags, 0644);
+    }
+    else
+    {
+        result = ::open((_directory + "/" + path).c_str(), flags, 0644);
+    }
+
+    if(result < 0 && (create || errno != ENOENT))
+    {
+        throw system_error("Failed to open bucket", path);
+    }
+    return result;
+}
+
+void rmp::descriptor_cache::evict()
+{
+    // Descriptors still held by a request are closed when it releases them
+    while(_entries.size() > _capacity)
+    {
+        _index.erase(_entries.back().first);
+        _entries.pop_back();
+    }
+}
+
+rmp::bucket_store::bucket_store() :
+    _io_mode(rmp::io_modes::BUFFERED_IO),
+    _readahead(DEFAULT_READAHEAD),
+    _use_openat(false),
+    _migration_threads(DEFAULT_MIGRATION_THREADS),
+    _migrating(false),
+    _migration_failed(false),
+    _cache(DEFAULT_CACHE_CAPACITY),
+    _descriptors(DEFAULT_DESCRIPTOR_CAPACITY)
+{
+
+}
+
+void rmp::bucket_store::set_root_directory(
+    const std::string& root_directory)
+{
+    _root_directory = root_directory;
+}
+
+void rmp::bucket_store::set_io_mode(rmp::io_modes io_mode)
+{
+    _io_mode = io_mode;
+}
+
+void rmp::bucket_store::set_cache_capacity(size_t capacity)
+{
+    _cache.set_capacity(capacity);
+}
+
+void rmp::bucket_store::set_readahead(size_t readahead)
+{
+    _readahead = _allocator.round_up(readahead);
+}
+
+void rmp::bucket_store::set_descriptor_capacity(size_t capacity)
+{
+    _descriptors.set_capacity(capacity);
+}
+
+void rmp::bucket_store::set_openat(bool use_openat)
+{
+    _use_openat = use_openat;
+}
+
+void rmp::bucket_store::set_layout(const rmp::bucket_layout& layout)
+{
+    _layout = layout;
+}
+
+void rmp::bucket_store::set_migration_threads(size_t threads)
+{
+    _migration_threads = threads;
+}
+
+void rmp::bucket_store::set_partition(
+    const rmp::bucket_store& parent, 
+    size_t partitions)
+{
+    // Same files and settings, the cache budgets are split evenly
+    _root_directory = parent._root_directory;
+    _io_mode = parent._io_mode;
+    _readahead = parent._readahead;
+    _use_openat = parent._use_openat;
+    _layout = parent._layout;
+    _migration_threads = parent._migration_threads;
+    _cache.set_capacity(parent._cache.capacity() / partitions);
+    _descriptors.set_capacity(
+        std::max<size_t>(parent._descriptors.capacity() / partitions, 1));
+}
+
+void rmp::bucket_store::set_numa_node(int node)
+{
+    _allocator.set_node(node);
+}
+
+void rmp::bucket_store::open()
+{
+    int flags = O_RDWR;
+    std::string probe_path, current;
+    int fd;
+    if(_io_mode == rmp::io_modes::DIRECT_IO)
+    {
+#if defined(O_DIRECT)
+        flags |= O_DIRECT;
+#else
+        throw std::runtime_error("Direct I/O is not supported");
+#endif
+        // Fail early if the file system does not support O_DIRECT
+        probe_path = _root_directory + "/.direct";
+        fd = ::open(probe_path.c_str(), flags | O_CREAT, 0644);
+        if(fd < 0)
+        {
+            throw system_error("Failed to open for direct I/O", probe_path);
+        }
+        close(fd);
+        unlink(probe_path.c_str());
+    }
+    _descriptors.open(_root_directory, flags, _use_openat);
+
+    current = rmp::bucket_layout::load(_root_directory).name();
+    if(current != _layout.name())
+    {
+        if(current != "flat")
+        {
+            throw std::runtime_error(
+                "Cannot migrate bucket layout " + current 
+                + " to " + _layout.name());
+        }
+        // Serve from both layouts until every flat bucket has moved, the
+        // fan-out directories are made as buckets need them
+        _migrating = true;
+        _migrator.reset(new rmp::layout_migrator(
+            _root_directory, 
+            _layout, 
+            _migration_threads));
+        _migrator->start([this](bool complete)
+        {
+            _migration_failed = !complete;
+            _migrating = !complete;
+        });
+    }
+}
+
+bool rmp::bucket_store::migrating() const
+{
+    return _migrating;
+}
+
+bool rmp::bucket_store::migration_failed() const
+{
+    return _migration_failed;
+}
+
+void rmp::bucket_store::scan(
+    std::function<void(
+        const std::string& hash, 
+        rmp::bucket& bucket)> callback,
+    std::function<bool(const std::string& hash)> filter)
+{
+    std::vector<std::string> directories(1, _root_directory);
+    std::string directory, path;
+    DIR * handle;
+    dirent * entry;
+    struct stat status;
+    rmp::bucket bucket;
+
+    // Walks both layouts, buckets moved mid-scan may be seen twice
+    while(directories.size() > 0)
+    {
+        directory = directories.back();
+        directories.pop_back();
+        handle = opendir(directory.c_str());
+        if(handle == nullptr)
+        {
+            throw system_error("Failed to open directory", directory);
+        }
+        while((entry = readdir(handle)) != nullptr)
+        {
+            if(!rmp::bucket_layout::is_bucket_name(entry->d_name))
+            {
+                continue;
+            }
+            path = directory + "/" + entry->d_name;
+            if(lstat(path.c_str(), &status) < 0)
+            {
+                continue;
+            }
+            if(S_ISDIR(status.st_mode))
+            {
+                directories.push_back(path);
+            }
+            else if(S_ISREG(status.st_mode) 
+                && (!filter || filter(entry->d_name)))
+            {
+                load(entry->d_name, bucket);
+                callback(entry->d_name, bucket);
+            }
+        }
+        closedir(handle);
+    }
+}
+
+void rmp::bucket_store::load(
+    const std::string& hash,
+    rmp::bucket& bucket)
+{
+    std::shared_ptr<const rmp::aligned_buffer> buffer;
+    std::shared_ptr<rmp::file_descriptor> descriptor;
+    bool direct = (_io_mode == rmp::io_modes::DIRECT_IO);
+    rmp::trace_phase phase(rmp::trace_phases::TRACE_LOAD_BUCKET);
+    RMP_PROBE(bucket__load__start, hash.c_str());
+
+    bucket.clear_records();
+
+    if(direct)
+    {
+        buffer = _cache.find(hash);
+    }
+
+    if(!buffer)
+    {
+        descriptor = open_bucket(hash, false);
+        if(descriptor)
+        {
+            try
+            {
+                buffer = read_bucket(descriptor->get());
+            }
+            catch(const std::exception& e)
+            {
+                throw system_error(e.what(), hash);
+            }
+            if(direct)
+            {
+                _cache.insert(hash, buffer);
+            }
+        }
+    }
+
+    if(buffer && buffer->size() > 0)
+    {
+        rmp::slow_log::touch(buffer->size(), 0);
+        bucket.ParseFromArray(
+            buffer->data(),
+            buffer->size());
+    }
+    RMP_PROBE(bucket__load__end, hash.c_str(), buffer ? buffer->size() : 0);
+}
+
+void rmp::bucket_store::store(
+    const std::string& hash,
+    const rmp::bucket& bucket)
+{
+    std::shared_ptr<rmp::aligned_buffer> buffer;
+    std::shared_ptr<rmp::file_descriptor> descriptor;
+    size_t size;
+    rmp::trace_phase phase(rmp::trace_phases::TRACE_STORE_BUCKET);
+
+    size = bucket.ByteSizeLong();
+    RMP_PROBE(bucket__store__start, hash.c_str(), size);
+    rmp::slow_log::touch(0, size);
+    buffer = std::make_shared<rmp::aligned_buffer>(_allocator, size);
+    bucket.SerializeWithCachedSizesToArray(
+        reinterpret_cast<uint8_t*>(buffer->data()));
+    buffer->resize(size);
+    if(_io_mode == rmp::io_modes::DIRECT_IO)
+    {
+        // O_DIRECT writes whole blocks, so pad and truncate afterwards
+        memset(
+            buffer->data() + size,
+            0,
+            buffer->capacity() - size);
+    }
+
+    descriptor = open_bucket(hash, true);
+    try
+    {
+        write_bucket(descriptor->get(), *buffer);
+    }
+    catch(const std::exception& e)
+    {
+        _cache.erase(hash);
+        throw system_error(e.what(), hash);
+    }
+
+    if(_io_mode == rmp::io_modes::DIRECT_IO)
+    {
+        // The cache is the only copy of the bucket kept in memory
+        _cache.insert(hash, buffer);
+    }
+    RMP_PROBE(bucket__store__end, hash.c_str(), size);
+}
+
+rmp::page_cache& rmp::bucket_store::cache()
+{
+    return _cache;
+}
+
+std::shared_ptr<rmp::aligned_buffer> rmp::bucket_store::read_bucket(int fd)
+{
+    std::shared_ptr<rmp::aligned_buffer> result, larger;
+    rmp::thread_statistics& statistics = rmp::statistics::local();
+    struct stat status;
+    ssize_t read_size;
+    size_t size;
+
+    // Read ahead a fixed number of blocks, most buckets fit in one read
+    result = std::make_shared<rmp::aligned_buffer>(_allocator, _readahead);
+    read_size = pread(fd, result->data(), result->capacity(), 0);
+    if(read_size < 0)
+    {
+        throw std::runtime_error("Failed to read bucket");
+    }
+    size = read_size;
+    rmp::statistics::add(statistics.disk_reads, 1);
+
+    if(size == result->capacity())
+    {
+        if(fstat(fd, &status) < 0)
+        {
+            throw std::runtime_error("Failed to stat bucket");
+        }
+        larger = std::make_shared<rmp::aligned_buffer>(
+            _allocator,
+            status.st_size);
+        memcpy(larger->data(), result->data(), size);
+        while(read_size > 0 && size < larger->capacity())
+        {
+            read_size = pread(
+                fd,
+                larger->data() + size,
+                larger->capacity() - size,
+                size);
+            if(read_size < 0)
+            {
+                throw std::runtime_error("Failed to read bucket");
+            }
+            size += read_size;
+            rmp::statistics::add(statistics.disk_reads, 1);
+        }
+        result = larger;
+    }
+    rmp::statistics::add(statistics.disk_bytes_read, size);
+    result->resize(size);
+    return result;
+}
+
+void rmp::bucket_store::write_bucket(
+    int fd,
+    const rmp::aligned_buffer& buffer)
+{
+    size_t length = buffer.size();
+    ssize_t written = 0;
+
+    if(_io_mode == rmp::io_modes::DIRECT_IO && length > 0)
+    {
+        length = buffer.capacity();
+    }
+
+    if(length > 0)
+    {
+        written = pwrite(fd, buffer.data(), length, 0);
+        rmp::statistics::add(rmp::statistics::local().disk_writes, 1);
+    }
+
+    if(written < 0 || static_cast<size_t>(written) != length)
+    {
+        throw std::runtime_error("Failed to write bucket");
+    }
+    rmp::statistics::add(rmp::statistics::local().disk_bytes_written, length);
+
+    if(ftruncate(fd, buffer.size()) < 0)
+    {
+        throw std::runtime_error("Failed to truncate bucket");
+    }
+}
+
+std::shared_ptr<rmp::file_descriptor> rmp::bucket_store::open_bucket(
+    const std::string& hash,
+    bool create)
+{
+    std::shared_ptr<rmp::file_descriptor> result;
+    std::string path = _layout.path(hash);
+    if(!_migrating)
+    {
+        result = _descriptors.acquire(hash, path, create);
+    }
+    else if(create)
+    {
+        // Move the flat bucket first so the write cannot be overwritten
+        // by the migrator moving a stale copy later
+        _layout.create_parents(_root_directory, hash);
+        if(rename(
+            (_root_directory + "/" + hash).c_str(), 
+            (_root_directory + "/" + path).c_str()) < 0 && errno != ENOENT)
+        {
+            throw system_error("Failed to migrate bucket", hash);
+        }
+        result = _descriptors.acquire(hash, path, create);
+    }
+    else
+    {
+        // Buckets only ever move from the flat path to the fan-out path,
+        // so checking the fan-out path again covers a concurrent move
+        result = _descriptors.acquire(hash, path, false);
+        if(!result)
+        {
+            result = _descriptors.acquire(hash, hash, false);
+        }
+        if(!result)
+        {
+            result = _descriptors.acquire(hash, path, false);
+        }
+    }
+    return result;
+}
+
+static std::runtime_error system_error(
+    const std::string& message,
+    const std::string& path)
+{
+    return std::runtime_error(
+        message + " " + path + ": " + strerror(errno));
+}
\ No newline at end of file
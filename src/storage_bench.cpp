@@ -0,0 +1,477 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+#include "record_manager.h"
+
+struct workload
+{
+    std::string directory;
+    std::vector<std::string> backends;
+    size_t buckets = 10000;
+    size_t records = 4;
+    size_t value_size = 64;
+    std::string distribution = "uniform";
+    double theta = 0.99;
+    unsigned read_percent = 50;
+    size_t operations = 100000;
+    size_t threads = 1;
+    size_t cache_size = 64 * 1024 * 1024;
+    uint64_t seed = 1;
+};
+
+struct results
+{
+    std::mutex mutex;
+    rmp::histogram reads;
+    rmp::histogram writes;
+    std::atomic<uint64_t> disk_reads{0};
+    std::atomic<uint64_t> disk_bytes_read{0};
+    std::atomic<uint64_t> disk_writes{0};
+    std::atomic<uint64_t> disk_bytes_written{0};
+};
+
+static bool storage_bench_init(
+    workload& workload,
+    int argc, 
+    const char ** argv) noexcept;
+
+static bool storage_bench_main(const workload& workload) noexcept;
+
+static void parse_option(workload& workload, const std::string& option);
+
+static void configure(
+    rmp::bucket_store& store, 
+    const workload& workload,
+    const std::string& backend);
+
+static void populate(rmp::bucket_store& store, const workload& workload);
+
+static void run(
+    rmp::bucket_store& store, 
+    const workload& workload,
+    size_t thread,
+    std::atomic<uint64_t>& inserted,
+    results& results);
+
+static void report(
+    const std::string& backend, 
+    const workload& workload,
+    double seconds,
+    rmp::bucket_store& store,
+    const results& results);
+
+static void print_histogram(
+    const std::string& name, 
+    const rmp::histogram& values);
+
+static std::string bucket_hash(uint64_t key);
+
+static void fill_bucket(
+    rmp::bucket& bucket, 
+    const workload& workload, 
+    uint64_t key);
+
+int main(int argc, const char ** argv)
+{
+    workload workload;
+    return (storage_bench_init(workload,argc,argv) 
+        && storage_bench_main(workload))
+        ? EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+static bool storage_bench_init(
+    workload& workload,
+    int argc, 
+    const char ** argv) noexcept
+{
+    bool result(true);
+    std::string error_message;
+
+    result = (argc >= 2);
+
+    if(result)
+    {
+        try
+        {
+            workload.directory = argv[1];
+            workload.backends = {"buffered", "direct", "fanout"};
+            for(int arg = 2; arg < argc; arg++)
+            {
+                parse_option(workload, argv[arg]);
+            }
+        }
+        catch(const std::exception& e)
+        {
+            error_message = e.what();
+            result = false;
+        }
+    }
+    else
+    {
+        error_message = "At least 2 args expected, " + std::to_string(argc) + " found.";
+    }
+
+    if (!result)
+    {
+        std::cerr << "Failed to parse args: "
+                  << error_message
+                  << std::endl
+                  << "storage-bench <directory> [options]"
+                  << std::endl
+                  << "  --backends=<list>    buffered,direct,fanout by default"
+                  << std::endl
+                  << "  --buckets=<count>    dataset size, 10000 by default"
+                  << std::endl
+                  << "  --records=<count>    records per bucket, 4 by default"
+                  << std::endl
+                  << "  --value-size=<bytes> bytes per record, 64 by default"
+                  << std::endl
+                  << "  --distribution=<uniform|zipfian|latest>"
+                  << std::endl
+                  << "                       keys chosen, uniform by default"
+                  << std::endl
+                  << "  --theta=<skew>       zipfian skew, 0.99 by default"
+                  << std::endl
+                  << "  --reads=<percent>    reads in the mix, 50 by default"
+                  << std::endl
+                  << "  --operations=<count> measured, 100000 by default"
+                  << std::endl
+                  << "  --threads=<count>    threads issuing operations"
+                  << std::endl
+                  << "  --cache-size=<bytes> direct I/O cache capacity"
+                  << std::endl
+                  << "  --seed=<n>           random seed"
+                  << std::endl;
+    }
+
+    return result;
+}
+
+static bool storage_bench_main(const workload& workload) noexcept
+{
+    bool result(true);
+    std::string directory;
+    std::vector<std::thread> threads;
+    std::chrono::steady_clock::time_point start;
+    double seconds;
+    for(const std::string& backend : workload.backends)
+    {
+        // Every backend gets a fresh store and the same seeded workload
+        rmp::bucket_store store;
+        results results;
+        std::atomic<uint64_t> inserted(workload.buckets);
+        try
+        {
+            directory = workload.directory + "/" + backend;
+            if(mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+            {
+                throw std::runtime_error(
+                    "Failed to create directory " + directory);
+            }
+            store.set_root_directory(directory);
+            configure(store, workload, backend);
+            store.open();
+            while(store.migrating() && !store.migration_failed())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            populate(store, workload);
+            start = std::chrono::steady_clock::now();
+            for(size_t thread = 0; thread < workload.threads; thread++)
+            {
+                threads.emplace_back(
+                    run, 
+                    std::ref(store), 
+                    std::cref(workload),
+                    thread,
+                    std::ref(inserted),
+                    std::ref(results));
+            }
+            for(std::thread& thread : threads)
+            {
+                thread.join();
+            }
+            threads.clear();
+            seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            report(backend, workload, seconds, store, results);
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << backend << ": " << e.what() << std::endl;
+            result = false;
+        }
+    }
+    return result;
+}
+
+static void parse_option(workload& workload, const std::string& option)
+{
+    std::string name, value, backend;
+    size_t separator;
+
+    separator = option.find('=');
+    name = option.substr(0, separator);
+    if(separator != std::string::npos)
+    {
+        value = option.substr(separator + 1);
+    }
+
+    if(name == "--backends")
+    {
+        std::stringstream list(value);
+        workload.backends.clear();
+        while(std::getline(list, backend, ','))
+        {
+            workload.backends.push_back(backend);
+        }
+    }
+    else if(name == "--buckets" && std::stoull(value) > 0)
+    {
+        workload.buckets = std::stoull(value);
+    }
+    else if(name == "--records")
+    {
+        workload.records = std::stoull(value);
+    }
+    else if(name == "--value-size")
+    {
+        workload.value_size = std::stoull(value);
+    }
+    else if(name == "--distribution" 
+        && (value == "uniform" || value == "zipfian" || value == "latest"))
+    {
+        workload.distribution = value;
+    }
+    else if(name == "--theta")
+    {
+        workload.theta = std::stod(value);
+    }
+    else if(name == "--reads" && std::stoul(value) <= 100)
+    {
+        workload.read_percent = std::stoul(value);
+    }
+    else if(name == "--operations")
+    {
+        workload.operations = std::stoull(value);
+    }
+    else if(name == "--threads" && std::stoull(value) > 0)
+    {
+        workload.threads = std::stoull(value);
+    }
+    else if(name == "--cache-size")
+    {
+        workload.cache_size = std::stoull(value);
+    }
+    else if(name == "--seed")
+    {
+        workload.seed = std::stoull(value);
+    }
+    else
+    {
+        throw std::invalid_argument("Unrecognized option " + option);
+    }
+}
+
+static void configure(
+    rmp::bucket_store& store, 
+    const workload& workload,
+    const std::string& backend)
+{
+    if(backend == "direct")
+    {
+        store.set_io_mode(rmp::io_modes::DIRECT_IO);
+        store.set_cache_capacity(workload.cache_size);
+    }
+    else if(backend == "fanout")
+    {
+        store.set_layout(rmp::bucket_layout::parse("2x2"));
+    }
+    else if(backend == "direct-fanout")
+    {
+        store.set_io_mode(rmp::io_modes::DIRECT_IO);
+        store.set_cache_capacity(workload.cache_size);
+        store.set_layout(rmp::bucket_layout::parse("2x2"));
+    }
+    else if(backend != "buffered")
+    {
+        throw std::invalid_argument("Unknown backend " + backend);
+    }
+}
+
+static void populate(rmp::bucket_store& store, const workload& workload)
+{
+    rmp::bucket bucket;
+    for(uint64_t key = 0; key < workload.buckets; key++)
+    {
+        fill_bucket(bucket, workload, key);
+        store.store(bucket_hash(key), bucket);
+    }
+}
+
+static void run(
+    rmp::bucket_store& store, 
+    const workload& workload,
+    size_t thread,
+    std::atomic<uint64_t>& inserted,
+    results& results)
+{
+    rmp::thread_statistics& statistics = rmp::statistics::local();
+    std::mt19937_64 random(workload.seed + thread);
+    std::uniform_int_distribution<uint64_t> uniform(0, workload.buckets - 1);
+    std::uniform_int_distribution<unsigned> percent(0, 99);
+    rmp::zipfian_generator zipfian(workload.buckets, workload.theta);
+    uint64_t disk_reads = statistics.disk_reads;
+    uint64_t disk_bytes_read = statistics.disk_bytes_read;
+    uint64_t disk_writes = statistics.disk_writes;
+    uint64_t disk_bytes_written = statistics.disk_bytes_written;
+    size_t operations = workload.operations / workload.threads;
+    std::unique_ptr<rmp::histogram> reads(new rmp::histogram());
+    std::unique_ptr<rmp::histogram> writes(new rmp::histogram());
+    rmp::bucket bucket;
+    uint64_t key, begin, latest;
+    bool read;
+    if(thread < workload.operations % workload.threads)
+    {
+        operations++;
+    }
+    for(size_t operation = 0; operation < operations; operation++)
+    {
+        read = percent(random) < workload.read_percent;
+        if(workload.distribution == "latest")
+        {
+            // Writes insert new buckets, reads favour the newest ones
+            latest = inserted.load(std::memory_order_relaxed) - 1;
+            key = read 
+                ? latest - std::min(latest, zipfian.next(random))
+                : inserted.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if(workload.distribution == "zipfian")
+        {
+            key = zipfian.next(random);
+        }
+        else
+        {
+            key = uniform(random);
+        }
+
+        if(read)
+        {
+            begin = uv_hrtime();
+            store.load(bucket_hash(key), bucket);
+            reads->record(uv_hrtime() - begin);
+        }
+        else
+        {
+            fill_bucket(bucket, workload, key);
+            begin = uv_hrtime();
+            store.store(bucket_hash(key), bucket);
+            writes->record(uv_hrtime() - begin);
+        }
+    }
+    // Histograms take one writer, each thread merges its own at the end
+    {
+        std::lock_guard<std::mutex> lock(results.mutex);
+        results.reads.merge(*reads);
+        results.writes.merge(*writes);
+    }
+    rmp::statistics::add(
+        results.disk_reads, 
+        statistics.disk_reads - disk_reads);
+    rmp::statistics::add(
+        results.disk_bytes_read, 
+        statistics.disk_bytes_read - disk_bytes_read);
+    rmp::statistics::add(
+        results.disk_writes, 
+        statistics.disk_writes - disk_writes);
+    rmp::statistics::add(
+        results.disk_bytes_written, 
+        statistics.disk_bytes_written - disk_bytes_written);
+}
+
+static void report(
+    const std::string& backend, 
+    const workload& workload,
+    double seconds,
+    rmp::bucket_store& store,
+    const results& results)
+{
+    double operations = static_cast<double>(workload.operations);
+    std::cout << "backend " << backend << std::endl
+              << "distribution " << workload.distribution << std::endl
+              << "operations " << workload.operations << std::endl
+              << std::fixed << std::setprecision(1)
+              << "seconds " << seconds << std::endl
+              << "ops_per_second " << operations / seconds << std::endl
+              << "disk_reads_per_op " 
+              << results.disk_reads / operations << std::endl
+              << "disk_bytes_read_per_op " 
+              << results.disk_bytes_read / operations << std::endl
+              << "disk_writes_per_op " 
+              << results.disk_writes / operations << std::endl
+              << "disk_bytes_written_per_op " 
+              << results.disk_bytes_written / operations << std::endl
+              << "cache_hits " << store.cache().hits() << std::endl
+              << "cache_misses " << store.cache().misses() << std::endl;
+    print_histogram("read", results.reads);
+    print_histogram("write", results.writes);
+}
+
+static void print_histogram(
+    const std::string& name, 
+    const rmp::histogram& values)
+{
+    std::cout << name << " count=" << values.count() 
+              << std::fixed << std::setprecision(1)
+              << " p50=" << values.percentile(50) / 1000.0
+              << " p90=" << values.percentile(90) / 1000.0
+              << " p99=" << values.percentile(99) / 1000.0
+              << " p999=" << values.percentile(99.9) / 1000.0
+              << " max=" << values.max() / 1000.0
+              << "us" << std::endl;
+}
+
+static std::string bucket_hash(uint64_t key)
+{
+    return rmp::djb_hash("user" + std::to_string(key) + "@example.com");
+}
+
+static void fill_bucket(
+    rmp::bucket& bucket, 
+    const workload& workload, 
+    uint64_t key)
+{
+    rmp::record * record;
+    bucket.Clear();
+    for(size_t index = 0; index < workload.records; index++)
+    {
+        record = bucket.add_records();
+        record->set_email(
+            "user" + std::to_string(key) 
+            + "-" + std::to_string(index) + "@example.com");
+        record->mutable_contact()->set_name(
+            std::string(workload.value_size, 'x'));
+        record->mutable_contact()->set_phone("0000000000");
+    }
+}
\ No newline at end of file
@@ -0,0 +1,552 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+
+static rmp::bucket * create_bucket(
+    google::protobuf::Arena * arena,
+    std::unique_ptr<rmp::bucket>& owner);
+
+rmp::store::store() :
+    _memory_tier(false),
+    _locking(true),
+    _lock_threshold(0)
+{
+
+}
+
+rmp::store::store(const std::string& root_directory) :
+    store()
+{
+    set_root_directory(root_directory);
+}
+
+void rmp::store::set_root_directory(const std::string& root_directory)
+{
+    _buckets.set_root_directory(root_directory);
+}
+
+void rmp::store::set_io_mode(rmp::io_modes io_mode)
+{
+    _buckets.set_io_mode(io_mode);
+}
+
+void rmp::store::set_cache_capacity(size_t capacity)
+{
+    _buckets.set_cache_capacity(capacity);
+}
+
+void rmp::store::set_readahead(size_t readahead)
+{
+    _buckets.set_readahead(readahead);
+}
+
+void rmp::store::set_descriptor_capacity(size_t capacity)
+{
+    _buckets.set_descriptor_capacity(capacity);
+}
+
+void rmp::store::set_openat(bool use_openat)
+{
+    _buckets.set_openat(use_openat);
+}
+
+void rmp::store::set_layout(const rmp::bucket_layout& layout)
+{
+    _buckets.set_layout(layout);
+}
+
+void rmp::store::set_migration_threads(size_t threads)
+{
+    _buckets.set_migration_threads(threads);
+}
+
+void rmp::store::set_memory_tier(bool memory_tier)
+{
+    _memory_tier = memory_tier;
+}
+
+void rmp::store::set_locking(bool locking)
+{
+    _locking = locking;
+}
+
+void rmp::store::set_lock_threshold(uint64_t milliseconds)
+{
+    _lock_threshold = milliseconds * 1000000;
+}
+
+void rmp::store::set_partition(const rmp::store& parent, size_t partitions)
+{
+    _buckets.set_partition(parent._buckets, partitions);
+    _memory_tier = parent._memory_tier;
+    _lock_threshold = parent._lock_threshold;
+}
+
+void rmp::store::set_numa_node(int node)
+{
+    _buckets.set_numa_node(node);
+}
+
+bool rmp::store::memory_tier() const
+{
+    return _memory_tier;
+}
+
+void rmp::store::open()
+{
+    _buckets.open();
+}
+
+void rmp::store::load(std::function<bool(const std::string& hash)> filter)
+{
+    if(_memory_tier)
+    {
+        // Every record is resident, reads never touch the bucket files
+        _buckets.scan(
+            [this](const std::string& hash, rmp::bucket& bucket)
+            {
+                for(const rmp::record& record : bucket.records())
+                {
+                    _records.insert(
+                        record.email(), 
+                        record.SerializeAsString());
+                }
+            },
+            filter);
+    }
+}
+
+bool rmp::store::migrating() const
+{
+    return _buckets.migrating();
+}
+
+bool rmp::store::migration_failed() const
+{
+    return _buckets.migration_failed();
+}
+
+bool rmp::store::create_record(rmp::record& record)
+{
+    std::string hash, serialized;
+    rmp::bucket * bucket;
+    bool exists;
+    std::unique_ptr<rmp::bucket> owner;
+    bucket = create_bucket(record.GetArena(), owner);
+    hash = djb_hash(record.email());
+    bucket_guard guard(*this, hash, "create", record.email(), _locking);
+    exists = _memory_tier && _records.find(record.email(), serialized);
+    if(!exists)
+    {
+        _buckets.load(hash, *bucket);
+        exists = (find_record(*bucket, record.email()) != -1);
+    }
+    if(!exists)
+    {
+        if(_memory_tier)
+        {
+            record.SerializeToString(&serialized);
+        }
+        // Same arena on both sides, so this is a pointer swap
+        bucket->add_records()->Swap(&record);
+        _buckets.store(hash, *bucket);
+        if(_memory_tier)
+        {
+            _records.insert(
+                bucket->records(bucket->records_size() - 1).email(), 
+                serialized);
+        }
+    }
+    return !exists;
+}
+
+bool rmp::store::read_record(const std::string& email, rmp::record& record)
+{
+    std::string hash, serialized;
+    rmp::bucket * bucket;
+    int index = -1;
+    std::unique_ptr<rmp::bucket> owner;
+    if(_memory_tier)
+    {
+        // Resident records are only kept serialized
+        index = _records.find(email, serialized) ? 0 : -1;
+        if(index != -1)
+        {
+            record.ParseFromString(serialized);
+        }
+    }
+    else
+    {
+        hash = djb_hash(email);
+        bucket_guard guard(*this, hash, "read", email, _locking);
+        bucket = create_bucket(record.GetArena(), owner);
+        _buckets.load(hash, *bucket);    
+        index = find_record(*bucket, email);
+        if(index != -1)
+        {
+            record.Swap(bucket->mutable_records(index));
+        }
+    }
+    return index != -1;
+}
+
+bool rmp::store::read_record(
+    const std::string& email, 
+    std::string& serialized,
+    google::protobuf::Arena * arena)
+{
+    std::string hash;
+    rmp::bucket * bucket;
+    int index;
+    bool found;
+    std::unique_ptr<rmp::bucket> owner;
+    if(_memory_tier)
+    {
+        // Served without the bucket lock, writers publish new versions
+        found = _records.find(email, serialized);
+    }
+    else
+    {
+        hash = djb_hash(email);
+        bucket_guard guard(*this, hash, "read", email, _locking);
+        bucket = create_bucket(arena, owner);
+        _buckets.load(hash, *bucket);    
+        index = find_record(*bucket, email);
+        found = (index != -1);
+        if(found)
+        {
+            bucket->records(index).SerializeToString(&serialized);
+        }
+    }
+    return found;
+}
+
+bool rmp::store::update_record(rmp::record& record)
+{
+    std::string hash, serialized;
+    rmp::bucket * bucket;
+    int index = -1;
+    std::unique_ptr<rmp::bucket> owner;
+    bucket = create_bucket(record.GetArena(), owner);
+    hash = djb_hash(record.email());
+    bucket_guard guard(*this, hash, "update", record.email(), _locking);
+    if(!_memory_tier || _records.find(record.email(), serialized))
+    {
+        _buckets.load(hash, *bucket);    
+        index = find_record(*bucket, record.email());
+    }
+    if(index != -1)
+    {
+        if(_memory_tier)
+        {
+            record.SerializeToString(&serialized);
+        }
+        bucket->mutable_records(index)->Swap(&record);
+        _buckets.store(hash, *bucket);
+        if(_memory_tier)
+        {
+            _records.update(bucket->records(index).email(), serialized);
+        }
+    }
+    return index != -1;
+}
+
+bool rmp::store::delete_record(const std::string& email)
+{
+    std::string hash, serialized;
+    rmp::bucket * bucket;
+    int index = -1;
+    std::unique_ptr<rmp::bucket> owner;
+    bucket = create_bucket(nullptr, owner);
+    hash = djb_hash(email);
+    bucket_guard guard(*this, hash, "delete", email, _locking);
+    if(!_memory_tier || _records.find(email, serialized))
+    {
+        _buckets.load(hash, *bucket);    
+        index = find_record(*bucket, email);
+    }
+    if(index != -1)
+    {
+        bucket->mutable_records()->DeleteSubrange(index, 1);
+        _buckets.store(hash, *bucket);
+        if(_memory_tier)
+        {
+            _records.erase(email);
+        }
+    }
+    return index != -1;
+}
+
+void rmp::store::execute(std::vector<rmp::store_operation>& batch)
+{
+    std::vector<std::pair<std::string,size_t>> order;
+    std::unique_ptr<rmp::bucket> owner;
+    rmp::bucket * bucket;
+    size_t first, last;
+    bool changed;
+    for(size_t index = 0; index < batch.size(); index++)
+    {
+        order.emplace_back(djb_hash(batch[index].data.email()), index);
+    }
+    // Operations on one bucket are applied in their batch order under a
+    // single lock, load and store
+    std::stable_sort(
+        order.begin(), 
+        order.end(), 
+        [](const std::pair<std::string,size_t>& left, 
+            const std::pair<std::string,size_t>& right)
+        {
+            return left.first < right.first;
+        });
+    for(first = 0; first < order.size(); first = last)
+    {
+        last = first;
+        while(last < order.size() && order[last].first == order[first].first)
+        {
+            last++;
+        }
+        bucket_guard guard(
+            *this, 
+            order[first].first, 
+            "execute", 
+            batch[order[first].second].data.email(), 
+            _locking);
+        bucket = create_bucket(nullptr, owner);
+        _buckets.load(order[first].first, *bucket);
+        changed = false;
+        for(size_t index = first; index < last; index++)
+        {
+            changed = apply(*bucket, batch[order[index].second]) || changed;
+        }
+        if(changed)
+        {
+            _buckets.store(order[first].first, *bucket);
+        }
+
+        // Resident copies follow once the bucket is on disk
+        for(size_t index = first; _memory_tier && index < last; index++)
+        {
+            rmp::store_operation& operation = batch[order[index].second];
+            switch(operation.succeeded ? operation.command : -1)
+            {
+            case rmp::command_codes::CREATE_RECORD:
+                _records.insert(
+                    operation.data.email(), 
+                    operation.data.SerializeAsString());
+                break;
+            case rmp::command_codes::UPDATE_RECORD:
+                _records.update(
+                    operation.data.email(), 
+                    operation.data.SerializeAsString());
+                break;
+            case rmp::command_codes::DELETE_RECORD:
+                _records.erase(operation.data.email());
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+size_t rmp::store::scan(std::function<void(
+    const std::string& email, 
+    const std::string& record)> callback)
+{
+    if(!_memory_tier)
+    {
+        throw std::runtime_error("Scans require the memory tier");
+    }
+    // Consistent as of the snapshot while writers keep going
+    rmp::record_table::snapshot snapshot(_records);
+    return _records.scan(snapshot, callback);
+}
+
+bool rmp::store::apply(rmp::bucket& bucket, rmp::store_operation& operation)
+{
+    int index = find_record(bucket, operation.data.email());
+    bool changed = false;
+    switch(operation.command)
+    {
+    case rmp::command_codes::CREATE_RECORD:
+        operation.succeeded = (index == -1);
+        if(operation.succeeded)
+        {
+            *bucket.add_records() = operation.data;
+        }
+        break;
+    case rmp::command_codes::READ_RECORD:
+        operation.succeeded = (index != -1);
+        if(operation.succeeded)
+        {
+            operation.data = bucket.records(index);
+        }
+        break;
+    case rmp::command_codes::UPDATE_RECORD:
+        operation.succeeded = (index != -1);
+        if(operation.succeeded)
+        {
+            *bucket.mutable_records(index) = operation.data;
+        }
+        break;
+    case rmp::command_codes::DELETE_RECORD:
+        operation.succeeded = (index != -1);
+        if(operation.succeeded)
+        {
+            bucket.mutable_records()->DeleteSubrange(index, 1);
+        }
+        break;
+    default:
+        operation.succeeded = false;
+        break;
+    }
+    changed = operation.succeeded 
+        && operation.command != rmp::command_codes::READ_RECORD;
+    return changed;
+}
+
+uint64_t rmp::store::aquire_lock(
+    const std::string& hash, 
+    const char * operation, 
+    const std::string& email)
+{
+    std::unique_lock<std::mutex> lock(
+        _thread_locks_mutex, std::defer_lock);
+    rmp::trace_phase phase(rmp::trace_phases::TRACE_LOCK_WAIT);
+    rmp::thread_statistics& statistics = rmp::statistics::local();
+    uint64_t start = uv_hrtime();
+    uint64_t acquired;
+    const char * holder = nullptr;
+    bool contended = false;
+    lock.lock();
+    // Aquire thread lock, the check and the insert are one step. Waiters
+    // sleep until a release, then try again
+    auto inserted = _thread_locks.emplace(hash, operation);
+    while(!inserted.second)
+    {
+        contended = true;
+        holder = inserted.first->second;
+        _thread_locks_released.wait(lock);
+        inserted = _thread_locks.emplace(hash, operation);
+    }
+    acquired = uv_hrtime();
+    if(contended)
+    {
+        _lock_profile.contended(hash, acquired - start);
+    }
+    lock.unlock();
+
+    RMP_PROBE(lock__acquire, hash.c_str(), acquired - start);
+    statistics.lock_wait.record(acquired - start);
+    if(contended)
+    {
+        rmp::statistics::add(statistics.lock_contentions, 1);
+    }
+    if(_lock_threshold > 0 && acquired - start >= _lock_threshold)
+    {
+        std::cerr << "Waited " << (acquired - start) / 1000000 
+                  << " ms for bucket " << hash << " to " << operation 
+                  << " " << email << ", last held by " << holder 
+                  << std::endl;
+    }
+    return acquired;
+}
+
+void rmp::store::release_lock(const std::string& hash, uint64_t acquired)
+{
+    std::unique_lock<std::mutex> lock(
+        _thread_locks_mutex, std::defer_lock);
+    uint64_t hold = uv_hrtime() - acquired;
+    lock.lock();
+    // Release thread lock
+    _thread_locks.erase(hash);
+    _lock_profile.held(hash, hold);
+    lock.unlock();
+    _thread_locks_released.notify_all();
+    RMP_PROBE(lock__release, hash.c_str(), hold);
+    rmp::statistics::local().lock_hold.record(hold);
+}
+
+std::string rmp::store::lock_report()
+{
+    std::lock_guard<std::mutex> lock(_thread_locks_mutex);
+    return _lock_profile.report();
+}
+
+rmp::store::bucket_guard::bucket_guard(
+    rmp::store& store, 
+    const std::string& hash,
+    const char * operation,
+    const std::string& email,
+    bool enabled) :
+    _store(store),
+    _hash(hash),
+    _enabled(enabled),
+    _acquired(0)
+{
+    if(_enabled)
+    {
+        _acquired = _store.aquire_lock(_hash, operation, email);
+    }
+}
+
+rmp::store::bucket_guard::~bucket_guard()
+{
+    if(_enabled)
+    {
+        _store.release_lock(_hash, _acquired);
+    }
+}
+
+int rmp::find_record(const rmp::bucket& bucket, const std::string& email)
+{
+    int result = -1;
+    int index = 0;
+    rmp::trace_phase phase(rmp::trace_phases::TRACE_FIND_RECORD);
+    while(index < bucket.records_size() && result == -1)
+    {
+        if(email == bucket.records(index).email())
+        {
+            result = index;
+        }
+        index++;
+    }
+    return result;
+}
+
+static rmp::bucket * create_bucket(
+    google::protobuf::Arena * arena,
+    std::unique_ptr<rmp::bucket>& owner)
+{
+    // Buckets share the arena of the record, or the heap without one
+    rmp::bucket * result = google::protobuf::Arena::CreateMessage<
+        rmp::bucket>(arena);
+    if(arena == nullptr)
+    {
+        owner.reset(result);
+    }
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,292 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+#include "record_manager.h"
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static void write_events(
+    std::ostream& output, 
+    const rmp::request_trace& trace, 
+    bool& first);
+
+static double calibrate();
+
+const char * PHASE_NAMES[] = {
+    "parse", "lock_wait", "load_bucket", "find_record", "store_bucket", 
+    "serialize", "write"};
+
+// Indexed by command code, anything past the end is a plain request
+const char * TRACE_COMMAND_NAMES[] = {
+    "create", "read", "update", "delete", "open_channel", "stats", "locks",
+    "export"};
+
+const uint64_t TRACE_FLUSH_MILLISECONDS = 100;
+
+const uint64_t CALIBRATION_MILLISECONDS = 20;
+
+std::atomic<size_t> rmp::tracer::_sample(0);
+thread_local rmp::request_trace * rmp::tracer::_active = nullptr;
+
+static std::mutex trace_mutex;
+static std::condition_variable trace_signal;
+static std::vector<rmp::request_trace*> trace_queue;
+static std::thread trace_writer;
+static std::ofstream trace_output;
+static bool trace_running = false;
+static uint64_t trace_origin = 0;
+static std::atomic<uint32_t> trace_threads(0);
+static thread_local uint32_t trace_thread = 0;
+static thread_local size_t trace_countdown = 0;
+
+void rmp::tracer::enable(const std::string& path, size_t sample)
+{
+    disable();
+    trace_output.open(path, std::ios::out | std::ios::trunc);
+    if(!trace_output)
+    {
+        throw std::runtime_error("Failed to open trace file " + path);
+    }
+
+    ticks_per_microsecond();
+    trace_origin = now();
+    trace_output << "[";
+    trace_running = true;
+    trace_writer = std::thread(write);
+    _sample.store(std::max<size_t>(sample, 1), std::memory_order_relaxed);
+}
+
+void rmp::tracer::disable()
+{
+    _sample.store(0, std::memory_order_relaxed);
+    if(trace_writer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            trace_running = false;
+        }
+        trace_signal.notify_one();
+        trace_writer.join();
+        trace_output << "]" << std::endl;
+        trace_output.close();
+    }
+}
+
+uint64_t rmp::tracer::now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return uv_hrtime();
+#endif
+}
+
+double rmp::tracer::ticks_per_microsecond()
+{
+    static double ticks = calibrate();
+    return ticks;
+}
+
+const char * rmp::tracer::phase_name(rmp::trace_phases phase)
+{
+    return PHASE_NAMES[phase];
+}
+
+const char * rmp::tracer::command_name(int command)
+{
+    const int commands = static_cast<int>(
+        sizeof(TRACE_COMMAND_NAMES) / sizeof(TRACE_COMMAND_NAMES[0]));
+    return (command >= 0 && command < commands) 
+        ? TRACE_COMMAND_NAMES[command] : "request";
+}
+
+rmp::request_trace * rmp::tracer::sample()
+{
+    // Count down per thread so sampling never touches shared state
+    if(trace_countdown == 0)
+    {
+        trace_countdown = _sample.load(std::memory_order_relaxed);
+        if(trace_thread == 0)
+        {
+            trace_thread = ++trace_threads;
+        }
+
+        _active = new rmp::request_trace();
+        _active->begin = now();
+        _active->thread = trace_thread;
+    }
+
+    trace_countdown--;
+    return _active;
+}
+
+rmp::request_trace * rmp::tracer::detach()
+{
+    rmp::request_trace * trace = _active;
+    _active = nullptr;
+    return trace;
+}
+
+void rmp::tracer::attach(rmp::request_trace * trace)
+{
+    _active = trace;
+}
+
+void rmp::tracer::record(
+    rmp::request_trace * trace, 
+    rmp::trace_phases phase, 
+    uint64_t begin, 
+    uint64_t end)
+{
+    if(trace != nullptr)
+    {
+        if(trace_thread == 0)
+        {
+            trace_thread = ++trace_threads;
+        }
+
+        trace->events.push_back({phase, begin, end, trace_thread});
+    }
+}
+
+void rmp::tracer::end(rmp::request_trace * trace)
+{
+    if(trace != nullptr)
+    {
+        if(trace == _active)
+        {
+            _active = nullptr;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            trace_queue.push_back(trace);
+        }
+    }
+}
+
+void rmp::tracer::write()
+{
+    std::vector<rmp::request_trace*> traces;
+    bool running = true;
+    bool first = true;
+    while(running)
+    {
+        {
+            std::unique_lock<std::mutex> lock(trace_mutex);
+            trace_signal.wait_for(
+                lock, 
+                std::chrono::milliseconds(TRACE_FLUSH_MILLISECONDS), 
+                []{ return !trace_running; });
+            running = trace_running;
+            traces.swap(trace_queue);
+        }
+
+        for(rmp::request_trace * trace : traces)
+        {
+            write_events(trace_output, *trace, first);
+            delete trace;
+        }
+
+        traces.clear();
+        trace_output.flush();
+    }
+}
+
+rmp::trace_phase::trace_phase(rmp::trace_phases phase) :
+    _trace(rmp::tracer::active()),
+    _phase(phase),
+    _begin((_trace == nullptr && !rmp::slow_log::recording()) 
+        ? 0 : rmp::tracer::now())
+{
+}
+
+rmp::trace_phase::~trace_phase()
+{
+    uint64_t end;
+    if(_begin != 0)
+    {
+        end = rmp::tracer::now();
+        rmp::tracer::record(_trace, _phase, _begin, end);
+        rmp::slow_log::phase(_phase, end - _begin);
+    }
+}
+
+static void write_events(
+    std::ostream& output, 
+    const rmp::request_trace& trace, 
+    bool& first)
+{
+    // Chrome trace events use microseconds from an arbitrary origin
+    auto microseconds = [](uint64_t ticks)
+    {
+        return ((double)ticks - (double)trace_origin) 
+            / rmp::tracer::ticks_per_microsecond();
+    };
+    uint64_t end = trace.begin;
+    for(const rmp::trace_event& event : trace.events)
+    {
+        end = std::max(end, event.end);
+    }
+
+    output << std::fixed << std::setprecision(3) << (first ? "\n" : ",\n") 
+        << "{\"name\":\"" 
+        << rmp::tracer::command_name(trace.command)
+        << "\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":" 
+        << microseconds(trace.begin) 
+        << ",\"dur\":" << (double)(end - trace.begin) 
+            / rmp::tracer::ticks_per_microsecond()
+        << ",\"pid\":1,\"tid\":" << trace.thread << "}";
+    first = false;
+    for(const rmp::trace_event& event : trace.events)
+    {
+        output << ",\n{\"name\":\"" << rmp::tracer::phase_name(event.phase) 
+            << "\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":" 
+            << microseconds(event.begin) 
+            << ",\"dur\":" 
+            << (double)(event.end - event.begin) 
+                / rmp::tracer::ticks_per_microsecond()
+            << ",\"pid\":1,\"tid\":" << event.thread << "}";
+    }
+}
+
+static double calibrate()
+{
+    std::chrono::steady_clock::time_point clock_begin;
+    std::chrono::steady_clock::time_point clock_end;
+    uint64_t tick_begin;
+    uint64_t tick_end;
+    // The TSC rate is not reported anywhere portable, measure it
+    clock_begin = std::chrono::steady_clock::now();
+    tick_begin = rmp::tracer::now();
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(CALIBRATION_MILLISECONDS));
+    clock_end = std::chrono::steady_clock::now();
+    tick_end = rmp::tracer::now();
+    return (double)(tick_end - tick_begin) 
+        / (double)std::chrono::duration_cast<std::chrono::microseconds>(
+            clock_end - clock_begin).count();
+}
\ No newline at end of file
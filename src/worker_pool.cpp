@@ -0,0 +1,159 @@
+/********************************************************************
+ * Copyright (c) 2021 John R. Patek
+ * 
+ * This software is provided 'as-is', without any express or implied 
+ * warranty. In no event will the authors be held liable for any 
+ * damages arising from the use of this software.
+ * 
+ * Permission is granted to anyone to use this software for any 
+ * purpose, including commercial applications, and to alter it and 
+ * redistribute it freely, subject to the following restrictions:
+ * 
+ *    1. The origin of this software must not be misrepresented; you 
+ *       must not claim that you wrote the original software. If you 
+ *       use this software in a product, an acknowledgment in the 
+ *       product documentation would be appreciated but is not 
+ *       required.
+ *    
+ *    2. Altered source versions must be plainly marked as such, and 
+ *       must not be misrepresented as being the original software.
+ *    
+ *    3. This notice may not be removed or altered from any source 
+ *       distribution.
+ * 
+ *******************************************************************/
+
+#include "record_manager.h"
+#include <sys/eventfd.h>
+
+// Jobs a worker takes off the queue at once
+const size_t WORKER_BATCH = 32;
+
+rmp::worker_pool::worker_pool(size_t capacity) :
+    _queue(capacity),
+    _event(-1),
+    _running(false),
+    _sleeping(0),
+    _stalls(0),
+    _parks(0)
+{
+
+}
+
+rmp::worker_pool::~worker_pool()
+{
+    stop();
+}
+
+void rmp::worker_pool::start(
+    size_t threads, 
+    handler callback, 
+    initializer initialize)
+{
+    _event = eventfd(0, EFD_SEMAPHORE);
+    if(_event < 0)
+    {
+        throw std::runtime_error("Failed to create worker event");
+    }
+    _handler = callback;
+    _initialize = initialize;
+    _running = true;
+    for(size_t worker = 0; worker < threads; worker++)
+    {
+        _threads.emplace_back(&rmp::worker_pool::run, this, worker);
+    }
+}
+
+bool rmp::worker_pool::submit(void * job)
+{
+    bool result = _queue.push(job);
+    if(!result)
+    {
+        _stalls++;
+    }
+    else
+    {
+        // Pairs with the fence in run: the push is visible before the
+        // sleeper count is read, so a parking worker cannot be missed
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(_sleeping.load() > 0)
+        {
+            wake(1);
+        }
+    }
+    return result;
+}
+
+void rmp::worker_pool::stop()
+{
+    if(_running.exchange(false))
+    {
+        wake(_threads.size());
+        for(std::thread& thread : _threads)
+        {
+            thread.join();
+        }
+        _threads.clear();
+        close(_event);
+        _event = -1;
+    }
+}
+
+size_t rmp::worker_pool::size() const
+{
+    return _threads.size();
+}
+
+rmp::queue_metrics rmp::worker_pool::metrics() const
+{
+    rmp::queue_metrics result;
+    result.depth = _queue.size();
+    result.enqueued = _queue.pushed();
+    result.stalls = _stalls.load();
+    result.parks = _parks.load();
+    return result;
+}
+
+void rmp::worker_pool::run(size_t worker)
+{
+    void * jobs[WORKER_BATCH];
+    size_t count;
+    uint64_t value;
+    if(_initialize)
+    {
+        _initialize(worker);
+    }
+    while(_running)
+    {
+        count = _queue.pop(jobs, WORKER_BATCH);
+        if(count == 0)
+        {
+            // Announce the sleep before the last look at the queue, a
+            // producer either sees the sleeper or its job is seen here
+            _sleeping++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            count = _queue.pop(jobs, WORKER_BATCH);
+            if(count == 0 && _running)
+            {
+                _parks++;
+                while(read(_event, &value, sizeof(value)) < 0 
+                    && errno == EINTR);
+            }
+            _sleeping--;
+        }
+
+        if(count > 0)
+        {
+            _handler(worker, jobs, count);
+        }
+    }
+}
+
+void rmp::worker_pool::wake(size_t count)
+{
+    uint64_t value = count;
+    if(count > 0 && write(_event, &value, sizeof(value)) < 0)
+    {
+        throw std::runtime_error("Failed to wake workers");
+    }
+}
\ No newline at end of file
@@ -86,4 +86,1141 @@ TEST_F(rmp_test,delete_test)
         bad);
 
     EXPECT_FALSE(result.first);
+}
+
+TEST(arena_test,steady_state_test)
+{
+    rmp::request_arena arena(1024);
+    rmp::request * request;
+    rmp::bucket * bucket;
+    rmp::record * record;
+    size_t allocations;
+    
+    for(int iteration = 0; iteration < 8; iteration++)
+    {
+        request = google::protobuf::Arena::CreateMessage<rmp::request>(
+            arena.get());
+        bucket = google::protobuf::Arena::CreateMessage<rmp::bucket>(
+            arena.get());
+        for(int index = 0; index < 256; index++)
+        {
+            record = bucket->add_records();
+            record->set_email(std::to_string(index));
+            record->mutable_contact()->set_name("John");
+        }
+        bucket->add_records()->Swap(request->mutable_payload());
+        allocations = arena.allocations();
+        arena.reset();
+    }
+
+    // The arena grows once and then serves every request from one block
+    EXPECT_EQ(allocations,0);
+    EXPECT_GT(arena.initial_size(),1024);
+}
+
+TEST(record_table_test,insert_find_erase_test)
+{
+    rmp::record_table table;
+    std::string email, record;
+
+    // Enough entries to rehash, half of them with keys stored externally
+    for(int index = 0; index < 1000; index++)
+    {
+        email = std::to_string(index) 
+            + ((index % 2) ? "@example.com" : "@a-much-longer-domain.example.com");
+        EXPECT_TRUE(table.insert(email, std::to_string(index)));
+        EXPECT_FALSE(table.insert(email, std::to_string(index)));
+    }
+    EXPECT_EQ(table.size(),1000);
+
+    EXPECT_TRUE(table.find("7@example.com",record));
+    EXPECT_EQ(record,"7");
+    EXPECT_TRUE(table.update("7@example.com","seven"));
+    EXPECT_TRUE(table.find("7@example.com",record));
+    EXPECT_EQ(record,"seven");
+
+    EXPECT_TRUE(table.erase("7@example.com"));
+    EXPECT_FALSE(table.erase("7@example.com"));
+    EXPECT_FALSE(table.find("7@example.com",record));
+    EXPECT_FALSE(table.update("7@example.com","seven"));
+    EXPECT_EQ(table.size(),999);
+}
+
+TEST(record_table_test,snapshot_test)
+{
+    rmp::record_table table;
+    std::string record;
+    std::vector<std::string> emails;
+
+    table.insert("a@example.com","a1");
+    table.insert("b@example.com","b1");
+    {
+        rmp::record_table::snapshot snapshot(table);
+        EXPECT_EQ(table.snapshots(),1);
+
+        // Writes after the snapshot stay invisible to it
+        table.update("a@example.com","a2");
+        table.erase("b@example.com");
+        table.insert("c@example.com","c1");
+
+        EXPECT_TRUE(table.find("a@example.com",record,snapshot));
+        EXPECT_EQ(record,"a1");
+        EXPECT_TRUE(table.find("b@example.com",record,snapshot));
+        EXPECT_EQ(record,"b1");
+        EXPECT_FALSE(table.find("c@example.com",record,snapshot));
+        EXPECT_FALSE(table.find("b@example.com",record));
+
+        // A revived record does not leak into the snapshot either
+        EXPECT_TRUE(table.insert("b@example.com","b2"));
+        EXPECT_TRUE(table.find("b@example.com",record,snapshot));
+        EXPECT_EQ(record,"b1");
+
+        EXPECT_EQ(table.scan(snapshot,[&](
+            const std::string& email, 
+            const std::string& data)
+        {
+            emails.push_back(email);
+        }),2);
+    }
+    EXPECT_EQ(table.snapshots(),0);
+    EXPECT_EQ(emails.size(),2);
+    EXPECT_TRUE(table.find("a@example.com",record));
+    EXPECT_EQ(record,"a2");
+    EXPECT_EQ(table.size(),3);
+}
+
+TEST(record_table_test,concurrent_update_test)
+{
+    rmp::record_table table;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop(false);
+    std::atomic<int> torn(0);
+    uint64_t settled, epoch;
+
+    for(int key = 0; key < 16; key++)
+    {
+        table.insert(std::to_string(key) + "@example.com","k" 
+            + std::to_string(key) + "-0");
+    }
+    // Whatever earlier tests left queued must not count against this one
+    for(int attempt = 0; attempt < 4; attempt++)
+    {
+        rmp::epoch::collect();
+    }
+    settled = rmp::statistics::memory(rmp::memory_subsystems::MEMORY_INDEX);
+    epoch = rmp::epoch::current();
+
+    for(int reader = 0; reader < 4; reader++)
+    {
+        threads.emplace_back([&]()
+        {
+            std::string record, prefix;
+            for(int index = 0; !stop.load(); index++)
+            {
+                prefix = "k" + std::to_string(index % 16) + "-";
+                if(!table.find(
+                    std::to_string(index % 16) + "@example.com",
+                    record) 
+                    || record.compare(0,prefix.size(),prefix) != 0)
+                {
+                    torn++;
+                }
+            }
+        });
+    }
+    // Each writer owns half of the keys, every update retires a version
+    for(int writer = 0; writer < 2; writer++)
+    {
+        threads.emplace_back([&,writer]()
+        {
+            int key;
+            for(int index = 0; index < 20000; index++)
+            {
+                key = writer * 8 + index % 8;
+                table.update(std::to_string(key) + "@example.com","k" 
+                    + std::to_string(key) + "-" + std::to_string(index % 10));
+            }
+        });
+    }
+    threads[4].join();
+    threads[5].join();
+    stop.store(true);
+    for(int reader = 0; reader < 4; reader++)
+    {
+        threads[reader].join();
+    }
+    EXPECT_EQ(torn.load(),0);
+    EXPECT_GT(rmp::epoch::current(),epoch);
+
+    // With the readers gone every retired version is freed, leaving the
+    // same memory the table held before the updates
+    for(int attempt = 0; attempt < 4; attempt++)
+    {
+        rmp::epoch::collect();
+    }
+    EXPECT_EQ(
+        rmp::statistics::memory(rmp::memory_subsystems::MEMORY_INDEX),
+        settled);
+}
+
+TEST(spsc_queue_test,order_test)
+{
+    rmp::spsc_queue<int> queue(4);
+    int value, expected = 0;
+    std::thread producer([&]()
+    {
+        for(int index = 0; index < 10000; index++)
+        {
+            while(!queue.push(index))
+            {
+                std::this_thread::yield();
+            }
+        }
+    });
+    while(expected < 10000)
+    {
+        if(queue.pop(value))
+        {
+            EXPECT_EQ(value,expected);
+            expected++;
+        }
+    }
+    producer.join();
+    EXPECT_FALSE(queue.pop(value));
+}
+
+TEST(mpmc_queue_test,batch_test)
+{
+    rmp::mpmc_queue<int> queue(64);
+    std::atomic<long> total(0);
+    std::atomic<int> received(0);
+    std::vector<std::thread> threads;
+    for(int producer = 0; producer < 2; producer++)
+    {
+        threads.emplace_back([&]()
+        {
+            for(int value = 1; value <= 5000; value++)
+            {
+                while(!queue.push(value))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for(int consumer = 0; consumer < 2; consumer++)
+    {
+        threads.emplace_back([&]()
+        {
+            int values[8];
+            size_t count;
+            while(received < 10000)
+            {
+                count = queue.pop(values, 8);
+                for(size_t index = 0; index < count; index++)
+                {
+                    total += values[index];
+                }
+                received += count;
+            }
+        });
+    }
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    EXPECT_EQ(total.load(),2 * 5000L * 5001 / 2);
+    EXPECT_EQ(queue.size(),0);
+    EXPECT_EQ(queue.pushed(),10000);
+}
+
+TEST(worker_pool_test,submit_test)
+{
+    rmp::worker_pool pool(16);
+    std::atomic<int> handled(0);
+    int job;
+    pool.start(3, [&](size_t worker, void ** jobs, size_t count)
+    {
+        handled += count;
+    });
+    for(int index = 0; index < 1000; index++)
+    {
+        while(!pool.submit(&job))
+        {
+            std::this_thread::yield();
+        }
+    }
+    while(handled < 1000)
+    {
+        std::this_thread::yield();
+    }
+    pool.stop();
+    EXPECT_EQ(pool.metrics().enqueued,1000);
+    EXPECT_EQ(pool.metrics().depth,0);
+}
+
+TEST(worker_pool_test,idle_wakeup_test)
+{
+    rmp::worker_pool pool(16);
+    std::atomic<int> handled(0);
+    std::chrono::steady_clock::time_point deadline;
+    int job;
+    bool woken = true;
+    pool.start(2, [&](size_t worker, void ** jobs, size_t count)
+    {
+        handled += count;
+    });
+    // One job at a time into an idle pool, a lost wakeup leaves it queued
+    for(int index = 0; index < 20000 && woken; index++)
+    {
+        ASSERT_TRUE(pool.submit(&job));
+        deadline = std::chrono::steady_clock::now() 
+            + std::chrono::seconds(1);
+        while(handled <= index && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::yield();
+        }
+        woken = (handled > index);
+    }
+    EXPECT_TRUE(woken);
+    pool.stop();
+}
+
+TEST(numa_test,parse_cpus_test)
+{
+    std::vector<int> cpus = rmp::numa::parse_cpus("0-2,8");
+    EXPECT_EQ(cpus,std::vector<int>({0,1,2,8}));
+    EXPECT_THROW(rmp::numa::parse_cpus("3-1"),std::invalid_argument);
+}
+
+TEST(client_test,unix_address_test)
+{
+    rmp::client client;
+    std::pair<bool,std::string> result;
+    EXPECT_THROW(
+        client.set_address("unix:" + std::string(200,'a'),0),
+        std::runtime_error);
+
+    // Nothing listens on this path, so the request fails to connect
+    client.set_address("unix:/nonexistent/rmp.sock",0);
+    result = client.read_record("nobody@example.com");
+    EXPECT_FALSE(result.first);
+    EXPECT_EQ(result.second,"Failed to connect socket");
+}
+
+TEST(shm_channel_test,round_trip_test)
+{
+    rmp::shm_channel server;
+    rmp::shm_channel client(dup(server.descriptor()));
+    std::string message;
+    const char * reply;
+    char * frame;
+    size_t length;
+    // Enough frames of uneven size to wrap the ring several times
+    std::thread responder([&server]()
+    {
+        const char * data;
+        char * frame;
+        size_t size;
+        for(int index = 0; index < 2000; index++)
+        {
+            data = nullptr;
+            while(data == nullptr)
+            {
+                data = server.receive(rmp::REQUEST_RING,size,100);
+            }
+            std::string request(data,size);
+            server.release(rmp::REQUEST_RING);
+            frame = server.reserve(rmp::RESPONSE_RING,request.size());
+            ASSERT_NE(frame,nullptr);
+            memcpy(frame,request.data(),request.size());
+            server.commit(rmp::RESPONSE_RING,request.size());
+        }
+    });
+    for(int index = 0; index < 2000; index++)
+    {
+        message.assign(1 + (index * 37) % 1000,'a' + index % 26);
+        frame = client.reserve(rmp::REQUEST_RING,message.size());
+        ASSERT_NE(frame,nullptr);
+        memcpy(frame,message.data(),message.size());
+        client.commit(rmp::REQUEST_RING,message.size());
+        reply = nullptr;
+        while(reply == nullptr)
+        {
+            reply = client.receive(rmp::RESPONSE_RING,length,100);
+        }
+        EXPECT_EQ(std::string(reply,length),message);
+        client.release(rmp::RESPONSE_RING);
+    }
+    responder.join();
+    EXPECT_EQ(client.reserve(rmp::REQUEST_RING,1024 * 1024),nullptr);
+    client.close();
+    EXPECT_TRUE(server.closed());
+}
+
+TEST(shm_channel_test,corrupt_length_test)
+{
+    const uint32_t lengths[] = {0x7ffffff0u,64};
+    size_t size = 0;
+    for(uint32_t length : lengths)
+    {
+        rmp::shm_channel server;
+        rmp::shm_channel client(dup(server.descriptor()));
+        char * frame = client.reserve(rmp::REQUEST_RING,16);
+        ASSERT_NE(frame,nullptr);
+        client.commit(rmp::REQUEST_RING,16);
+        // Past the end of the ring, then past the committed tail
+        memcpy(frame - sizeof(length),&length,sizeof(length));
+        EXPECT_EQ(server.receive(rmp::REQUEST_RING,size,10),nullptr);
+        EXPECT_TRUE(server.closed());
+        EXPECT_TRUE(client.closed());
+    }
+}
+
+TEST(store_test,batch_test)
+{
+    char directory[] = "/tmp/rmp-store-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    rmp::store store(directory);
+    rmp::record record;
+    std::vector<rmp::store_operation> batch(5);
+    store.set_memory_tier(true);
+    store.open();
+    store.load();
+
+    record.set_email("first@example.com");
+    record.mutable_contact()->set_name("First");
+    EXPECT_TRUE(store.create_record(record));
+    record.set_email("first@example.com");
+    EXPECT_FALSE(store.create_record(record));
+
+    // Operations on the same record keep their batch order
+    batch[0].command = rmp::command_codes::CREATE_RECORD;
+    batch[0].data.set_email("second@example.com");
+    batch[1].command = rmp::command_codes::UPDATE_RECORD;
+    batch[1].data.set_email("first@example.com");
+    batch[1].data.mutable_contact()->set_name("Updated");
+    batch[2].command = rmp::command_codes::READ_RECORD;
+    batch[2].data.set_email("first@example.com");
+    batch[3].command = rmp::command_codes::DELETE_RECORD;
+    batch[3].data.set_email("first@example.com");
+    batch[4].command = rmp::command_codes::READ_RECORD;
+    batch[4].data.set_email("first@example.com");
+    store.execute(batch);
+    EXPECT_TRUE(batch[0].succeeded);
+    EXPECT_TRUE(batch[1].succeeded);
+    EXPECT_TRUE(batch[2].succeeded);
+    EXPECT_EQ(batch[2].data.contact().name(),"Updated");
+    EXPECT_TRUE(batch[3].succeeded);
+    EXPECT_FALSE(batch[4].succeeded);
+
+    EXPECT_FALSE(store.read_record("first@example.com",record));
+    EXPECT_TRUE(store.read_record("second@example.com",record));
+    EXPECT_EQ(record.email(),"second@example.com");
+    EXPECT_TRUE(store.delete_record("second@example.com"));
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(page_cache_test,eviction_test)
+{
+    rmp::aligned_allocator allocator;
+    rmp::page_cache cache(3 * 4096);
+    for(const char * hash : {"a", "b", "c"})
+    {
+        cache.insert(hash,std::make_shared<rmp::aligned_buffer>(allocator,1));
+    }
+    EXPECT_EQ(cache.size(),3u * 4096);
+
+    // A hit moves the bucket to the front, so the next insert evicts b
+    EXPECT_NE(cache.find("a"),nullptr);
+    cache.insert("d",std::make_shared<rmp::aligned_buffer>(allocator,1));
+    EXPECT_EQ(cache.find("b"),nullptr);
+    EXPECT_NE(cache.find("a"),nullptr);
+    EXPECT_NE(cache.find("c"),nullptr);
+    EXPECT_NE(cache.find("d"),nullptr);
+    EXPECT_EQ(cache.size(),3u * 4096);
+    EXPECT_EQ(cache.hits(),4u);
+    EXPECT_EQ(cache.misses(),1u);
+
+    // Buffers larger than the whole cache are not kept, replacing one
+    // drops the old copy
+    cache.insert("e",std::make_shared<rmp::aligned_buffer>(allocator,4 << 12));
+    EXPECT_EQ(cache.find("e"),nullptr);
+    cache.insert("a",std::make_shared<rmp::aligned_buffer>(allocator,2 << 12));
+    EXPECT_EQ(cache.size(),3u * 4096);
+    EXPECT_EQ(cache.find("c"),nullptr);
+    EXPECT_EQ(cache.find("a")->capacity(),2u << 12);
+
+    cache.set_capacity(4096);
+    EXPECT_EQ(cache.size(),0u);
+    cache.insert("f",std::make_shared<rmp::aligned_buffer>(allocator,1));
+    EXPECT_EQ(cache.size(),4096u);
+}
+
+TEST(page_cache_test,direct_io_test)
+{
+    char directory[] = "/tmp/rmp-direct-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    rmp::aligned_allocator allocator(4096);
+    rmp::bucket_store store;
+    rmp::bucket bucket, loaded;
+    struct stat status;
+    std::string hash = rmp::djb_hash("direct@example.com");
+    void * block;
+    {
+        // O_DIRECT needs the address and length aligned to the block
+        rmp::aligned_buffer small(allocator,100), large(allocator,5000);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(small.data()) % 4096,0u);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(large.data()) % 4096,0u);
+        EXPECT_EQ(small.capacity(),4096u);
+        EXPECT_EQ(large.capacity(),8192u);
+        EXPECT_EQ(allocator.allocated(),3u * 4096);
+        EXPECT_THROW(small.resize(4097),std::length_error);
+        block = small.data();
+    }
+    // Freed blocks are kept for the next buffer of the same size
+    EXPECT_EQ(allocator.allocated(),0u);
+    EXPECT_EQ(rmp::aligned_buffer(allocator,4096).data(),block);
+
+    store.set_root_directory(directory);
+    store.set_io_mode(rmp::io_modes::DIRECT_IO);
+    try
+    {
+        store.open();
+    }
+    catch(const std::runtime_error& e)
+    {
+        EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+        GTEST_SKIP() << e.what();
+    }
+    for(int index = 0; index < 100; index++)
+    {
+        bucket.add_records()->set_email(
+            "user" + std::to_string(index) + "@example.com");
+    }
+    store.store(hash,bucket);
+    // The write is padded to whole blocks and then truncated
+    ASSERT_EQ(stat((std::string(directory) + "/" + hash).c_str(),&status),0);
+    EXPECT_EQ(static_cast<size_t>(status.st_size),bucket.ByteSizeLong());
+    store.cache().erase(hash);
+    store.load(hash,loaded);
+    EXPECT_EQ(loaded.records_size(),100);
+    EXPECT_EQ(loaded.records(99).email(),"user99@example.com");
+    EXPECT_NE(store.cache().find(hash),nullptr);
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(descriptor_cache_test,evict_in_use_test)
+{
+    char directory[] = "/tmp/rmp-descriptors-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    std::shared_ptr<rmp::file_descriptor> held, reopened;
+    char data[5] = {};
+    int fd;
+    for(bool use_openat : {false, true})
+    {
+        rmp::descriptor_cache cache(2);
+        cache.open(directory,O_RDWR,use_openat);
+        EXPECT_EQ(cache.acquire("missing","missing",false),nullptr);
+        held = cache.acquire("a","a",true);
+        ASSERT_NE(held,nullptr);
+        fd = held->get();
+        cache.acquire("b","b",true);
+        cache.acquire("c","c",true);
+        EXPECT_EQ(cache.size(),2u);
+
+        // An evicted descriptor stays open for the request holding it
+        EXPECT_EQ(pwrite(fd,"data",4,0),4);
+        reopened = cache.acquire("a","a",false);
+        ASSERT_NE(reopened,nullptr);
+        EXPECT_NE(reopened->get(),fd);
+        EXPECT_EQ(pread(reopened->get(),data,4,0),4);
+        EXPECT_STREQ(data,"data");
+
+        // and is closed once that request lets go of it
+        held.reset();
+        EXPECT_EQ(fcntl(fd,F_GETFD),-1);
+        EXPECT_EQ(errno,EBADF);
+        EXPECT_EQ(cache.acquire("a","a",false),reopened);
+        reopened.reset();
+    }
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(bucket_layout_test,parse_path_test)
+{
+    rmp::bucket_layout flat = rmp::bucket_layout::parse("flat");
+    rmp::bucket_layout nested = rmp::bucket_layout::parse("2x2");
+    EXPECT_TRUE(flat.flat());
+    EXPECT_EQ(flat.name(),"flat");
+    EXPECT_EQ(flat.path("1a2b3c"),"1a2b3c");
+    EXPECT_FALSE(nested.flat());
+    EXPECT_EQ(nested.name(),"2x2");
+    // Short hashes are padded to 8 digits before they fan out
+    EXPECT_EQ(nested.path("1a2b3c"),"00/1a/1a2b3c");
+    EXPECT_EQ(nested.path("deadbeef"),"de/ad/deadbeef");
+
+    EXPECT_THROW(rmp::bucket_layout::parse("2"),std::invalid_argument);
+    EXPECT_THROW(rmp::bucket_layout::parse("3x3"),std::invalid_argument);
+    EXPECT_THROW(rmp::bucket_layout::parse("1x0"),std::invalid_argument);
+    EXPECT_TRUE(rmp::bucket_layout::is_bucket_name("1a2b3c"));
+    EXPECT_FALSE(rmp::bucket_layout::is_bucket_name("1A2B3C"));
+    EXPECT_FALSE(rmp::bucket_layout::is_bucket_name(".layout"));
+    EXPECT_FALSE(rmp::bucket_layout::is_bucket_name("123456789"));
+}
+
+TEST(layout_migrator_test,concurrent_test)
+{
+    char directory[] = "/tmp/rmp-layout-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    rmp::bucket_layout layout = rmp::bucket_layout::parse("2x1");
+    std::vector<std::string> emails, hashes;
+    std::vector<std::thread> threads;
+    std::vector<int> rounds(2);
+    std::atomic<int> wrong(0);
+    rmp::bucket bucket;
+    {
+        rmp::bucket_store flat;
+        flat.set_root_directory(directory);
+        flat.open();
+        for(int index = 0; index < 2000; index++)
+        {
+            emails.push_back("user" + std::to_string(index) + "@example.com");
+            hashes.push_back(rmp::djb_hash(emails.back()));
+            bucket.clear_records();
+            bucket.add_records()->set_email(emails.back());
+            flat.store(hashes.back(),bucket);
+        }
+    }
+
+    rmp::bucket_store store;
+    store.set_root_directory(directory);
+    store.set_layout(layout);
+    store.set_migration_threads(2);
+    store.open();
+    // Requests keep loading and storing buckets while they are moved
+    for(int thread = 0; thread < 2; thread++)
+    {
+        threads.emplace_back([&,thread]()
+        {
+            rmp::bucket loaded;
+            int round = 0;
+            for(; round < 3 || (store.migrating() && round < 100); round++)
+            {
+                for(size_t index = thread; index < hashes.size(); index += 2)
+                {
+                    store.load(hashes[index],loaded);
+                    if(loaded.records_size() != 1 
+                        || loaded.records(0).email() != emails[index])
+                    {
+                        wrong++;
+                    }
+                    loaded.mutable_records(0)->mutable_contact()->set_name(
+                        std::to_string(round));
+                    store.store(hashes[index],loaded);
+                }
+            }
+            rounds[thread] = round - 1;
+        });
+    }
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    for(int wait = 0; wait < 100 && store.migrating(); wait++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_FALSE(store.migrating());
+    EXPECT_EQ(wrong.load(),0);
+
+    // Every bucket ends up at its fan-out path with its last write
+    for(size_t index = 0; index < hashes.size(); index++)
+    {
+        store.load(hashes[index],bucket);
+        ASSERT_EQ(bucket.records_size(),1);
+        EXPECT_EQ(
+            bucket.records(0).contact().name(),
+            std::to_string(rounds[index % 2]));
+        EXPECT_TRUE(std::ifstream(
+            std::string(directory) + "/" + layout.path(hashes[index])).good());
+        EXPECT_FALSE(std::ifstream(
+            std::string(directory) + "/" + hashes[index]).good());
+    }
+    EXPECT_EQ(rmp::bucket_layout::load(directory).name(),"2x1");
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(store_test,contended_lock_test)
+{
+    char directory[] = "/tmp/rmp-store-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    rmp::store store(directory);
+    rmp::record record;
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> slowest(2,0);
+    std::atomic<int> ready(0);
+    store.open();
+    store.load();
+    record.set_email("shared@example.com");
+    EXPECT_TRUE(store.create_record(record));
+
+    // Both threads keep updating one bucket, a waiter wakes on release
+    for(int thread = 0; thread < 2; thread++)
+    {
+        threads.emplace_back([&,thread]()
+        {
+            rmp::record update;
+            uint64_t start;
+            ready++;
+            while(ready.load() < 2);
+            for(int index = 0; index < 2000; index++)
+            {
+                update.set_email("shared@example.com");
+                update.mutable_contact()->set_name(std::to_string(index));
+                start = uv_hrtime();
+                store.update_record(update);
+                slowest[thread] = std::max(slowest[thread],uv_hrtime() - start);
+            }
+        });
+    }
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    EXPECT_NE(store.lock_report().find("contentions="),std::string::npos);
+    EXPECT_LT(std::max(slowest[0],slowest[1]),20000000u);
+    EXPECT_TRUE(store.read_record("shared@example.com",record));
+    EXPECT_EQ(record.contact().name(),"1999");
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(layout_migrator_test,blocked_directory_test)
+{
+    char directory[] = "/tmp/rmp-layout-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    rmp::bucket_layout layout = rmp::bucket_layout::parse("2x1");
+    std::vector<std::string> hashes = {"1", "1a2b3c4d", "1abcdef0"};
+    rmp::bucket bucket;
+    {
+        rmp::bucket_store flat;
+        flat.set_root_directory(directory);
+        flat.open();
+        for(size_t index = 0; index < 2; index++)
+        {
+            bucket.clear_records();
+            bucket.add_records()->set_email(hashes[index]);
+            flat.store(hashes[index],bucket);
+        }
+    }
+
+    // The flat bucket 1 sits where the fan-out directory 1 goes
+    rmp::bucket_store store;
+    store.set_root_directory(directory);
+    store.set_layout(layout);
+    ASSERT_NO_THROW(store.open());
+    bucket.clear_records();
+    bucket.add_records()->set_email(hashes[2]);
+    store.store(hashes[2],bucket);
+    for(int wait = 0; wait < 100 && store.migrating(); wait++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_FALSE(store.migrating());
+    EXPECT_FALSE(store.migration_failed());
+    for(const std::string& hash : hashes)
+    {
+        store.load(hash,bucket);
+        ASSERT_EQ(bucket.records_size(),1);
+        EXPECT_EQ(bucket.records(0).email(),hash);
+        EXPECT_TRUE(std::ifstream(
+            std::string(directory) + "/" + layout.path(hash)).good());
+    }
+    EXPECT_EQ(layout.path("1"),"0/0/1");
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(layout_migrator_test,failed_move_test)
+{
+    char directory[] = "/tmp/rmp-layout-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    std::string root = directory;
+    rmp::bucket_layout layout = rmp::bucket_layout::parse("1x2");
+    std::atomic<int> finished(-1);
+    std::ofstream(root + "/deadbeef") << "bucket";
+    std::ofstream(root + "/12345678") << "bucket";
+    // A directory in the way makes the rename fail with EISDIR
+    ASSERT_EQ(mkdir((root + "/de").c_str(),0755),0);
+    ASSERT_EQ(mkdir((root + "/de/deadbeef").c_str(),0755),0);
+    std::ofstream(root + "/de/deadbeef/obstacle") << "obstacle";
+    {
+        rmp::layout_migrator migrator(root,layout,2);
+        migrator.start([&](bool complete)
+        {
+            finished = complete ? 1 : 0;
+        });
+        for(int wait = 0; wait < 100 && finished < 0; wait++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        EXPECT_EQ(finished.load(),0);
+        EXPECT_EQ(migrator.failed(),1u);
+        EXPECT_FALSE(migrator.done());
+    }
+    // The flat bucket is still there and the layout was not switched
+    EXPECT_TRUE(std::ifstream(root + "/deadbeef").good());
+    EXPECT_TRUE(std::ifstream(root + "/12/12345678").good());
+    EXPECT_EQ(rmp::bucket_layout::load(root).name(),"flat");
+
+    EXPECT_EQ(std::system(("rm -rf " + root + "/de/deadbeef").c_str()),0);
+    finished = -1;
+    {
+        rmp::layout_migrator migrator(root,layout,2);
+        migrator.start([&](bool complete)
+        {
+            finished = complete ? 1 : 0;
+        });
+        for(int wait = 0; wait < 100 && finished < 0; wait++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        EXPECT_EQ(finished.load(),1);
+        EXPECT_TRUE(migrator.done());
+    }
+    EXPECT_TRUE(std::ifstream(root + "/de/deadbeef").good());
+    EXPECT_EQ(rmp::bucket_layout::load(root).name(),"1x2");
+    EXPECT_EQ(std::system(("rm -rf " + root).c_str()),0);
+}
+
+TEST(histogram_test,percentile_test)
+{
+    rmp::histogram values, merged;
+    for(uint64_t value = 1; value <= 10000; value++)
+    {
+        values.record(value);
+    }
+    merged.merge(values);
+    EXPECT_EQ(merged.count(),10000u);
+    EXPECT_EQ(merged.max(),10000u);
+    // Buckets are within about 3% of the values they hold
+    EXPECT_NEAR(merged.percentile(50),5000,5000 * 0.04);
+    EXPECT_NEAR(merged.percentile(99),9900,9900 * 0.04);
+    EXPECT_EQ(merged.percentile(100),10000u);
+}
+
+TEST_F(rmp_test,stats_test)
+{
+    std::pair<bool,std::string> result;
+    result = _client->read_record("nobody@example.com");
+    EXPECT_FALSE(result.first);
+    result = _client->server_statistics();
+    EXPECT_TRUE(result.first);
+    EXPECT_NE(result.second.find("requests "),std::string::npos);
+    EXPECT_NE(result.second.find("read count="),std::string::npos);
+    EXPECT_NE(
+        result.second.find("request_queue_enqueued "),
+        std::string::npos);
+    EXPECT_NE(
+        result.second.find("response_queue_stalls "),
+        std::string::npos);
+    EXPECT_NE(result.second.find("numa_"),std::string::npos);
+}
+
+TEST_F(rmp_test,arena_steady_state_test)
+{
+    std::pair<bool,std::string> result;
+    std::string before, after;
+    rmp::info info;
+    info.set_name("Arena");
+    _client->create_record("arena@example.com",info);
+    // The first rounds warm up every loop and worker arena
+    for(int round = 0; round < 3; round++)
+    {
+        for(int index = 0; index < 200; index++)
+        {
+            result = _client->read_record("arena@example.com");
+            EXPECT_TRUE(result.first);
+        }
+        result = _client->server_statistics();
+        ASSERT_TRUE(result.first);
+        before = after;
+        after = result.second.substr(
+            result.second.find("arena_allocations "));
+        after = after.substr(0,after.find('\n'));
+    }
+    EXPECT_NE(after,"");
+    EXPECT_EQ(before,after);
+    _client->delete_record("arena@example.com");
+}
+
+TEST_F(rmp_test,export_test)
+{
+    char path[] = "/tmp/rmp_export_XXXXXX";
+    int descriptor = mkstemp(path);
+    std::pair<bool,std::string> result;
+    std::vector<std::thread> threads;
+    std::atomic<bool> running(true);
+    std::atomic<int> started(0);
+    std::ifstream file;
+    uint32_t size;
+    std::string data;
+    rmp::record record;
+    std::set<std::string> emails;
+    size_t exported = 0;
+    rmp::info info;
+    ASSERT_NE(descriptor,-1);
+    close(descriptor);
+    info.set_name("0");
+    for(int index = 0; index < 100; index++)
+    {
+        _client->create_record(
+            "export" + std::to_string(index) + "@example.com",info);
+    }
+    for(int writer = 0; writer < 2; writer++)
+    {
+        threads.emplace_back([&running,&started,writer]()
+        {
+            rmp::client client("127.0.0.1",12345);
+            rmp::info update;
+            for(int round = 1; running; round++)
+            {
+                update.set_name(std::to_string(round));
+                client.update_record(
+                    "export" + std::to_string(writer) + "@example.com",
+                    update);
+                started += (round == 1);
+            }
+        });
+    }
+    while(started < 2)
+    {
+        std::this_thread::yield();
+    }
+    result = _client->export_records(path);
+    running = false;
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    for(int index = 0; index < 100; index++)
+    {
+        _client->delete_record(
+            "export" + std::to_string(index) + "@example.com");
+    }
+    if(!result.first)
+    {
+        unlink(path);
+        // Only servers without the memory tier or with shards refuse
+        EXPECT_TRUE(
+            result.second == "Export requires the memory tier"
+            || result.second == "Export is not available with shards");
+        GTEST_SKIP() << result.second;
+    }
+    // Every record is whole, and the ones created before the export are
+    // all in it while the writers kept updating two of them
+    file.open(path, std::ios::binary);
+    while(file.read(reinterpret_cast<char*>(&size), sizeof(size)))
+    {
+        data.resize(size);
+        ASSERT_TRUE(file.read(&data[0], size));
+        ASSERT_TRUE(record.ParseFromString(data));
+        emails.insert(record.email());
+        exported++;
+    }
+    EXPECT_TRUE(file.eof());
+    EXPECT_EQ(
+        result.second,
+        "Exported " + std::to_string(exported) + " records");
+    EXPECT_EQ(emails.size(),exported);
+    for(int index = 0; index < 100; index++)
+    {
+        EXPECT_EQ(
+            emails.count("export" + std::to_string(index) + "@example.com"),
+            1u);
+    }
+    unlink(path);
+}
+
+TEST(tracer_test,sample_test)
+{
+    char path[] = "/tmp/rmp_trace_XXXXXX";
+    int descriptor = mkstemp(path);
+    std::stringstream contents;
+    size_t traced = 0;
+    ASSERT_NE(descriptor,-1);
+    close(descriptor);
+    EXPECT_EQ(rmp::tracer::begin(),nullptr);
+    rmp::tracer::enable(path,4);
+    for(int index = 0; index < 8; index++)
+    {
+        if(rmp::tracer::begin() != nullptr)
+        {
+            traced++;
+            {
+                rmp::trace_phase phase(rmp::trace_phases::TRACE_PARSE);
+            }
+            rmp::tracer::active()->command = rmp::command_codes::READ_RECORD;
+            rmp::tracer::end(rmp::tracer::detach());
+        }
+    }
+    rmp::tracer::disable();
+    EXPECT_EQ(traced,2u);
+    EXPECT_EQ(rmp::tracer::active(),nullptr);
+    contents << std::ifstream(path).rdbuf();
+    EXPECT_EQ(contents.str().front(),'[');
+    EXPECT_NE(contents.str().find("\"name\":\"read\""),std::string::npos);
+    EXPECT_NE(contents.str().find("\"name\":\"parse\""),std::string::npos);
+    EXPECT_NE(contents.str().find("]"),std::string::npos);
+    EXPECT_STREQ(
+        rmp::tracer::command_name(rmp::command_codes::LOCKS),
+        "locks");
+    EXPECT_STREQ(rmp::tracer::command_name(-1),"request");
+    unlink(path);
+}
+
+TEST(lock_profile_test,top_test)
+{
+    rmp::lock_profile profile;
+    std::vector<rmp::lock_contention> top;
+    // Fill every entry once, then push one hash well past the rest
+    for(size_t index = 0; index < rmp::LOCK_PROFILE_ENTRIES; index++)
+    {
+        profile.contended(std::to_string(index),1000);
+    }
+    for(int count = 0; count < 10; count++)
+    {
+        profile.contended("hot",2000);
+    }
+    profile.held("hot",500);
+    profile.held("untracked",500);
+    top = profile.top(2);
+    ASSERT_EQ(top.size(),2u);
+    EXPECT_EQ(top[0].hash,"hot");
+    // It replaced an entry contended once, which bounds its error
+    EXPECT_EQ(top[0].contentions,11u);
+    EXPECT_EQ(top[0].error,1u);
+    EXPECT_EQ(top[0].wait_max,2000u);
+    EXPECT_EQ(top[0].holds,1u);
+    EXPECT_EQ(top[1].contentions,1u);
+    EXPECT_NE(profile.report().find("hot contentions=11"),std::string::npos);
+}
+
+TEST(slow_log_test,rotate_test)
+{
+    char directory[] = "/tmp/rmp-slow-XXXXXX";
+    ASSERT_NE(mkdtemp(directory),nullptr);
+    std::string path = std::string(directory) + "/slow.log";
+    rmp::request request;
+    std::stringstream contents;
+    request.set_command(rmp::command_codes::READ_RECORD);
+    request.mutable_payload()->set_email("slow@example.com");
+    // Every request is slow at a zero threshold, and each line rotates
+    rmp::slow_log::enable(path,0,1);
+    for(int index = 0; index < 3; index++)
+    {
+        rmp::slow_log::begin(request);
+        {
+            rmp::trace_phase phase(rmp::trace_phases::TRACE_FIND_RECORD);
+        }
+        rmp::slow_log::end(10);
+        // The writer rotates after each batch it drains
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+    rmp::slow_log::disable();
+    EXPECT_EQ(rmp::slow_log::recording(),false);
+    contents << std::ifstream(path + ".1").rdbuf();
+    EXPECT_NE(contents.str().find("command=read"),std::string::npos);
+    EXPECT_NE(
+        contents.str().find("hash=" + rmp::djb_hash("slow@example.com")),
+        std::string::npos);
+    EXPECT_NE(contents.str().find("response_bytes=10"),std::string::npos);
+    EXPECT_TRUE(std::ifstream(path + ".3").good());
+    EXPECT_FALSE(std::ifstream(path + ".4").good());
+    EXPECT_EQ(std::system(("rm -rf " + std::string(directory)).c_str()),0);
+}
+
+TEST(memory_test,reclaim_test)
+{
+    rmp::aligned_allocator allocator;
+    rmp::page_cache cache(16 << 20);
+    uint64_t before = rmp::statistics::memory(
+        rmp::memory_subsystems::MEMORY_CACHE);
+    for(int index = 0; index < 64; index++)
+    {
+        cache.insert(
+            std::to_string(index),
+            std::make_shared<rmp::aligned_buffer>(allocator,64 << 10));
+    }
+    EXPECT_EQ(
+        rmp::statistics::memory(rmp::memory_subsystems::MEMORY_CACHE),
+        before + (4 << 20));
+    // Over the limit the cache gives back the excess before anything is
+    // refused
+    rmp::statistics::set_memory_limit(rmp::statistics::memory() - (1 << 20));
+    EXPECT_FALSE(rmp::statistics::over_limit());
+    EXPECT_EQ(cache.size(),3u << 20);
+    rmp::statistics::set_memory_limit(0);
+}
+
+TEST(statistics_test,exited_threads_test)
+{
+    std::vector<std::thread> threads;
+    std::string report = rmp::statistics::report();
+    uint64_t requests = std::stoull(
+        report.substr(report.find("requests ") + 9));
+    uint64_t before = rmp::statistics::memory(
+        rmp::memory_subsystems::MEMORY_MESSAGES);
+    for(int index = 0; index < 8; index++)
+    {
+        threads.emplace_back([]()
+        {
+            rmp::statistics::add(rmp::statistics::local().requests,5);
+            rmp::statistics::allocate(
+                rmp::memory_subsystems::MEMORY_MESSAGES,
+                1000);
+        });
+    }
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    // The exited threads' counts survive them and still sum with frees on
+    // other threads
+    report = rmp::statistics::report();
+    EXPECT_EQ(
+        std::stoull(report.substr(report.find("requests ") + 9)),
+        requests + 40);
+    rmp::statistics::release(rmp::memory_subsystems::MEMORY_MESSAGES,8000);
+    EXPECT_EQ(
+        rmp::statistics::memory(rmp::memory_subsystems::MEMORY_MESSAGES),
+        before);
+}
+
+TEST(histogram_test,expected_interval_test)
+{
+    rmp::histogram values;
+    // A 10ms stall with 1ms expected between samples hides 9 of them
+    values.record(10000,1000);
+    EXPECT_EQ(values.count(),10u);
+    EXPECT_EQ(values.max(),10000u);
+    EXPECT_NEAR(values.percentile(0),1000,1000 * 0.04);
+    values.record(500,1000);
+    EXPECT_EQ(values.count(),11u);
+}
+
+TEST(zipfian_test,skew_test)
+{
+    std::mt19937_64 random(1);
+    rmp::zipfian_generator zipfian(1000,0.99);
+    rmp::zipfian_generator uniform(1000,0.0);
+    size_t hot = 0, flat = 0;
+    for(int index = 0; index < 10000; index++)
+    {
+        hot += (zipfian.next(random) < 10) ? 1 : 0;
+        flat += (uniform.next(random) < 10) ? 1 : 0;
+    }
+    // The top 1% of keys draw far more than 1% of a skewed workload
+    EXPECT_GT(hot,3000u);
+    EXPECT_LT(flat,300u);
+    EXPECT_THROW(rmp::zipfian_generator(1000,1.0),std::invalid_argument);
 }
\ No newline at end of file